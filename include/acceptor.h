@@ -0,0 +1,19 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+/*
+ * Multiple acceptors.
+ *
+ * Instead of one accept loop in the main thread, several threads each accept
+ * from a listening socket of their own, all bound to the same port with
+ * SO_REUSEPORT.  The kernel spreads incoming connections among the sockets,
+ * and each acceptor thread is pinned to a CPU, so that accepting scales with
+ * the number of cores.  Accepted connections are served as without acceptors:
+ * by a thread each, or by the worker pool.
+ */
+
+int *acceptors_listen(char *port, int num_acceptors);
+void acceptors_start(int *listenfds, int num_acceptors);
+void acceptor_pin_cpu(int cpu);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef CAMP_H
+#define CAMP_H
+
+#include "pbx.h"
+
+/*
+ * Camp-on: "camp <ext>" places a call like "dial <ext>", except that when the
+ * line is busy, the caller waits for it instead of having to hang up and dial
+ * again.  The caller hears a busy signal while it waits, and is rung back,
+ * going to RING BACK while the line rings, as soon as the line goes back on
+ * hook; callers waiting for the same line are served in the order they
+ * camped.  Hanging up stops waiting.
+ */
+
+int pbx_camp(PBX *pbx, TU *tu, int ext);
+int tu_camp(TU *tu, TU *target);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "tu.h"
+#include "csapp.h"
+
+/*
+ * Handling of a client connection, independent of how the connection is
+ * served (a thread per connection, or an event loop).
+ */
+
+#define CLIENT_ACCEPT_PAUSE_MS 10   // How long accepting stops after a shortage of descriptors or memory.
+
+typedef enum client_cmd {           // The commands a client can send, as parsed by client_parse().
+    CLIENT_PICKUP, CLIENT_HANGUP, CLIENT_DIAL, CLIENT_CHAT,
+    CLIENT_CAMP, CLIENT_JOIN, CLIENT_CONF, CLIENT_UNKNOWN
+} CLIENT_CMD;
+
+int client_accept_failed(int err);
+int client_accept(int listenfd, SA *addr, socklen_t *addrlen);
+TU *client_open(int connfd, int *extp);
+CLIENT_CMD client_parse(char *line, size_t len, int *argp);
+void client_line(TU *tu, char *line, size_t len);
+size_t client_input(TU *tu, char *buf, size_t len, size_t size);
+void client_close(TU *tu, int ext, int connfd);
+void client_serve(int connfd);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CONF_H
+#define CONF_H
+
+#include "pbx.h"
+#include "outq.h"
+
+/*
+ * Conference rooms: "conf <room>" takes a TU that hears a dial tone into a
+ * room, identified by any number, which is opened when its first member joins
+ * and closed when its last one leaves.  While in a room, the TU stays in
+ * TU_DIAL_TONE as far as calls are concerned, so that it is busy to callers,
+ * and its chat goes to every other member of the room as "CHAT <msg>".  Any
+ * command that takes it out of TU_DIAL_TONE, such as hanging up or dialing,
+ * takes it out of the room as well.
+ *
+ * A message is written to the output queue of each member as it was received,
+ * behind a constant prefix, without being copied, and without a lock of the
+ * room or of any TU; the members of a room are read under epoch protection,
+ * from an array that is copied whenever a member joins or leaves.  When a
+ * client's batch of commands sends more than one message to a room, the
+ * members' queues are corked from the second message on, so that each member
+ * gets the lot in one vectored write.  That is done for the first
+ * CONF_BATCH_ROOMS rooms a batch sends to.  A client is in one room at a time,
+ * so its batch only reaches more if it moves from room to room, and then each
+ * message to the others is written to their members at once.  A member too slow
+ * to keep up is disconnected when its queue overflows, like any client.
+ */
+#define CONF_BATCH_ROOMS 4  // Most rooms a batch of commands holds back output for.
+
+typedef struct conf_room CONF_ROOM;
+
+CONF_ROOM *conf_join(int number, OUTQ *outq);
+void conf_leave(CONF_ROOM *room, OUTQ *outq);
+void conf_say(CONF_ROOM *room, OUTQ *from, const char *msg, int batched);
+void conf_flush(void);
+
+int pbx_conf(PBX *pbx, TU *tu, int room);
+int tu_conf(TU *tu, int room);
+
+#endif
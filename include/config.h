@@ -0,0 +1,42 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+/*
+ * Tunable parameters of the PBX server.
+ * They are given their default values in config.c and may be changed by
+ * command-line options in main() before the PBX is initialized.
+ */
+struct pbx_config {
+    int num_shards;         // Number of registry shards (-s).
+    int first_ext;          // Lowest extension number handed out (-x).
+    int last_ext;           // Highest extension number handed out (-x).
+    size_t outq_size;       // Most output queued for a client before it is disconnected (-q).
+    int pool_prefill;       // Objects of each kind allocated up front by the pools (-P).
+    int event_loops;        // Number of epoll event loops, or 0 for a thread per connection (-e).
+    int workers;            // Number of pooled worker threads, or 0 for a thread per connection (-w).
+    int acceptors;          // Number of SO_REUSEPORT listening sockets and accept threads, or 0 for one (-a).
+    int uring_loops;        // Number of io_uring loops, or 0 for none (-u).
+    int ring_timeout;       // Milliseconds a call may ring unanswered, or 0 for no limit (-R).
+    int idle_timeout;       // Milliseconds a client may send nothing before it is disconnected, or 0 for no limit (-I).
+};
+
+/*
+ * Default values of the tunable parameters.
+ */
+#define PBX_DEFAULT_SHARDS 16
+#define PBX_DEFAULT_FIRST_EXT 1
+#define PBX_DEFAULT_LAST_EXT 99999
+#define PBX_DEFAULT_OUTQ_SIZE (64 * 1024)
+#define PBX_DEFAULT_POOL_PREFILL 0
+#define PBX_DEFAULT_EVENT_LOOPS 0
+#define PBX_DEFAULT_WORKERS 0
+#define PBX_DEFAULT_ACCEPTORS 0
+#define PBX_DEFAULT_URING_LOOPS 0
+#define PBX_DEFAULT_RING_TIMEOUT 0
+#define PBX_DEFAULT_IDLE_TIMEOUT 0
+
+extern struct pbx_config pbx_config;
+
+#endif
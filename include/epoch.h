@@ -0,0 +1,30 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation for objects that are read without a lock.
+ *
+ * A thread that follows pointers into a shared structure brackets the
+ * accesses with epoch_enter() and epoch_leave().  A writer that unlinks an
+ * object from the structure hands it to epoch_retire() instead of freeing
+ * it; the reclaim function runs only once every thread that could still
+ * hold a pointer to the object has left its critical section.
+ *
+ * Critical sections nest, and they may block, but a thread that stays
+ * inside one holds back reclamation for everybody.
+ */
+
+/*
+ * Link embedded in every object that can be retired.
+ */
+struct epoch_entry {
+    struct epoch_entry *next;                   // Next entry in the same retire list.
+    void (*reclaim)(struct epoch_entry *);      // Frees the object that embeds this entry.
+};
+
+void epoch_enter(void);
+void epoch_leave(void);
+void epoch_retire(struct epoch_entry *entry, void (*reclaim)(struct epoch_entry *));
+void epoch_drain(void);
+
+#endif
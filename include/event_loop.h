@@ -0,0 +1,16 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/*
+ * Event-loop server mode.
+ *
+ * Instead of a thread per connection, a fixed number of threads each run an
+ * epoll loop over non-blocking sockets.  Every loop accepts connections from
+ * the shared listening socket and then serves them itself.  With several
+ * SO_REUSEPORT listening sockets (see acceptor.h), the loops are spread over
+ * them and each loop is pinned to a CPU.
+ */
+
+void event_loops_start(int *listenfds, int num_listenfds, int num_loops);
+
+#endif
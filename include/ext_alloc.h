@@ -0,0 +1,23 @@
+#ifndef EXT_ALLOC_H
+#define EXT_ALLOC_H
+
+/*
+ * Allocator of extension numbers.
+ *
+ * Extensions are handed out from a configured range [first, last], independently
+ * of the file descriptors of the underlying connections.  Free extensions are kept
+ * in FIFO order, so that a released extension is reused as late as possible.
+ * Allocation and release take constant time.
+ */
+typedef struct ext_alloc EXT_ALLOC;
+
+EXT_ALLOC *ext_alloc_init(int first, int last, int num_shards);
+int ext_alloc_get(EXT_ALLOC *ea);
+void ext_alloc_put(EXT_ALLOC *ea, int ext);
+
+/*
+ * Global allocator used by the server to number the TUs it registers.
+ */
+extern EXT_ALLOC *ext_allocator;
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef HUNT_H
+#define HUNT_H
+
+#include "pbx.h"
+
+/*
+ * Hunt groups: a pilot extension that rings an idle member of a group.
+ *
+ * Groups are defined when the server starts (-H), each with a pilot extension
+ * outside the range handed out to TUs and a policy for choosing among its idle
+ * members.  A TU joins a group with "join <pilot>", and leaves it when it is
+ * unregistered; a TU is in at most one group.  Dialing the pilot rings an idle
+ * member, that is, one that is on hook, or gives a busy signal if there is
+ * none.
+ *
+ * Each group keeps an index of its idle members, which tu_dispatch() updates
+ * whenever a member goes on or off hook, so that dialing the pilot finds an
+ * idle member without looking at the others, however many the group has.
+ */
+typedef enum hunt_policy {
+    HUNT_LINEAR,            // The idle member that joined first.
+    HUNT_ROUND_ROBIN,       // The next idle member after the one last chosen, in the order they joined.
+    HUNT_LONGEST_IDLE       // The member that has been idle longest.
+} HUNT_POLICY;
+
+#define HUNT_MAX_GROUPS 64  // Most groups a server can define.
+
+typedef struct hunt_group HUNT_GROUP;
+typedef struct hunt_member HUNT_MEMBER;
+
+int hunt_create(int pilot, HUNT_POLICY policy);
+int hunt_overlaps(int first, int last);
+HUNT_GROUP *hunt_find(int pilot);
+int hunt_dial(HUNT_GROUP *group, TU *tu);
+
+/*
+ * Membership, for tu.c.  Must be called with the lock of the member's TU held.
+ */
+HUNT_MEMBER *hunt_add(HUNT_GROUP *group, TU *tu, int idle);
+void hunt_remove(HUNT_MEMBER *member);
+void hunt_set_idle(HUNT_MEMBER *member, int idle);
+
+int pbx_join(PBX *pbx, TU *tu, int pilot);
+int tu_join(TU *tu, HUNT_GROUP *group);
+int tu_hunt(TU *tu, TU *member);
+
+#endif
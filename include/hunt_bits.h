@@ -0,0 +1,31 @@
+#ifndef HUNT_BITS_H
+#define HUNT_BITS_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical bitmap of the positions of a hunt group.
+ *
+ * The lowest of HUNT_LEVELS levels has a bit per position, and each level
+ * above a bit per word of the level below that is not empty, up to a single
+ * word.  The next position set from any position is found by going up until a
+ * word has a bit set after the position, then down, so with at most
+ * 2 * HUNT_LEVELS - 1 word operations whatever the size of the bitmap, which
+ * is why it is limited to HUNT_MAX_POSITIONS positions.  A bitmap starts out
+ * zeroed, with no positions, and only grows.
+ */
+#define HUNT_LEVELS 3           // Levels of a bitmap.
+#define HUNT_MAX_POSITIONS (1 << (6 * HUNT_LEVELS))     // Positions of a bitmap with a single word at the top: 262144.
+
+struct hunt_bits {              // A hunt_bits structure contains:
+    uint64_t *levels[HUNT_LEVELS];      // One bit per position, then one per word of the level below that is not zero,
+    int num_words;              // The number of words at the lowest level, each of 64 positions.
+};
+
+void hunt_bits_set(struct hunt_bits *bits, int pos);
+void hunt_bits_clear(struct hunt_bits *bits, int pos);
+int hunt_bits_next(struct hunt_bits *bits, int from);
+int hunt_bits_next_wrap(struct hunt_bits *bits, int from);
+void hunt_bits_grow(struct hunt_bits *bits, int num_words, int fill);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stddef.h>
+
+#include "csapp.h"
+
+/*
+ * Buffered reader of lines from a client.
+ *
+ * Input is read in chunks as large as the buffer allows.  Line terminators are
+ * found with memchr() over the whole chunk rather than byte by byte, and each
+ * line is handed out as a view into the buffer: no bytes are copied.  A line
+ * keeps its "\r\n" or "\n" terminator and is NUL-terminated in place; the view
+ * stays valid until the next call.  As with Rio_readlineb(), a line longer than
+ * LINE_READER_MAX bytes is cut, and a last line without a terminator is handed
+ * out when the client closes the connection.
+ */
+#define LINE_READER_MAX (MAXLINE - 1)   // Longest line handed out, without its NUL.
+
+typedef struct line_reader {            // A line_reader structure contains:
+    int fd;                             // The descriptor read from,
+    char *start;                        // The first byte not handed out yet,
+    char *end;                          // The end of the bytes read,
+    size_t scanned;                     // The number of bytes after 'start' known to hold no newline,
+    char *held;                         // Where a NUL stands in for a byte of the next line, or NULL,
+    char saved;                         // ... and the byte it stands in for,
+    char buf[LINE_READER_MAX + 1];      // The bytes read, with room for a terminating NUL.
+} LINE_READER;
+
+void line_reader_init(LINE_READER *lr, int fd);
+int line_reader_next(LINE_READER *lr, char **linep, size_t *lenp);
+int line_reader_ready(LINE_READER *lr);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Bounded outbound queue of a client connection.
+ *
+ * Output to a client goes through its queue and never blocks the writing
+ * thread on the client's socket: whatever the socket does not accept at once
+ * is buffered and sent later by a flusher thread.  A client that lets more
+ * than the configured amount of output pile up is disconnected.  A queue may
+ * be corked, so that a batch of writes goes out in one system call.  A write
+ * may be gathered from several buffers, which are only copied if the socket
+ * does not take them at once.
+ */
+typedef struct outq OUTQ;
+
+OUTQ *outq_init(int fd, size_t size);
+void outq_write(OUTQ *q, const void *buf, size_t len);
+void outq_writev(OUTQ *q, const struct iovec *iov, int iovcnt);
+void outq_cork(OUTQ *q);
+void outq_uncork(OUTQ *q);
+void outq_discard(OUTQ *q);
+void outq_free(OUTQ *q);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Pool allocator for fixed-size objects that are created and destroyed with
+ * every connection (TUs, registry nodes, outbound queues, ...).
+ *
+ * Each thread keeps a small cache of free objects per pool, so that most
+ * allocations and frees touch no lock at all.  A cache that runs empty or
+ * full exchanges a batch of objects with the pool's shared depot.  Objects
+ * are carved out of slabs that are never returned to malloc().  pool_alloc()
+ * exits if a slab cannot be allocated; pool_try_alloc() returns NULL instead,
+ * for callers that can refuse a connection rather than stop the server.
+ *
+ * A pool is defined statically with POOL_INITIALIZER and needs no setup.
+ * A pool of objects that every connection takes one of is defined with
+ * POOL_DEFINE instead, which also lists it for pool_prefill_all(): main()
+ * calls that for -P before accepting connections, so that a server started
+ * with -P does not call malloc() for them until that many objects are live.
+ * The alignment must be a power of two no smaller than a pointer.
+ */
+struct pool_free;
+
+typedef struct pool {
+    size_t size;                    // Size of an object, rounded up to 'align'.
+    size_t align;                   // Alignment of every object.
+    atomic_int id;                  // Index of this pool's cache in every thread, or 0 before first use.
+    int slabs;                      // Number of slabs carved so far.
+    struct pool_free *depot;        // Free objects not cached by any thread.
+    pthread_mutex_t lock;           // Protects 'slabs' and 'depot'.
+} POOL;
+
+#define POOL_ROUND(size, align) (((size) + (align) - 1) / (align) * (align))
+#define POOL_INITIALIZER(size, align) \
+    { POOL_ROUND(size, align), align, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER }
+
+/*
+ * Define a pool, as with POOL_INITIALIZER, and list it for pool_prefill_all()
+ * before main() runs.  May be preceded by 'static'; the closing declaration
+ * lets the definition end with a semicolon like any other.
+ */
+#define POOL_DEFINE(name, size, align) \
+    POOL name = POOL_INITIALIZER(size, align); \
+    static void name##_register(void) __attribute__((constructor)); \
+    static void name##_register(void) { pool_register(&name); } \
+    extern POOL name
+
+void *pool_alloc(POOL *pool);
+void *pool_try_alloc(POOL *pool);
+void pool_free(POOL *pool, void *obj);
+void pool_register(POOL *pool);
+void pool_prefill(POOL *pool, int count);
+void pool_prefill_all(int count);
+
+/*
+ * Pool of the connection contexts handed from the accept loop to the server threads.
+ */
+extern POOL conn_pool;
+
+#endif
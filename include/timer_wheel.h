@@ -0,0 +1,41 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/*
+ * Hierarchical timer wheel, with a resolution of one millisecond.
+ *
+ * A timer is embedded in the object it times.  Armed timers are linked into
+ * the slots of TIMER_LEVELS wheels of TIMER_SLOTS slots each: a slot of level 0
+ * holds the timers due in one millisecond, and a slot of each level above
+ * covers TIMER_SLOTS times as long as one of the level below.  Arming and
+ * cancelling a timer link and unlink it in constant time, whatever the number
+ * of timers armed.  Whenever level 0 comes round, the next slot of the level
+ * above is moved down, so each timer is moved at most TIMER_LEVELS-1 times.
+ *
+ * Expired timers are run by a single timer thread, one at a time, without any
+ * lock of the wheel held: a callback may arm its own or any other timer.  A
+ * timer is no longer pending when its callback runs, so timer_cancel() cannot
+ * stop a callback that has already been picked; callers must be prepared for
+ * a callback that runs after it has been cancelled or armed again.
+ */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)                       // Slots per level.
+#define TIMER_LEVELS 4
+#define TIMER_MAX_MS ((1UL << (TIMER_BITS * TIMER_LEVELS)) - 1)    // Longest delay, about 4.6 hours; longer ones are cut.
+
+typedef struct timer {                  // A timer structure contains:
+    struct timer *next;                 // Links in the list of its slot,
+    struct timer *prev;
+    unsigned long expires;              // The millisecond it is due, on the clock of timer_now(),
+    int slot;                           // The index of its slot over all levels, or -1 if it is not pending,
+    void (*fn)(struct timer *);         // The function called when it expires.
+} TIMER;
+
+void timer_init(TIMER *timer, void (*fn)(TIMER *));
+int timer_arm(TIMER *timer, unsigned long ms);
+int timer_cancel(TIMER *timer);
+int timer_pending(TIMER *timer);
+unsigned long timer_now(void);
+void timer_warp(unsigned long ms);
+
+#endif
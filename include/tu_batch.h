@@ -0,0 +1,19 @@
+#ifndef TU_BATCH_H
+#define TU_BATCH_H
+
+#include "tu.h"
+
+/*
+ * Batching of the notifications caused by a client's commands.
+ *
+ * A thread carrying out a batch of commands from one client brackets them with
+ * tu_batch_begin() and tu_batch_end().  In between, what is sent to that TU,
+ * and to every other TU the commands affect, is held back in the TUs' output
+ * queues; at the end, each TU's client gets it all in one system call.  The
+ * batch must end before the thread waits for more input.
+ */
+
+void tu_batch_begin(TU *tu);
+void tu_batch_end(void);
+
+#endif
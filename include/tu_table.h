@@ -0,0 +1,62 @@
+#ifndef TU_TABLE_H
+#define TU_TABLE_H
+
+#include "tu.h"
+#include "server.h"
+
+/*
+ * Transition table of the TU state machine.
+ *
+ * The effect of a command on a TU is determined by the state of the TU, the
+ * command, and the state of the "other" TU: the target for TU_DIAL_CMD, the
+ * current peer for the other commands, or TU_PEER_NONE if there is none.
+ * Besides the commands of the test scripts, the table has rows for camp-on and
+ * for the commands the server issues itself.  For TU_CAMP_CMD and
+ * TU_CALLBACK_CMD, the other TU is the one camped on, and for TU_HUNT_CMD, the
+ * member of a hunt group chosen to be rung.
+ * The same table drives tu_dispatch() in the server and gives the test
+ * scripts the set of states they may expect in response to a command.
+ */
+
+#define TU_NUM_STATES 7                         // Number of TU_STATE values.
+#define TU_NUM_COMMANDS 4                       // TU_PICKUP_CMD through TU_CHAT_CMD.
+#define TU_TIMEOUT_CMD TU_NUM_COMMANDS          // The call ringing a TU was not answered in time. Issued by the server, never by a client.
+#define TU_CAMP_CMD (TU_NUM_COMMANDS+1)         // Dial, and if the line is busy, wait for it.
+#define TU_CALLBACK_CMD (TU_NUM_COMMANDS+2)     // The line a TU camped on has come free. Issued by the server.
+#define TU_HUNT_CMD (TU_NUM_COMMANDS+3)         // Dial an idle member of a hunt group.
+#define TU_NUM_TABLE_COMMANDS (TU_NUM_COMMANDS+4)
+#define TU_HAS_TARGET(cmd) ((cmd) == TU_DIAL_CMD || (cmd) >= TU_CAMP_CMD)  // Whether the other TU is given, rather than the peer.
+#define TU_PEER_NONE TU_NUM_STATES              // "State" of a peer or target that does not exist.
+#define TU_NUM_PEER_STATES (TU_NUM_STATES+1)
+
+/*
+ * What a transition does.  Actions from TU_ACT_LINK on involve the other TU,
+ * whose lock is then held together with that of the TU itself.
+ */
+typedef enum tu_action {
+    TU_ACT_RETRY,       // The TUs are being paired or unpaired by another thread; look again.
+    TU_ACT_STAY,        // No effect. The current state is reported.
+    TU_ACT_IGNORE,      // No effect, and nothing is reported: the command has been overtaken.
+    TU_ACT_SELF,        // The TU alone goes to 'next'.
+    TU_ACT_LINK,        // A call is placed: the two TUs become peers.
+    TU_ACT_ANSWER,      // A ringing call is answered.
+    TU_ACT_UNLINK,      // A call that was not answered is abandoned: the TUs stop being peers.
+    TU_ACT_DISCONNECT,  // An answered call is ended: the TUs stop being peers.
+    TU_ACT_CHAT,        // A chat message is sent to the peer. States are unchanged.
+    TU_ACT_CAMP         // The TU waits in the queue of the other TU, whose state is unchanged.
+} TU_ACTION;
+
+#define TU_ACTION_PAIRED(action) ((action) >= TU_ACT_LINK)
+
+struct tu_transition {
+    unsigned char action;       // A TU_ACTION.
+    unsigned char next;         // State the TU goes to.
+    unsigned char peer_next;    // State the other TU goes to, for paired actions.
+    signed char result;         // Value returned to the caller: 0, -1 if the command failed, or TU_RESULT_MISSED.
+};
+
+#define TU_RESULT_MISSED 1      // The member of a hunt group was taken before it could be rung; nothing was done.
+
+extern const struct tu_transition tu_transitions[TU_NUM_STATES][TU_NUM_TABLE_COMMANDS][TU_NUM_PEER_STATES];
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef TU_TIMEOUT_H
+#define TU_TIMEOUT_H
+
+#include "tu.h"
+
+/*
+ * Timeouts of TUs, driven by the timer wheel.
+ *
+ * A call that rings for pbx_config.ring_timeout milliseconds without being
+ * answered is abandoned: the called TU goes back on hook, and the caller gets
+ * a dial tone again.  A client that sends nothing for pbx_config.idle_timeout
+ * milliseconds is disconnected.  A timeout of 0 disables either.  The server
+ * calls tu_touch() for every line a client sends.
+ */
+
+void tu_touch(TU *tu);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+/*
+ * io_uring server mode.
+ *
+ * Like the epoll event loops, a fixed number of threads each serve many
+ * connections, but every loop drives an io_uring instance instead: a multishot
+ * accept on the listening socket, and a multishot receive on each connection
+ * into a ring of buffers registered with the kernel.  One io_uring_enter()
+ * call submits new requests and collects the input of every connection that
+ * has some.  Output still goes through the connections' output queues.
+ *
+ * The backend is compiled in only when PBX_IO_URING is defined (make
+ * IO_URING=1).  uring_loops_start() fails, and the caller falls back to epoll,
+ * when it is not, or when the running kernel lacks what the loops need.
+ */
+
+int uring_loops_start(int *listenfds, int num_listenfds, int num_loops);
+
+#endif
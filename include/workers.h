@@ -0,0 +1,19 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/*
+ * Worker-pool server mode.
+ *
+ * A fixed number of threads is started up front.  The accept loop registers
+ * the client of each accepted connection and hands the connection to the
+ * pool, whose poller thread watches every connection with epoll.  Each time a
+ * connection has input, the poller passes it through a bounded lock-free
+ * queue to an idle worker, which carries out the complete lines it has sent
+ * and goes back to the queue.  Any number of clients can be connected; at
+ * most as many as there are workers are being served at any instant.
+ */
+
+void workers_start(int num_workers);
+void workers_submit(int connfd);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Acceptors: accept connections from several SO_REUSEPORT sockets at once.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+#include "acceptor.h"
+#include "server.h"
+#include "config.h"
+#include "pool.h"
+#include "workers.h"
+#include "client.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define ACCEPTOR_MAX_CPUS 1024      // Most CPUs an affinity mask can name.
+
+struct acceptor {                   // An acceptor structure contains:
+    int listenfd;                   // The listening descriptor of the acceptor,
+    int cpu;                        // The CPU it runs on.
+};
+
+/*
+ * Pin the calling thread to a CPU, counted modulo the CPUs online.
+ * The raw system call is used because pthread_setaffinity_np() and the
+ * CPU_SET() macros need _GNU_SOURCE, which clashes with csapp.h.
+ */
+void acceptor_pin_cpu(int cpu) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus <= 0)
+        return;
+    cpu %= (ncpus < ACCEPTOR_MAX_CPUS) ? ncpus : ACCEPTOR_MAX_CPUS;
+
+    unsigned long mask[ACCEPTOR_MAX_CPUS / (CHAR_BIT * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / (CHAR_BIT * sizeof(unsigned long))] |= 1UL << (cpu % (CHAR_BIT * sizeof(unsigned long)));
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)    // Not fatal: the thread just runs anywhere.
+        debug("Could not pin a thread to CPU %d.\n", cpu);
+}
+
+static void *acceptor_thread(void *arg) {
+    struct acceptor *acc = arg;
+    Pthread_detach(pthread_self());
+
+    sigset_t mask;                  // SIGHUP is left to the main thread.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    acceptor_pin_cpu(acc->cpu);
+
+    while (1)
+    {
+        int connfd = client_accept(acc->listenfd, NULL, NULL);
+        if (pbx_config.workers > 0)
+        {
+            workers_submit(connfd);
+            continue;
+        }
+        int *connfdp = pool_alloc(&conn_pool);    // The thread frees it, as for the main accept loop.
+        *connfdp = connfd;
+        pthread_t tid;
+        int rc;
+        if ((rc = pthread_create(&tid, NULL, pbx_client_service, connfdp)) != 0)
+            posix_error(rc, "pthread_create error");
+    }
+    return NULL;
+}
+
+/*
+ * Open the listening sockets of the acceptors, all on the same port.
+ *
+ * @return  An array of 'num_acceptors' listening descriptors.
+ */
+int *acceptors_listen(char *port, int num_acceptors) {
+    int *listenfds = Malloc(num_acceptors * sizeof(int));
+    for (int i = 0; i < num_acceptors; i++)
+        listenfds[i] = Open_listenfd_reuseport(port);
+    return listenfds;
+}
+
+/*
+ * Start an acceptor thread for each listening descriptor, the i-th one on
+ * CPU i.  They run until the process exits.
+ */
+void acceptors_start(int *listenfds, int num_acceptors) {
+    for (int i = 0; i < num_acceptors; i++)
+    {
+        struct acceptor *acc = Malloc(sizeof(struct acceptor));
+        acc->listenfd = listenfds[i];
+        acc->cpu = i;
+        pthread_t tid;
+        Pthread_create(&tid, NULL, acceptor_thread, acc);
+    }
+}
@@ -0,0 +1,220 @@
+/*
+ * Conference rooms: chat among any number of TUs.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "conf.h"
+#include "epoch.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Rooms are found by number in a hash table, whose buckets each have a lock,
+ * only when a TU joins or leaves; a member keeps a pointer to its room.  The
+ * members of a room are an array of output queues that is never changed once
+ * it is published: joining and leaving publish a new array, under the lock
+ * of the room's bucket, and retire the old one, so that broadcasters read the
+ * array without any lock.  A room that loses its last member is unlinked and
+ * retired in the same way.  The queue of a member stays valid for as long as
+ * a broadcaster that found it in the array stays in its epoch critical
+ * section, for the member's TU leaves its room before it is unregistered.
+ */
+#define CONF_BUCKETS 64                 // Buckets of the table of rooms.
+
+#define CONF_CHAT_PREFIX "CHAT "
+#define CONF_CHAT_PREFIX_LEN (sizeof(CONF_CHAT_PREFIX) - 1)
+
+struct conf_members {                   // A conf_members structure contains:
+    struct epoch_entry retire;          // Link used to defer freeing the array until no broadcaster can see it (must be first),
+    int count;                          // The number of members,
+    OUTQ *outqs[];                      // The output queues of the members.
+};
+
+typedef struct conf_room {              // A conf_room structure contains:
+    struct epoch_entry retire;          // Link used to defer freeing the room (must be first),
+    int number;                         // The number it is joined by,
+    struct conf_room *next;             // The next room in its bucket,
+    _Atomic(struct conf_members *) members;     // The current members.
+} CONF_ROOM;
+
+static struct conf_bucket {             // A conf_bucket structure contains:
+    CONF_ROOM *rooms;                   // The open rooms whose numbers hash to it,
+    sem_t lock;                         // Protects 'rooms' and the publication of their members.
+} buckets[CONF_BUCKETS];
+
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The batch of the calling thread: the rooms it has sent to since the batch
+ * began, and, for those it has sent to more than once, the members whose
+ * queues it holds corked, within an epoch critical section of its own, until
+ * conf_flush().
+ */
+static __thread struct conf_batch {     // A conf_batch structure contains:
+    int count;                          // The number of rooms sent to,
+    struct {
+        CONF_ROOM *room;                // A room sent to,
+        struct conf_members *corked;    // The members corked, or NULL.
+    } rooms[CONF_BATCH_ROOMS];
+} conf_batch;
+
+static void conf_start(void) {
+    for (int i = 0; i < CONF_BUCKETS; i++)
+        Sem_init(&(buckets[i].lock), 0, 1);
+}
+
+static struct conf_bucket *conf_bucket(int number) {
+    return &buckets[(unsigned int) number % CONF_BUCKETS];
+}
+
+static void conf_reclaim(struct epoch_entry *entry) {
+    free(entry);                        // Rooms and arrays both start with their link.
+}
+
+static struct conf_members *conf_members_new(int count) {
+    struct conf_members *members = Malloc(sizeof(struct conf_members) + count * sizeof(OUTQ *));
+    members->count = count;
+    return members;
+}
+
+/*
+ * Add the output queue of a TU to a room, opening the room if needed.
+ *
+ * @param number  The number of the room.
+ * @param outq  The output queue of the TU.
+ * @return the room, which the TU must leave with conf_leave().
+ */
+CONF_ROOM *conf_join(int number, OUTQ *outq) {
+    Pthread_once(&conf_once, conf_start);
+    struct conf_bucket *bucket = conf_bucket(number);
+    P(&(bucket->lock));
+    CONF_ROOM *room = bucket->rooms;
+    while (room != NULL && room->number != number)
+        room = room->next;
+    struct conf_members *old = NULL;
+    if (room == NULL)
+    {
+        debug("Opening conference room %d.\n", number);
+        room = Malloc(sizeof(CONF_ROOM));
+        room->number = number;
+        room->next = bucket->rooms;
+        atomic_init(&(room->members), NULL);
+        bucket->rooms = room;
+    }
+    else
+        old = atomic_load_explicit(&(room->members), memory_order_relaxed);    // Writers are excluded.
+    int count = (old != NULL) ? old->count : 0;
+    struct conf_members *members = conf_members_new(count + 1);
+    if (old != NULL)
+        memcpy(members->outqs, old->outqs, count * sizeof(OUTQ *));
+    members->outqs[count] = outq;
+    atomic_store_explicit(&(room->members), members, memory_order_release);
+    V(&(bucket->lock));
+    if (old != NULL)
+        epoch_retire(&(old->retire), conf_reclaim);
+    return room;
+}
+
+/*
+ * Take the output queue of a TU out of a room, closing the room if it was the
+ * last member.
+ */
+void conf_leave(CONF_ROOM *room, OUTQ *outq) {
+    struct conf_bucket *bucket = conf_bucket(room->number);
+    P(&(bucket->lock));
+    struct conf_members *old = atomic_load_explicit(&(room->members), memory_order_relaxed);
+    if (old->count == 1)
+    {
+        debug("Closing conference room %d.\n", room->number);
+        CONF_ROOM **prev = &(bucket->rooms);
+        while (*prev != room)
+            prev = &((*prev)->next);
+        *prev = room->next;
+        V(&(bucket->lock));
+        epoch_retire(&(old->retire), conf_reclaim);
+        epoch_retire(&(room->retire), conf_reclaim);
+        return;
+    }
+    struct conf_members *members = conf_members_new(old->count - 1);
+    int j = 0;
+    for (int i = 0; i < old->count; i++)
+        if (old->outqs[i] != outq && j < members->count)
+            members->outqs[j++] = old->outqs[i];
+    atomic_store_explicit(&(room->members), members, memory_order_release);
+    V(&(bucket->lock));
+    epoch_retire(&(old->retire), conf_reclaim);
+}
+
+/*
+ * Note that the calling thread's batch sends to a room, and from the second
+ * time on, hold back the output of the members until the batch ends.  Only
+ * the first CONF_BATCH_ROOMS rooms of a batch are noted; messages to any
+ * others go out at once, each in a write of its own to every member.
+ */
+static void conf_batch_add(CONF_ROOM *room) {
+    for (int i = 0; i < conf_batch.count; i++)
+    {
+        if (conf_batch.rooms[i].room != room)
+            continue;
+        if (conf_batch.rooms[i].corked == NULL)
+        {
+            epoch_enter();              // Left by conf_flush(), once the queues have been uncorked.
+            struct conf_members *members = atomic_load_explicit(&(room->members), memory_order_acquire);
+            for (int j = 0; j < members->count; j++)
+                outq_cork(members->outqs[j]);
+            conf_batch.rooms[i].corked = members;
+        }
+        return;
+    }
+    if (conf_batch.count == CONF_BATCH_ROOMS)
+    {
+        debug("Batch already sends to %d rooms; not holding back output for room %d.\n",
+              CONF_BATCH_ROOMS, room->number);
+        return;
+    }
+    conf_batch.rooms[conf_batch.count].room = room;
+    conf_batch.rooms[conf_batch.count].corked = NULL;
+    conf_batch.count += 1;
+}
+
+/*
+ * Send "CHAT <msg>" to every member of a room but the sender.
+ *
+ * @param room  The room, of which the sender is a member.
+ * @param from  The output queue of the sender.
+ * @param msg  The message, with its line terminator.
+ * @param batched  Whether the sender's commands are being carried out as a
+ * batch, which must then be ended with conf_flush().
+ */
+void conf_say(CONF_ROOM *room, OUTQ *from, const char *msg, int batched) {
+    struct iovec iov[2] = {             // Built once for all members; the message is not copied.
+        { .iov_base = CONF_CHAT_PREFIX, .iov_len = CONF_CHAT_PREFIX_LEN },
+        { .iov_base = (void *) msg, .iov_len = strlen(msg) }
+    };
+    if (batched)
+        conf_batch_add(room);
+    epoch_enter();
+    struct conf_members *members = atomic_load_explicit(&(room->members), memory_order_acquire);
+    for (int i = 0; i < members->count; i++)
+        if (members->outqs[i] != from)
+            outq_writev(members->outqs[i], iov, 2);     // Each write is whole, so messages from several senders never interleave.
+    epoch_leave();
+}
+
+/*
+ * Send what the calling thread's batch held back.  Called when the batch ends.
+ */
+void conf_flush(void) {
+    for (int i = 0; i < conf_batch.count; i++)
+    {
+        struct conf_members *members = conf_batch.rooms[i].corked;
+        if (members == NULL)
+            continue;
+        for (int j = 0; j < members->count; j++)
+            outq_uncork(members->outqs[j]);
+        epoch_leave();
+    }
+    conf_batch.count = 0;
+}
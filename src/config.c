@@ -0,0 +1,18 @@
+/*
+ * Tunable parameters of the PBX server.
+ */
+#include "config.h"
+
+struct pbx_config pbx_config = {
+    .num_shards = PBX_DEFAULT_SHARDS,
+    .first_ext = PBX_DEFAULT_FIRST_EXT,
+    .last_ext = PBX_DEFAULT_LAST_EXT,
+    .outq_size = PBX_DEFAULT_OUTQ_SIZE,
+    .pool_prefill = PBX_DEFAULT_POOL_PREFILL,
+    .event_loops = PBX_DEFAULT_EVENT_LOOPS,
+    .workers = PBX_DEFAULT_WORKERS,
+    .acceptors = PBX_DEFAULT_ACCEPTORS,
+    .uring_loops = PBX_DEFAULT_URING_LOOPS,
+    .ring_timeout = PBX_DEFAULT_RING_TIMEOUT,
+    .idle_timeout = PBX_DEFAULT_IDLE_TIMEOUT,
+};
@@ -971,7 +971,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -996,6 +996,13 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Let several sockets share the port, each with its own accept queue */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval , sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1018,6 +1025,21 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port)
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but the socket is opened
+ *     with SO_REUSEPORT, so that several of them may listen on the same
+ *     port.  The kernel spreads incoming connections among them.
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1041,6 +1063,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
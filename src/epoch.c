@@ -0,0 +1,175 @@
+/*
+ * Epoch: deferred reclamation of objects unlinked from lock-free structures.
+ *
+ * There is one global epoch counter.  A thread inside a critical section
+ * publishes the epoch it observed on entry in its own record; a quiescent
+ * thread publishes 0.  The global epoch may advance from e to e+1 only once
+ * every active thread has observed e, so an object retired while the global
+ * epoch was e can no longer be reached by anybody once the epoch reaches e+2.
+ * Retired objects are kept in three lists indexed by epoch modulo 3.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#include "epoch.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define EPOCH_LISTS 3
+
+struct epoch_rec {                          // An epoch_rec structure contains:
+    atomic_ulong local;                     // The epoch observed on entry, or 0 if the thread is quiescent,
+    atomic_int in_use;                      // Whether a live thread owns this record,
+    struct epoch_rec *next;                 // Pointer to the next record in the list of all records.
+} __attribute__((aligned(64)));             // Each record sits on its own cache line.
+
+static atomic_ulong global_epoch = 1;                   // Never 0, so that 0 can mean "quiescent".
+static _Atomic(struct epoch_rec *) epoch_recs = NULL;   // All records ever created. Records are reused, never freed.
+
+static struct epoch_entry *retired[EPOCH_LISTS];        // Objects waiting for a grace period, by retire epoch.
+static int retired_cnt = 0;                             // Total number of objects in 'retired'.
+static sem_t retire_mutex;                              // Protects 'retired' and 'retired_cnt'.
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;                         // Releases a thread's record when the thread exits.
+
+static __thread struct epoch_rec *self = NULL;          // This thread's record.
+static __thread int depth = 0;                          // Nesting depth of epoch_enter() calls.
+
+static void epoch_release(void *arg) {
+    struct epoch_rec *rec = arg;
+    atomic_store(&rec->local, 0);
+    atomic_store(&rec->in_use, 0);          // Another thread may now take over this record.
+}
+
+static void epoch_init(void) {
+    Sem_init(&retire_mutex, 0, 1);
+    pthread_key_create(&epoch_key, epoch_release);
+}
+
+/*
+ * Find a free record for the calling thread, or create one.
+ */
+static struct epoch_rec *epoch_acquire(void) {
+    Pthread_once(&epoch_once, epoch_init);
+
+    for (struct epoch_rec *rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&rec->in_use, &expected, 1))     // Reuse a record left behind by an exited thread.
+        {
+            pthread_setspecific(epoch_key, rec);
+            return rec;
+        }
+    }
+
+    struct epoch_rec *rec;
+    if (posix_memalign((void **) &rec, sizeof(struct epoch_rec), sizeof(struct epoch_rec)) != 0)
+        unix_error("posix_memalign error");
+    atomic_init(&rec->local, 0);
+    atomic_init(&rec->in_use, 1);
+    rec->next = atomic_load(&epoch_recs);
+    while (!atomic_compare_exchange_weak(&epoch_recs, &rec->next, rec))    // Push the new record onto the list.
+        ;
+    pthread_setspecific(epoch_key, rec);
+    return rec;
+}
+
+/*
+ * Enter a critical section.  Pointers loaded from a shared structure stay
+ * valid until the matching epoch_leave().
+ */
+void epoch_enter(void) {
+    if (depth++ > 0)                        // Already inside; the outer section protects us.
+        return;
+    if (self == NULL)
+        self = epoch_acquire();
+    atomic_store(&self->local, atomic_load(&global_epoch));    // Sequentially consistent, so a concurrent advance cannot miss it.
+    atomic_thread_fence(memory_order_seq_cst);  // A store alone may pass the acquire loads that follow; no slot may be read before it.
+}
+
+/*
+ * Leave a critical section.
+ */
+void epoch_leave(void) {
+    if (--depth > 0)
+        return;
+    atomic_store_explicit(&self->local, 0, memory_order_release);
+}
+
+/*
+ * Try to advance the global epoch.  Must be called with 'retire_mutex' held.
+ *
+ * @return the list of entries that became safe to reclaim, or NULL.
+ */
+static struct epoch_entry *epoch_try_advance(void) {
+    unsigned long epoch = atomic_load(&global_epoch);
+
+    for (struct epoch_rec *rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next)
+    {
+        unsigned long local = atomic_load(&rec->local);
+        if (local != 0 && local != epoch)   // Some thread has not observed the current epoch yet.
+            return NULL;
+    }
+    atomic_store(&global_epoch, epoch + 1);
+
+    // Entries retired two epochs ago share a list with the next epoch; take them out before it is reused.
+    struct epoch_entry *safe = retired[(epoch + 2) % EPOCH_LISTS];
+    retired[(epoch + 2) % EPOCH_LISTS] = NULL;
+    for (struct epoch_entry *entry = safe; entry != NULL; entry = entry->next)
+        retired_cnt -= 1;
+    return safe;
+}
+
+static void epoch_reclaim(struct epoch_entry *entry) {
+    while (entry != NULL)
+    {
+        struct epoch_entry *next = entry->next;     // The reclaim function frees 'entry'.
+        entry->reclaim(entry);
+        entry = next;
+    }
+}
+
+/*
+ * Defer reclamation of an object that has already been unlinked, so that no
+ * new reader can find it.  Objects whose grace period has elapsed, this one or
+ * earlier ones, are reclaimed before returning.
+ *
+ * @param entry  The epoch_entry embedded in the object.
+ * @param reclaim  Function that frees the object.
+ */
+void epoch_retire(struct epoch_entry *entry, void (*reclaim)(struct epoch_entry *)) {
+    Pthread_once(&epoch_once, epoch_init);
+    entry->reclaim = reclaim;
+
+    P(&retire_mutex);
+    unsigned long epoch = atomic_load(&global_epoch);
+    entry->next = retired[epoch % EPOCH_LISTS];
+    retired[epoch % EPOCH_LISTS] = entry;
+    retired_cnt += 1;
+    struct epoch_entry *safe = epoch_try_advance();
+    V(&retire_mutex);
+
+    epoch_reclaim(safe);    // Run the reclaim functions without holding the lock.
+}
+
+/*
+ * Wait until every retired object has been reclaimed.  The caller must not be
+ * inside a critical section.
+ */
+void epoch_drain(void) {
+    Pthread_once(&epoch_once, epoch_init);
+    while (1)
+    {
+        P(&retire_mutex);
+        struct epoch_entry *safe = epoch_try_advance();
+        int remaining = retired_cnt;
+        V(&retire_mutex);
+
+        epoch_reclaim(safe);
+        if (remaining == 0)
+            return;
+        sched_yield();      // Let readers that are still inside leave.
+    }
+}
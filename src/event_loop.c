@@ -0,0 +1,201 @@
+/*
+ * Event loops: serve many client connections from a few threads with epoll.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+#include "client.h"
+#include "acceptor.h"
+#include "pool.h"
+#include "config.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define EVENT_BATCH 64              // Most events taken from epoll at once.
+
+struct event_conn {                 // An event_conn structure contains:
+    int fd;                         // The connected descriptor,
+    int ext;                        // The extension of its TU,
+    TU *tu;                         // The TU of the client,
+    size_t len;                     // The number of bytes in 'buf',
+    char buf[MAXLINE + 1];          // Input not yet carried out, with room for a terminating NUL.
+};
+
+struct event_loop {                 // An event_loop structure contains:
+    int epfd;                       // The epoll instance of the loop,
+    int listenfd;                   // The listening descriptor, shared with other loops,
+    int cpu;                        // The CPU the loop is pinned to, or -1,
+    long accept_resume;             // When to watch 'listenfd' again, in ms of CLOCK_MONOTONIC, or 0 if it is watched.
+};
+
+static POOL event_conn_pool = POOL_INITIALIZER(sizeof(struct event_conn), 64);
+
+static void event_watch_listenfd(struct event_loop *loop) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };    // Wake one loop per connection.
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+/*
+ * The time in milliseconds on the monotonic clock.
+ */
+static long event_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/*
+ * Stop watching the listening socket for CLIENT_ACCEPT_PAUSE_MS.  It stays
+ * readable while the shortage lasts, and would otherwise wake the loop again
+ * at once.  The loop's connections are served meanwhile.
+ */
+static void event_pause_accept(struct event_loop *loop) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listenfd, NULL);
+    loop->accept_resume = event_now_ms() + CLIENT_ACCEPT_PAUSE_MS;
+}
+
+/*
+ * Accept every pending connection and add it to the loop.
+ * The listening socket is non-blocking, and may be shared with other loops.
+ */
+static void event_accept(struct event_loop *loop) {
+    while (1)
+    {
+        int connfd = accept(loop->listenfd, NULL, NULL);
+        if (connfd < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;                             // Another loop may have taken it.
+            if (errno == EINTR || !client_accept_failed(errno))
+                continue;
+            event_pause_accept(loop);
+            return;
+        }
+        fcntl(connfd, F_SETFL, O_NONBLOCK);         // csapp.h clashes with _GNU_SOURCE, which accept4() would need.
+
+        struct event_conn *conn = pool_alloc(&event_conn_pool);
+        conn->fd = connfd;
+        conn->len = 0;
+        if ((conn->tu = client_open(connfd, &(conn->ext))) == NULL)
+        {
+            pool_free(&event_conn_pool, conn);
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)     // Out of memory: give up on this client only.
+        {
+            debug("epoll_ctl() error: %s\n", strerror(errno));
+            client_close(conn->tu, conn->ext, connfd);
+            pool_free(&event_conn_pool, conn);
+        }
+    }
+}
+
+static void event_close(struct event_loop *loop, struct event_conn *conn) {
+    debug("Closing the connection of extension %d.\n", conn->ext);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    client_close(conn->tu, conn->ext, conn->fd);
+    pool_free(&event_conn_pool, conn);
+}
+
+/*
+ * Read what the client has sent and carry out every complete line.
+ *
+ * @return 0, or -1 if the connection was closed.
+ */
+static int event_read(struct event_loop *loop, struct event_conn *conn) {
+    ssize_t n = read(conn->fd, conn->buf + conn->len, MAXLINE - 1 - conn->len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (n <= 0)                                     // EOF, or the connection failed.
+    {
+        event_close(loop, conn);
+        return -1;
+    }
+    conn->len = client_input(conn->tu, conn->buf, conn->len + n, MAXLINE - 1);
+    return 0;
+}
+
+static void *event_loop_thread(void *arg) {
+    struct event_loop *loop = arg;
+    Pthread_detach(pthread_self());
+
+    sigset_t mask;                                  // SIGHUP is left to the main thread, which shuts the loops' connections down.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (loop->cpu >= 0)
+        acceptor_pin_cpu(loop->cpu);
+
+    struct epoll_event events[EVENT_BATCH];
+    while (1)
+    {
+        int timeout = -1;
+        if (loop->accept_resume != 0)               // Accepting is paused.
+        {
+            long left = loop->accept_resume - event_now_ms();
+            if (left <= 0)
+            {
+                loop->accept_resume = 0;
+                event_watch_listenfd(loop);
+            }
+            else
+                timeout = left;
+        }
+        int n = epoll_wait(loop->epfd, events, EVENT_BATCH, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (int i = 0; i < n; i++)
+        {
+            struct event_conn *conn = events[i].data.ptr;
+            if (conn == NULL)                       // The listening socket.
+                event_accept(loop);
+            else
+                event_read(loop, conn);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the event loops.  They run until the process exits.
+ *
+ * @param listenfds  The listening descriptors, which are made non-blocking.
+ * Loop i accepts from listenfds[i % num_listenfds].
+ * @param num_listenfds  The number of listening descriptors.  If there are
+ * more than one, they are SO_REUSEPORT sockets and loop i is pinned to CPU i.
+ * @param num_loops  The number of loops, each in a thread of its own.
+ * There are at least as many loops as listening descriptors.
+ */
+void event_loops_start(int *listenfds, int num_listenfds, int num_loops) {
+    if (num_loops < num_listenfds)                  // Every socket needs a loop accepting from it.
+        num_loops = num_listenfds;
+    pool_prefill(&event_conn_pool, pbx_config.pool_prefill);   // Only this mode uses the pool, so it is not prefilled with the others.
+    for (int i = 0; i < num_listenfds; i++)
+        fcntl(listenfds[i], F_SETFL, fcntl(listenfds[i], F_GETFL) | O_NONBLOCK);
+    for (int i = 0; i < num_loops; i++)
+    {
+        struct event_loop *loop = Malloc(sizeof(struct event_loop));
+        int listenfd = listenfds[i % num_listenfds];
+        loop->listenfd = listenfd;
+        loop->cpu = (num_listenfds > 1) ? i : -1;
+        loop->accept_resume = 0;
+        if ((loop->epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        event_watch_listenfd(loop);
+        pthread_t tid;
+        Pthread_create(&tid, NULL, event_loop_thread, loop);
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * Extension allocator: hands out extension numbers from a configured range.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include "ext_alloc.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * The range is split into shards the same way as the PBX registry, by extension
+ * modulo the number of shards, so that concurrent allocations usually take
+ * different locks.  Each shard keeps its free extensions in a ring buffer.
+ *
+ * Debug builds also keep a flag per extension telling whether it is handed
+ * out, so that releasing an extension twice, which would let it be handed to
+ * two TUs at once, fails an assertion instead of going unnoticed.
+ */
+struct ext_shard {              // An ext_shard structure contains:
+    int *ring;                  // A ring buffer of free extensions,
+    int size;                   // The capacity of 'ring',
+    int head;                   // The index of the oldest free extension,
+    int count;                  // The number of free extensions in 'ring',
+#ifdef DEBUG
+    char *in_use;               // Whether each extension of the shard is handed out, by ext_alloc_index(),
+#endif
+    sem_t shard_lock;           // Protects 'ring', 'head' and 'count'.
+} __attribute__((aligned(64)));
+
+typedef struct ext_alloc {      // An ext_alloc structure contains:
+    struct ext_shard *shards;   // The shards of the range,
+    int num_shards;             // The number of shards,
+    int first;                  // The lowest extension in the range,
+    int last;                   // The highest extension in the range,
+    atomic_uint next_shard;     // The shard the next allocation starts from.
+} EXT_ALLOC;
+
+EXT_ALLOC *ext_allocator;
+
+#ifdef DEBUG
+/*
+ * @return the index of an extension among those of its shard.
+ */
+static int ext_alloc_index(EXT_ALLOC *ea, int ext) {
+    return (ext - ea->first) / ea->num_shards;
+}
+#endif
+
+/*
+ * Initialize an allocator for the extensions first..last inclusive.
+ *
+ * @return the newly initialized allocator, or NULL if initialization fails.
+ */
+EXT_ALLOC *ext_alloc_init(int first, int last, int num_shards) {
+    debug("Inside ext_alloc_init(). Range %d-%d.\n", first, last);
+    if (first < 0 || last < first || num_shards <= 0)
+        return NULL;
+
+    EXT_ALLOC *ea;
+    if ((ea = calloc(1, sizeof(EXT_ALLOC))) == NULL)
+        return NULL;
+    if (posix_memalign((void **) &(ea->shards), sizeof(struct ext_shard), num_shards * sizeof(struct ext_shard)) != 0)
+    {
+        free(ea);
+        return NULL;
+    }
+    ea->num_shards = num_shards;
+    ea->first = first;
+    ea->last = last;
+    atomic_init(&(ea->next_shard), 0);
+
+    int per_shard = (last - first) / num_shards + 1;
+    for (int i = 0; i < num_shards; i++)
+    {
+        struct ext_shard *shard = &(ea->shards[i]);
+        if ((shard->ring = malloc(per_shard * sizeof(int))) == NULL)
+        {
+            while (--i >= 0)
+                free(ea->shards[i].ring);
+            free(ea->shards);
+            free(ea);
+            return NULL;
+        }
+#ifdef DEBUG
+        shard->in_use = Calloc(per_shard, 1);  // Debug builds only; running out of memory here is fatal.
+#endif
+        shard->size = per_shard;
+        shard->head = 0;
+        shard->count = 0;
+        Sem_init(&(shard->shard_lock), 0, 1);
+    }
+    for (int ext = first; ext <= last; ext++)   // Initially every extension is free, lowest first.
+    {
+        struct ext_shard *shard = &(ea->shards[ext % num_shards]);
+        shard->ring[shard->count++] = ext;
+    }
+    return ea;
+}
+
+/*
+ * Allocate an extension.
+ *
+ * @return the extension, or -1 if every extension in the range is in use.
+ */
+int ext_alloc_get(EXT_ALLOC *ea) {
+    unsigned int start = atomic_fetch_add_explicit(&(ea->next_shard), 1, memory_order_relaxed);
+
+    for (int i = 0; i < ea->num_shards; i++)    // Spread allocations over the shards, falling back to the others when one runs dry.
+    {
+        struct ext_shard *shard = &(ea->shards[(start + i) % ea->num_shards]);
+        P(&(shard->shard_lock));
+        if (shard->count > 0)
+        {
+            int ext = shard->ring[shard->head];
+            shard->head = (shard->head + 1) % shard->size;
+            shard->count -= 1;
+#ifdef DEBUG
+            shard->in_use[ext_alloc_index(ea, ext)] = 1;
+#endif
+            V(&(shard->shard_lock));
+            return ext;
+        }
+        V(&(shard->shard_lock));
+    }
+    debug("No free extension left. Returning -1.\n");
+    return -1;
+}
+
+/*
+ * Release an extension obtained from ext_alloc_get().
+ */
+void ext_alloc_put(EXT_ALLOC *ea, int ext) {
+    if (ext < ea->first || ext > ea->last)
+        return;
+    struct ext_shard *shard = &(ea->shards[ext % ea->num_shards]);
+    P(&(shard->shard_lock));
+#ifdef DEBUG
+    assert(shard->in_use[ext_alloc_index(ea, ext)] && "extension released twice");
+    shard->in_use[ext_alloc_index(ea, ext)] = 0;
+#endif
+    shard->ring[(shard->head + shard->count) % shard->size] = ext;  // Append, so that it is reused last.
+    shard->count += 1;
+    V(&(shard->shard_lock));
+}
@@ -0,0 +1,252 @@
+/*
+ * Hunt groups: pilot extensions that ring an idle member of a group.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hunt.h"
+#include "hunt_bits.h"
+#include "tu_table.h"
+#include "pool.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Each member has a position in its group; a member that joins takes the
+ * lowest free one.  For the linear and round-robin policies, the idle members
+ * are kept as a bitmap of positions (see hunt_bits.h), in which the next idle
+ * member from any position is found in a few word operations, whatever the
+ * size of the group.  That is why a group is limited to HUNT_MAX_POSITIONS
+ * members.  For the longest-idle policy, the idle members are kept in a list
+ * in the order they became idle.  The free positions are kept as a bitmap as
+ * well.
+ *
+ * A member is only changed with the lock of its TU held, and the index of a
+ * group with the group's lock held, which is taken after any TU lock.  The
+ * groups themselves are defined before the server starts, and never change.
+ */
+#define HUNT_MIN_POSITIONS 64   // Positions of a group when its first member joins.
+
+struct hunt_member {            // A hunt_member structure contains:
+    TU *tu;                     // The member's TU,
+    HUNT_GROUP *group;          // The group it belongs to,
+    int position;               // Its position in the group,
+    int idle;                   // Whether it is in the group's index of idle members,
+    struct hunt_member *prev;   // Links in the list of idle members, for HUNT_LONGEST_IDLE.
+    struct hunt_member *next;
+};
+
+typedef struct hunt_group {     // A hunt_group structure contains:
+    int pilot;                  // The extension that is dialed to reach the group,
+    HUNT_POLICY policy;         // How an idle member is chosen,
+    HUNT_MEMBER **members;      // The members by position, or NULL for a free position,
+    int num_positions;          // The number of positions in 'members',
+    struct hunt_bits free;      // The free positions,
+    struct hunt_bits idle;      // The positions of the idle members, for HUNT_LINEAR and HUNT_ROUND_ROBIN,
+    int cursor;                 // The position after the member chosen last, for HUNT_ROUND_ROBIN,
+    HUNT_MEMBER *idle_head;     // The idle members, longest idle first, for HUNT_LONGEST_IDLE,
+    HUNT_MEMBER *idle_tail;
+    sem_t lock;                 // Protects the fields above but the first two, and the members.
+} HUNT_GROUP;
+
+static HUNT_GROUP groups[HUNT_MAX_GROUPS];
+static int num_groups = 0;
+
+static POOL member_pool = POOL_INITIALIZER(sizeof(HUNT_MEMBER), 16);
+
+/*
+ * Define a hunt group.  Must be called before the server starts.
+ *
+ * @param pilot  The extension to be dialed to reach the group.
+ * @param policy  How an idle member is chosen.
+ * @return 0 if the group was defined, -1 if the pilot is invalid or taken,
+ * or there are too many groups.
+ */
+int hunt_create(int pilot, HUNT_POLICY policy) {
+    if (pilot < 0 || hunt_find(pilot) != NULL || num_groups == HUNT_MAX_GROUPS)
+        return -1;
+    HUNT_GROUP *group = &groups[num_groups++];
+    memset(group, 0, sizeof(HUNT_GROUP));
+    group->pilot = pilot;
+    group->policy = policy;
+    Sem_init(&(group->lock), 0, 1);
+    debug("Hunt group %d created with policy %d.\n", pilot, policy);
+    return 0;
+}
+
+/*
+ * @return nonzero if the pilot of a group lies within a range of extensions.
+ */
+int hunt_overlaps(int first, int last) {
+    for (int i = 0; i < num_groups; i++)
+        if (groups[i].pilot >= first && groups[i].pilot <= last)
+            return 1;
+    return 0;
+}
+
+/*
+ * @return the group whose pilot is an extension, or NULL if it is not a pilot.
+ */
+HUNT_GROUP *hunt_find(int pilot) {
+    for (int i = 0; i < num_groups; i++)        // There are few groups, and most servers have none.
+        if (groups[i].pilot == pilot)
+            return &groups[i];
+    return NULL;
+}
+
+/*
+ * Put a member in or take it out of the index of idle members.
+ * Must be called with the lock of the group held.
+ */
+static void hunt_mark(HUNT_GROUP *group, HUNT_MEMBER *member, int idle) {
+    if (member->idle == idle)
+        return;
+    member->idle = idle;
+    if (group->policy != HUNT_LONGEST_IDLE)
+    {
+        if (idle)
+            hunt_bits_set(&(group->idle), member->position);
+        else
+            hunt_bits_clear(&(group->idle), member->position);
+    }
+    else if (idle)                              // It has been idle for the shortest time.
+    {
+        member->next = NULL;
+        member->prev = group->idle_tail;
+        if (group->idle_tail != NULL)
+            group->idle_tail->next = member;
+        else
+            group->idle_head = member;
+        group->idle_tail = member;
+    }
+    else
+    {
+        if (member->prev != NULL)
+            member->prev->next = member->next;
+        else
+            group->idle_head = member->next;
+        if (member->next != NULL)
+            member->next->prev = member->prev;
+        else
+            group->idle_tail = member->prev;
+    }
+}
+
+/*
+ * Add a TU to a group.  Must be called with the lock of the TU held.
+ *
+ * @param idle  Whether the TU is on hook.
+ * @return the TU's membership, which it keeps until hunt_remove(), or NULL if
+ * the group already has HUNT_MAX_POSITIONS members.
+ */
+HUNT_MEMBER *hunt_add(HUNT_GROUP *group, TU *tu, int idle) {
+    HUNT_MEMBER *member = pool_alloc(&member_pool);
+    member->tu = tu;
+    member->group = group;
+    member->idle = 0;
+    P(&(group->lock));
+    int pos = hunt_bits_next(&(group->free), 0);
+    if (pos == -1 && group->num_positions == HUNT_MAX_POSITIONS)
+    {
+        V(&(group->lock));
+        pool_free(&member_pool, member);
+        debug("Hunt group %d is full.\n", group->pilot);
+        return NULL;
+    }
+    if (pos == -1)                              // Every position is taken: double them.
+    {
+        int num_positions = (group->num_positions > 0) ? 2 * group->num_positions : HUNT_MIN_POSITIONS;
+        group->members = Realloc(group->members, num_positions * sizeof(HUNT_MEMBER *));
+        hunt_bits_grow(&(group->free), num_positions >> 6, 1);
+        if (group->policy != HUNT_LONGEST_IDLE)
+            hunt_bits_grow(&(group->idle), num_positions >> 6, 0);
+        pos = group->num_positions;
+        group->num_positions = num_positions;
+    }
+    hunt_bits_clear(&(group->free), pos);
+    group->members[pos] = member;
+    member->position = pos;
+    hunt_mark(group, member, idle);
+    V(&(group->lock));
+    debug("Member added to hunt group %d at position %d.\n", group->pilot, pos);
+    return member;
+}
+
+/*
+ * Take a member out of its group, and free it.  Must be called with the lock
+ * of its TU held.
+ */
+void hunt_remove(HUNT_MEMBER *member) {
+    HUNT_GROUP *group = member->group;
+    P(&(group->lock));
+    hunt_mark(group, member, 0);
+    group->members[member->position] = NULL;
+    hunt_bits_set(&(group->free), member->position);
+    V(&(group->lock));
+    pool_free(&member_pool, member);
+}
+
+/*
+ * Record whether a member is idle.  Must be called with the lock of its TU
+ * held, as its state changes.
+ */
+void hunt_set_idle(HUNT_MEMBER *member, int idle) {
+    HUNT_GROUP *group = member->group;
+    P(&(group->lock));
+    hunt_mark(group, member, idle);
+    V(&(group->lock));
+}
+
+/*
+ * Choose an idle member of a group, as its policy says.
+ *
+ * @return the member's TU, with a reference for the caller, or NULL if no
+ * member is idle.
+ */
+static TU *hunt_pick(HUNT_GROUP *group) {
+    HUNT_MEMBER *member = NULL;
+    P(&(group->lock));
+    if (group->policy == HUNT_LONGEST_IDLE)
+        member = group->idle_head;
+    else
+    {
+        int from = (group->policy == HUNT_ROUND_ROBIN) ? group->cursor : 0;
+        int pos = hunt_bits_next_wrap(&(group->idle), from);
+        if (pos != -1)
+        {
+            member = group->members[pos];
+            group->cursor = pos + 1;
+        }
+    }
+    TU *tu = NULL;
+    if (member != NULL)
+    {
+        tu = member->tu;
+        tu_ref(tu, "hunted");                   // The member stays in the group, and its TU alive, while the lock is held.
+    }
+    V(&(group->lock));
+    return tu;
+}
+
+/*
+ * Dial the pilot of a group: ring an idle member, or give a busy signal if
+ * none is idle.  A member that is taken by another call between being chosen
+ * and being rung has left the index by then, and another one is chosen.
+ *
+ * @param group  The group.
+ * @param tu  The originating TU.
+ * @return 0 if successful, -1 if the originating TU went to the TU_ERROR state.
+ */
+int hunt_dial(HUNT_GROUP *group, TU *tu) {
+    debug("Hunting in group %d.\n", group->pilot);
+    while (1)
+    {
+        TU *member = hunt_pick(group);
+        int result = tu_hunt(tu, member);
+        if (member != NULL)
+            tu_unref(member, "hunt done");
+        if (result != TU_RESULT_MISSED)
+            return result;
+    }
+}
@@ -0,0 +1,96 @@
+/*
+ * Hierarchical bitmap of the positions of a hunt group.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hunt_bits.h"
+#include "csapp.h"
+
+/*
+ * @return the number of words at a level of a bitmap.
+ */
+static int hunt_bits_words(struct hunt_bits *bits, int level) {
+    int n = bits->num_words;
+    for (int l = 0; l < level; l++)
+        n = (n + 63) >> 6;
+    return n;
+}
+
+void hunt_bits_set(struct hunt_bits *bits, int pos) {
+    for (int l = 0; l < HUNT_LEVELS; l++, pos >>= 6)    // At the next level, the position is the index of the word.
+    {
+        uint64_t *word = &(bits->levels[l][pos >> 6]);
+        int was_empty = (*word == 0);
+        *word |= (uint64_t) 1 << (pos & 63);
+        if (!was_empty)                         // The levels above already have its bit set.
+            return;
+    }
+}
+
+void hunt_bits_clear(struct hunt_bits *bits, int pos) {
+    for (int l = 0; l < HUNT_LEVELS; l++, pos >>= 6)
+    {
+        uint64_t *word = &(bits->levels[l][pos >> 6]);
+        *word &= ~((uint64_t) 1 << (pos & 63));
+        if (*word != 0)                         // The levels above keep its bit set.
+            return;
+    }
+}
+
+/*
+ * @return the lowest position set in a bitmap from 'from' on, or -1 if there is none.
+ */
+int hunt_bits_next(struct hunt_bits *bits, int from) {
+    int pos = from;
+    int l = 0;
+    while (1)                                   // Up, until a word has a bit set at or after 'pos'.
+    {
+        int w = pos >> 6;
+        if (w >= hunt_bits_words(bits, l))
+            return -1;
+        uint64_t word = bits->levels[l][w] & (~(uint64_t) 0 << (pos & 63));
+        if (word != 0)
+        {
+            pos = (w << 6) + __builtin_ctzll(word);
+            break;
+        }
+        if (++l == HUNT_LEVELS)                 // The top level is a single word.
+            return -1;
+        pos = w + 1;                            // The words after this one, at the level above.
+    }
+    while (l-- > 0)                             // Down, to the lowest position under the bit found.
+        pos = (pos << 6) + __builtin_ctzll(bits->levels[l][pos]);
+    return pos;
+}
+
+/*
+ * @return the first position set in a bitmap from 'from' on, wrapping around
+ * to the lowest one, or -1 if there is none.
+ */
+int hunt_bits_next_wrap(struct hunt_bits *bits, int from) {
+    int pos = hunt_bits_next(bits, from);
+    if (pos == -1 && from > 0)
+        pos = hunt_bits_next(bits, 0);
+    return pos;
+}
+
+/*
+ * Grow a bitmap to 'num_words' words at the lowest level.  The new positions
+ * are set if 'fill' is nonzero.
+ */
+void hunt_bits_grow(struct hunt_bits *bits, int num_words, int fill) {
+    int first = bits->num_words;
+    for (int l = 0, old = first, n = num_words; l < HUNT_LEVELS; l++)
+    {
+        bits->levels[l] = Realloc(bits->levels[l], n * sizeof(uint64_t));
+        memset(bits->levels[l] + old, 0, (n - old) * sizeof(uint64_t));
+        old = (old + 63) >> 6;
+        n = (n + 63) >> 6;
+    }
+    bits->num_words = num_words;
+    if (fill)
+        for (int pos = first << 6; pos < num_words << 6; pos++)
+            hunt_bits_set(bits, pos);
+}
@@ -0,0 +1,102 @@
+/*
+ * Buffered line reader handing out lines in place.
+ */
+#include <string.h>
+#include <errno.h>
+
+#include "line_reader.h"
+#include "debug.h"
+
+void line_reader_init(LINE_READER *lr, int fd) {
+    lr->fd = fd;
+    lr->start = lr->buf;
+    lr->end = lr->buf;
+    lr->scanned = 0;
+    lr->held = NULL;
+}
+
+/*
+ * Hand out the next line.
+ *
+ * @param linep  Where to store the start of the line, which is NUL-terminated
+ * and valid until the next call.
+ * @param lenp  Where to store the length of the line, including its terminator.
+ * @return 1 if a line was handed out, 0 at end of input, or -1 if reading failed.
+ */
+int line_reader_next(LINE_READER *lr, char **linep, size_t *lenp) {
+    if (lr->held != NULL)               // Put back the byte that the last line's NUL replaced.
+    {
+        *lr->held = lr->saved;
+        lr->held = NULL;
+    }
+
+    char *next;                         // The byte following the line.
+    while (1)
+    {
+        size_t avail = lr->end - lr->start;
+        char *nl = memchr(lr->start + lr->scanned, '\n', avail - lr->scanned);
+        if (nl != NULL)
+        {
+            next = nl + 1;
+            break;
+        }
+        if (avail == LINE_READER_MAX)   // The line does not fit: cut it.
+        {
+            next = lr->end;
+            break;
+        }
+        lr->scanned = avail;
+
+        if (lr->start != lr->buf)       // Make room for the rest of the line.
+        {
+            memmove(lr->buf, lr->start, avail);
+            lr->start = lr->buf;
+            lr->end = lr->buf + avail;
+        }
+        ssize_t n = read(lr->fd, lr->end, LINE_READER_MAX - avail);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            debug("read() error: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+        {
+            if (avail == 0)
+                return 0;
+            next = lr->end;             // The last line has no terminator.
+            break;
+        }
+        lr->end += n;
+    }
+
+    *linep = lr->start;
+    *lenp = next - lr->start;
+    lr->saved = *next;                  // 'next' is at most one past the data, which the buffer has room for.
+    lr->held = next;
+    *next = '\0';
+    lr->start = next;
+    lr->scanned = 0;
+    return 1;
+}
+
+/*
+ * Tell whether the next line can be handed out without reading.
+ *
+ * @return nonzero if a complete line is buffered.
+ */
+int line_reader_ready(LINE_READER *lr) {
+    size_t avail = lr->end - lr->start;
+    if (avail == 0)
+        return 0;
+    if (avail == LINE_READER_MAX)       // A line that long is cut.
+        return 1;
+    if (lr->held != NULL && lr->saved == '\n')  // 'held' is always 'start'.
+        return 1;
+    char *from = lr->start + ((lr->held != NULL) ? 1 : 0);
+    if (memchr(from, '\n', lr->end - from) != NULL)
+        return 1;
+    lr->scanned = avail;                // Not worth scanning again.
+    return 0;
+}
@@ -7,10 +7,21 @@
 
 #include "pbx.h"
 #include "server.h"
+#include "config.h"
+#include "ext_alloc.h"
+#include "pool.h"
+#include "event_loop.h"
+#include "workers.h"
+#include "acceptor.h"
+#include "uring_loop.h"
+#include "timer_wheel.h"
+#include "hunt.h"
+#include "client.h"
 #include "debug.h"
 #include "csapp.h"
 
 static void terminate(int status);
+static int parse_hunt(char *arg);
 
 volatile sig_atomic_t hang_up = 0;
 
@@ -19,31 +30,143 @@ void sighup_handler(int s)
 {
     debug("Inside sighup_handler\n");
     hang_up = 1;
-    terminate(EXIT_FAILURE);
+    terminate(EXIT_SUCCESS);                        // SIGHUP is how the server is asked to shut down.
 }
 
 
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-s <shards>] [-x <first>-<last>] [-q <bytes>] [-P <count>] [-e <loops>] [-w <workers>] [-a <acceptors>] [-u <loops>] [-R <ms>] [-I <ms>] [-H <pilot>[:<policy>]]...
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
+    // Option '-s <shards>' sets the number of registry shards.
+    // Option '-x <first>-<last>' sets the range of extension numbers.
+    // Option '-q <bytes>' sets how much output may be queued for a slow client.
+    // Option '-P <count>' sizes the object pools for that many connections up front.
+    // Option '-e <loops>' serves connections from that many epoll event loops instead of a thread each.
+    // Option '-w <workers>' serves connections from a pool of that many threads instead of a thread each.
+    // Option '-a <acceptors>' accepts from that many SO_REUSEPORT sockets, each on a CPU of its own.
+    // Option '-u <loops>' serves connections from that many io_uring loops, or epoll loops if io_uring is unavailable.
+    // Option '-R <ms>' abandons a call that rings that long without being answered.
+    // Option '-I <ms>' disconnects a client that sends nothing for that long.
+    // Option '-H <pilot>[:<policy>]' defines a hunt group, and may be repeated.
     int option;
     char *port;
-    while ((option = getopt(argc, argv, "p:")) != -1)
+    while ((option = getopt(argc, argv, "p:s:x:q:P:e:w:a:u:R:I:H:")) != -1)
     {
         switch(option)
         {
             case 'p':
                 port = strdup(optarg);   // Dynamically allocate memory to hold the value of optarg in 'port'.
                 break;
+            case 's':
+                if ((pbx_config.num_shards = atoi(optarg)) <= 0)    // There must be at least one shard.
+                {
+                    fprintf(stderr, "Option -s requires a positive number of shards.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'x':
+                if (sscanf(optarg, "%d-%d", &pbx_config.first_ext, &pbx_config.last_ext) != 2 ||
+                    pbx_config.first_ext < 0 || pbx_config.last_ext < pbx_config.first_ext)
+                {
+                    fprintf(stderr, "Option -x requires a range <first>-<last> of extensions.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'q':
+                if (atoi(optarg) <= 0)                              // A queue must be able to hold something.
+                {
+                    fprintf(stderr, "Option -q requires a positive number of bytes.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                pbx_config.outq_size = atoi(optarg);
+                break;
+            case 'P':
+                if ((pbx_config.pool_prefill = atoi(optarg)) < 0)
+                {
+                    fprintf(stderr, "Option -P requires a non-negative count.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'e':
+                if ((pbx_config.event_loops = atoi(optarg)) <= 0)
+                {
+                    fprintf(stderr, "Option -e requires a positive number of event loops.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'w':
+                if ((pbx_config.workers = atoi(optarg)) <= 0)
+                {
+                    fprintf(stderr, "Option -w requires a positive number of workers.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'a':
+                if ((pbx_config.acceptors = atoi(optarg)) <= 0)
+                {
+                    fprintf(stderr, "Option -a requires a positive number of acceptors.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'u':
+                if ((pbx_config.uring_loops = atoi(optarg)) <= 0)
+                {
+                    fprintf(stderr, "Option -u requires a positive number of io_uring loops.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'R':
+                if ((pbx_config.ring_timeout = atoi(optarg)) <= 0 || pbx_config.ring_timeout > TIMER_MAX_MS)
+                {
+                    fprintf(stderr, "Option -R requires a positive number of milliseconds, at most %lu.\n", TIMER_MAX_MS);
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'I':
+                if ((pbx_config.idle_timeout = atoi(optarg)) <= 0)  // Longer than the wheel's reach is fine: the timer is armed again.
+                {
+                    fprintf(stderr, "Option -I requires a positive number of milliseconds.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
+            case 'H':
+                if (parse_hunt(optarg) < 0)
+                {
+                    fprintf(stderr, "Option -H requires a new pilot extension and a policy of linear, rr or idle.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                break;
             case '?':
                 if (optopt == 'p')      // Print error messages.
                     fprintf(stderr, "Option -p requires a port.\n");
+                else if (optopt == 's')
+                    fprintf(stderr, "Option -s requires a number of shards.\n");
+                else if (optopt == 'x')
+                    fprintf(stderr, "Option -x requires a range of extensions.\n");
+                else if (optopt == 'q')
+                    fprintf(stderr, "Option -q requires a number of bytes.\n");
+                else if (optopt == 'P')
+                    fprintf(stderr, "Option -P requires a count.\n");
+                else if (optopt == 'e')
+                    fprintf(stderr, "Option -e requires a number of event loops.\n");
+                else if (optopt == 'w')
+                    fprintf(stderr, "Option -w requires a number of workers.\n");
+                else if (optopt == 'a')
+                    fprintf(stderr, "Option -a requires a number of acceptors.\n");
+                else if (optopt == 'u')
+                    fprintf(stderr, "Option -u requires a number of io_uring loops.\n");
+                else if (optopt == 'R')
+                    fprintf(stderr, "Option -R requires a ring timeout.\n");
+                else if (optopt == 'I')
+                    fprintf(stderr, "Option -I requires an idle timeout.\n");
+                else if (optopt == 'H')
+                    fprintf(stderr, "Option -H requires a hunt group.\n");
                 else
                     fprintf(stderr, "Unknown option character %c.\n", optopt);
                 exit(EXIT_SUCCESS);
@@ -54,7 +177,12 @@ int main(int argc, char* argv[]){
     }
     if (optind == 1)                    // If no command line args provided, print usage message
     {
-        fprintf(stderr, "Usage: pbx <port>.\n");
+        fprintf(stderr, "Usage: pbx -p <port> [-s <shards>] [-x <first>-<last>] [-q <bytes>] [-P <count>] [-e <loops>] [-w <workers>] [-a <acceptors>] [-u <loops>] [-R <ms>] [-I <ms>] [-H <pilot>[:<policy>]]...\n");
+        exit(EXIT_SUCCESS);
+    }
+    if (hunt_overlaps(pbx_config.first_ext, pbx_config.last_ext))     // A TU must never be registered on a pilot.
+    {
+        fprintf(stderr, "Pilot extensions must lie outside the range of extensions.\n");
         exit(EXIT_SUCCESS);
     }
     debug("port: %s\n", port);
@@ -62,6 +190,13 @@ int main(int argc, char* argv[]){
     // Perform required initialization of the PBX module.
     debug("Initializing PBX...");
     pbx = pbx_init();
+    ext_allocator = ext_alloc_init(pbx_config.first_ext, pbx_config.last_ext, pbx_config.num_shards);
+    if (pbx == NULL || ext_allocator == NULL)
+    {
+        fprintf(stderr, "Failed to initialize the PBX.\n");
+        exit(EXIT_FAILURE);
+    }
+    pool_prefill_all(pbx_config.pool_prefill);     // Size the per-connection pools for -P now, not on the first connection.
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -70,18 +205,65 @@ int main(int argc, char* argv[]){
     // shutdown of the server.
 
     Signal(SIGHUP, sighup_handler);                 // Install SIGHUP handler.
+    Signal(SIGPIPE, SIG_IGN);                       // A client that goes away must not kill the server; its send fails instead.
     
     int listenfd, *connfdp;                         // Declare the listening descriptor and a pointer to a connected descriptor.
     socklen_t clientlen;                            // Declare an int variable to get assigned the sizeof(sockadd_storage).
     struct sockaddr_storage clientaddr;             // Declare a sockaddr_storage structure variable.
     pthread_t tid;                                  // Declare a long variable that will hold the thread ID of the created thread.
 
-    listenfd = Open_listenfd(port);                 // Open a listening descriptor, 'listenfd', ready to receive connection requests.
+    if (pbx_config.workers > 0)                     // The workers serve what the accept loops accept.
+        workers_start(pbx_config.workers);
+
+    int *listenfds = &listenfd;                     // The listening descriptors the loops below accept from.
+    int num_listenfds = 1;
+    if (pbx_config.acceptors > 0)                   // Several sockets share the port, each with its own accept loop.
+    {
+        listenfds = acceptors_listen(port, pbx_config.acceptors);
+        num_listenfds = pbx_config.acceptors;
+    }
+    else
+        listenfd = Open_listenfd(port);             // Open a listening descriptor, 'listenfd', ready to receive connection requests.
+
+    if (pbx_config.uring_loops > 0)                 // The io_uring loops accept and serve every connection.
+    {
+        if (uring_loops_start(listenfds, num_listenfds, pbx_config.uring_loops) == 0)
+        {
+            while (1)
+                pause();                            // Wait for SIGHUP.
+        }
+        fprintf(stderr, "io_uring is not available; using epoll event loops.\n");
+        pbx_config.event_loops = pbx_config.uring_loops;
+    }
+
+    if (pbx_config.event_loops > 0)                 // The event loops accept and serve every connection.
+    {
+        event_loops_start(listenfds, num_listenfds, pbx_config.event_loops);
+        while (1)
+            pause();                                // Wait for SIGHUP.
+    }
+
+    if (pbx_config.acceptors > 0)
+    {
+        acceptors_start(listenfds, num_listenfds);
+        while (1)
+            pause();                                // Wait for SIGHUP.
+    }
+
+    if (pbx_config.workers > 0)                     // The main thread accepts, and the workers serve.
+    {
+        while (!hang_up)
+        {
+            clientlen = sizeof(struct sockaddr_storage);
+            int connfd = client_accept(listenfd, (SA *) &clientaddr, &clientlen);
+            workers_submit(connfd);
+        }
+    }
 
     while (!hang_up) {                                                              // Infinite loop,
         clientlen=sizeof(struct sockaddr_storage);                                  // Assign the sizeof a sockaddr_storage struct to 'clientlen'. Used in accept().
-        connfdp = Malloc(sizeof(int));                                              // We must dynamically allocate space for the connected descriptor returned by accept(). This is done to avoid a race between the assignment statement in the peer thread and the accept statement in the main thread.
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);                // The accept() function waits for a connection request to arrive on the listening descriptor, 'listenfd'. When it arrives, 'clientaddr' is filled with the client's socket address.
+        connfdp = pool_alloc(&conn_pool);                                           // We must allocate separate space for each connected descriptor returned by accept(). This is done to avoid a race between the assignment statement in the peer thread and the accept statement in the main thread.
+        *connfdp = client_accept(listenfd, (SA *) &clientaddr, &clientlen);         // The accept() function waits for a connection request to arrive on the listening descriptor, 'listenfd'. When it arrives, 'clientaddr' is filled with the client's socket address.
         int rc;
         if ((rc = pthread_create(&tid, NULL, pbx_client_service, connfdp)) != 0)    // Finally, `pthread_create` is called to create a thread with the id, 'tid'. The new thread will run the thread routine, 'pbx_client_server()' with the input arguments 'connfdp'.
         {
@@ -104,3 +286,23 @@ static void terminate(int status) {
     debug("PBX server terminating");
     exit(status);
 }
+
+/*
+ * Define the hunt group given to option -H: a pilot extension, optionally
+ * followed by ':' and the policy, "linear" (the default), "rr" or "idle".
+ *
+ * @return 0 if the group was defined, otherwise -1.
+ */
+static int parse_hunt(char *arg) {
+    int pilot, len;
+    if (sscanf(arg, "%d%n", &pilot, &len) != 1)
+        return -1;
+    char *policy = arg + len;
+    if (*policy == '\0' || strcmp(policy, ":linear") == 0)
+        return hunt_create(pilot, HUNT_LINEAR);
+    if (strcmp(policy, ":rr") == 0)
+        return hunt_create(pilot, HUNT_ROUND_ROBIN);
+    if (strcmp(policy, ":idle") == 0)
+        return hunt_create(pilot, HUNT_LONGEST_IDLE);
+    return -1;
+}
@@ -0,0 +1,441 @@
+/*
+ * Outbound queues: non-blocking output to client connections.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+#include "pool.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * A write goes straight to the socket, without blocking, when nothing is
+ * queued ahead of it; the rest is appended to the queue's ring buffer, which
+ * is allocated the first time it is needed and grows with what is queued.
+ * Rings of the initial capacity, which is all most queues ever need, come
+ * from a pool like the queues themselves; larger ones from malloc().  A
+ * queue holding data is linked into the pending list, whose descriptors the
+ * flusher thread polls for POLLOUT.  While a queue is corked, every write is
+ * appended to the ring, and the lot is sent when the last holder uncorks it.
+ * Locks are taken in the order 'pending_mutex', then a queue lock.
+ */
+#define OUTQ_MIN_RING 256       // Initial capacity of a ring buffer.
+
+typedef struct outq {           // An outq structure contains:
+    int fd;                     // The connected descriptor,
+    char *ring;                 // The ring buffer of queued output, or NULL,
+    size_t cap;                 // The capacity of 'ring',
+    size_t size;                // The most output that may be queued,
+    size_t head;                // The index of the oldest queued byte,
+    size_t len;                 // The number of queued bytes,
+    int corked;                 // The number of holders of the cork,
+    int closed;                 // Whether output is being dropped,
+    sem_t lock;                 // Protects the fields above.
+    int linked;                 // Whether the queue is in the pending list,
+    struct outq *prev;          // Links in the pending list,
+    struct outq *next;
+    unsigned long round;        // The flusher round in which the queue was last polled,
+    int poll_index;             // The index of its descriptor in that round.
+} OUTQ;
+
+static POOL_DEFINE(outq_pool, sizeof(OUTQ), 64);
+static POOL_DEFINE(outq_ring_pool, OUTQ_MIN_RING, 64);
+
+static OUTQ *pending = NULL;                // Queues that hold data.
+static sem_t pending_mutex;                 // Protects 'pending' and the 'linked', 'prev', 'next', 'round' and 'poll_index' fields.
+static int wake_fds[2];                     // Pipe that wakes the flusher when a queue is added to 'pending'.
+static pthread_once_t outq_once = PTHREAD_ONCE_INIT;
+
+static void *outq_flusher(void *arg);
+
+static void outq_start(void) {
+    Sem_init(&pending_mutex, 0, 1);
+    if (pipe(wake_fds) < 0)
+        unix_error("pipe error");
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);    // A full pipe already means the flusher will wake up.
+    pthread_t tid;
+    Pthread_create(&tid, NULL, outq_flusher, NULL);
+}
+
+/*
+ * Send as much of the vector as the socket accepts at once, in one system call.
+ * A client that has gone away raises no SIGPIPE.
+ *
+ * @return the number of bytes sent, or -1 if the connection has failed.
+ */
+static ssize_t outq_sendv(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        debug("Send to fd %d failed: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * Give up on a connection: drop its output and shut it down.  The thread or
+ * loop serving the connection then sees EOF and unregisters the client, as if
+ * it had hung up; nothing else is affected.
+ * Must be called with the lock of the queue held.
+ */
+static void outq_fail(OUTQ *q) {
+    q->closed = 1;
+    q->len = 0;
+    shutdown(q->fd, SHUT_RDWR);
+}
+
+/*
+ * Send queued output until the queue is empty or the socket is full.
+ * Output that wraps around the end of the ring goes out in the same call.
+ * Must be called with the lock of the queue held.
+ */
+static void outq_drain(OUTQ *q) {
+    while (q->len > 0)
+    {
+        struct iovec iov[2];
+        int iovcnt = 1;
+        size_t chunk = q->cap - q->head;            // Bytes up to the end of the ring.
+        if (chunk > q->len)
+            chunk = q->len;
+        iov[0].iov_base = q->ring + q->head;
+        iov[0].iov_len = chunk;
+        if (chunk < q->len)                         // The rest is at the start of the ring.
+        {
+            iov[1].iov_base = q->ring;
+            iov[1].iov_len = q->len - chunk;
+            iovcnt = 2;
+        }
+        size_t want = q->len;
+        ssize_t n = outq_sendv(q->fd, iov, iovcnt);
+        if (n < 0)
+        {
+            outq_fail(q);
+            return;
+        }
+        q->head = (q->head + n) % q->cap;
+        q->len -= n;
+        if ((size_t) n < want)
+            return;
+    }
+}
+
+static char *outq_ring_alloc(size_t cap) {
+    return (cap == OUTQ_MIN_RING) ? pool_alloc(&outq_ring_pool) : Malloc(cap);
+}
+
+static void outq_ring_free(char *ring, size_t cap) {
+    if (ring == NULL)
+        return;
+    if (cap == OUTQ_MIN_RING)
+        pool_free(&outq_ring_pool, ring);
+    else
+        free(ring);
+}
+
+/*
+ * Make room in the ring for 'len' more bytes, growing it by doubling.
+ * Must be called with the lock of the queue held, and 'len' must fit within
+ * the queue's limit.
+ */
+static void outq_reserve(OUTQ *q, size_t len) {
+    if (q->len + len <= q->cap)
+        return;
+    size_t cap = (q->cap > 0) ? q->cap : OUTQ_MIN_RING;
+    while (cap < q->len + len)
+        cap *= 2;
+    if (cap > q->size)
+        cap = q->size;
+    char *ring = outq_ring_alloc(cap);
+    if (q->len > 0)                                 // Move the queued bytes to the start of the new ring.
+    {
+        size_t chunk = q->cap - q->head;
+        if (chunk > q->len)
+            chunk = q->len;
+        memcpy(ring, q->ring + q->head, chunk);
+        memcpy(ring + chunk, q->ring, q->len - chunk);
+    }
+    outq_ring_free(q->ring, q->cap);
+    q->ring = ring;
+    q->cap = cap;
+    q->head = 0;
+}
+
+/*
+ * Add a queue that holds data to the pending list, and wake the flusher to
+ * poll it.  A queue already in the list is polled anyway, so the flusher is
+ * only woken when the queue is added.
+ */
+static void outq_link(OUTQ *q) {
+    P(&pending_mutex);
+    int added = !q->linked;
+    if (added)
+    {
+        q->linked = 1;
+        q->round = 0;
+        q->prev = NULL;
+        q->next = pending;
+        if (pending != NULL)
+            pending->prev = q;
+        pending = q;
+    }
+    V(&pending_mutex);
+    char c = 0;
+    if (added && write(wake_fds[1], &c, 1) < 0 && errno != EAGAIN)
+        unix_error("outq wake error");
+}
+
+/*
+ * Must be called with 'pending_mutex' held.
+ */
+static void outq_unlink(OUTQ *q) {
+    if (!q->linked)
+        return;
+    if (q->prev != NULL)
+        q->prev->next = q->next;
+    else
+        pending = q->next;
+    if (q->next != NULL)
+        q->next->prev = q->prev;
+    q->linked = 0;
+}
+
+/*
+ * The flusher thread.  Each round polls the descriptors of all pending queues,
+ * then drains those that became writable and drops those that became empty.
+ * A queue freed during the poll is no longer in the list afterwards, so only
+ * the list, never the poll array, is used to find queues.
+ */
+static void *outq_flusher(void *arg) {
+    Pthread_detach(pthread_self());
+    struct pollfd *fds = NULL;
+    int fds_size = 0;
+    unsigned long round = 0;
+
+    while (1)
+    {
+        P(&pending_mutex);
+        round += 1;
+        int n = 1;
+        for (OUTQ *q = pending; q != NULL; q = q->next)
+            n += 1;
+        if (n > fds_size)
+        {
+            fds_size = 2 * n;
+            fds = Realloc(fds, fds_size * sizeof(struct pollfd));
+        }
+        fds[0].fd = wake_fds[0];
+        fds[0].events = POLLIN;
+        n = 1;
+        for (OUTQ *q = pending; q != NULL; q = q->next)
+        {
+            fds[n].fd = q->fd;
+            fds[n].events = POLLOUT;
+            q->round = round;
+            q->poll_index = n++;
+        }
+        V(&pending_mutex);
+
+        if (poll(fds, n, -1) < 0 && errno != EINTR)
+            unix_error("outq poll error");
+        if (fds[0].revents & POLLIN)
+        {
+            char buf[64];
+            while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+
+        P(&pending_mutex);
+        OUTQ *next;
+        for (OUTQ *q = pending; q != NULL; q = next)
+        {
+            next = q->next;
+            if (q->round != round || fds[q->poll_index].revents == 0)
+                continue;
+            P(&(q->lock));
+            if (fds[q->poll_index].revents & (POLLERR | POLLHUP | POLLNVAL))
+                outq_fail(q);                   // Nobody will read it; the client's own thread will see EOF.
+            outq_drain(q);
+            if (q->len == 0)
+                outq_unlink(q);
+            V(&(q->lock));
+        }
+        V(&pending_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Create the outbound queue of a connection.
+ *
+ * @param fd  The connected descriptor.
+ * @param size  The most output that may be queued before the client is disconnected.
+ * @return the new queue, or NULL if there is no memory for it.
+ */
+OUTQ *outq_init(int fd, size_t size) {
+    Pthread_once(&outq_once, outq_start);
+    OUTQ *q;
+    if ((q = pool_try_alloc(&outq_pool)) == NULL)
+        return NULL;
+    memset(q, 0, sizeof(OUTQ));
+    q->fd = fd;
+    q->size = size;
+    Sem_init(&(q->lock), 0, 1);
+    return q;
+}
+
+/*
+ * Append to the ring what a socket did not take of a vector, skipping the
+ * 'skip' bytes it did take.
+ * Must be called with the lock of the queue held, and the rest must fit
+ * within the queue's limit.
+ */
+static void outq_append(OUTQ *q, const struct iovec *iov, int iovcnt, size_t skip, size_t rest) {
+    outq_reserve(q, rest);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        if (skip >= len)
+        {
+            skip -= len;
+            continue;
+        }
+        p += skip;
+        len -= skip;
+        skip = 0;
+        size_t tail = (q->head + q->len) % q->cap;
+        size_t chunk = q->cap - tail;           // Room up to the end of the ring.
+        if (chunk > len)
+            chunk = len;
+        memcpy(q->ring + tail, p, chunk);
+        memcpy(q->ring, p + chunk, len - chunk);
+        q->len += len;
+    }
+}
+
+/*
+ * Write to a connection without blocking.  Writes are sent in the order in
+ * which they are made.  If the queue would overflow, or the connection fails,
+ * its contents are dropped and the connection is shut down, which makes the
+ * client's thread see EOF.  Later writes are dropped.
+ *
+ * The parts of the vector go out as one write, in a single system call if
+ * nothing is queued ahead of them: they are only copied if the socket does
+ * not take them all at once.
+ */
+void outq_writev(OUTQ *q, const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    P(&(q->lock));
+    if (q->closed)
+    {
+        V(&(q->lock));
+        return;
+    }
+    size_t sent = 0;
+    if (q->len == 0 && q->corked == 0)      // Nothing may overtake data already queued.
+    {
+        ssize_t n = outq_sendv(q->fd, (struct iovec *) iov, iovcnt);
+        if (n < 0)
+            outq_fail(q);
+        else
+            sent = n;
+    }
+    if (sent == len || q->closed)
+    {
+        V(&(q->lock));
+        return;
+    }
+
+    if (q->len + (len - sent) > q->size)
+    {
+        debug("Outbound queue of fd %d overflowed. Disconnecting the client.\n", q->fd);
+        outq_fail(q);
+        V(&(q->lock));
+        return;
+    }
+    outq_append(q, iov, iovcnt, sent, len - sent);
+    int corked = q->corked;
+    V(&(q->lock));
+
+    if (!corked)                            // Otherwise it is sent when the queue is uncorked.
+        outq_link(q);
+}
+
+/*
+ * Write a buffer to a connection without blocking.  See outq_writev().
+ */
+void outq_write(OUTQ *q, const void *buf, size_t len) {
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+    outq_writev(q, &iov, 1);
+}
+
+/*
+ * Hold back the output of a connection, so that what is written until
+ * outq_uncork() goes out together.  Corks nest, and may be held by several
+ * threads at once; output is held back until all of them have been removed.
+ */
+void outq_cork(OUTQ *q) {
+    P(&(q->lock));
+    q->corked += 1;
+    V(&(q->lock));
+}
+
+/*
+ * Remove a cork placed by outq_cork().  When the last one goes, the output
+ * held back is sent, in as few system calls as the socket allows.
+ */
+void outq_uncork(OUTQ *q) {
+    P(&(q->lock));
+    int pending = 0;
+    if (--(q->corked) == 0 && !q->closed && q->len > 0)
+    {
+        outq_drain(q);
+        pending = (q->len > 0);
+    }
+    V(&(q->lock));
+
+    if (pending)                            // The socket is full; leave the rest to the flusher.
+        outq_link(q);
+}
+
+/*
+ * Drop queued output, and any later writes, once the client has gone away.
+ * The descriptor may be closed and reused after this returns.
+ */
+void outq_discard(OUTQ *q) {
+    P(&pending_mutex);
+    P(&(q->lock));
+    q->closed = 1;
+    q->len = 0;
+    outq_unlink(q);
+    V(&(q->lock));
+    V(&pending_mutex);
+}
+
+/*
+ * Free an outbound queue.  Nobody may write to it any more.
+ */
+void outq_free(OUTQ *q) {
+    outq_discard(q);
+    outq_ring_free(q->ring, q->cap);
+    sem_destroy(&(q->lock));
+    pool_free(&outq_pool, q);
+}
@@ -2,29 +2,75 @@
  * PBX: simulates a Private Branch Exchange.
  */
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <sys/socket.h> // For shutdown(2)
 
 #include "pbx.h"
+#include "camp.h"
+#include "hunt.h"
+#include "conf.h"
+#include "config.h"
+#include "epoch.h"
+#include "pool.h"
 #include "debug.h"
 #include "csapp.h"
 
 struct pbx_node {               // A pbx_node structure contains:
+    struct epoch_entry retire;  // Link used to defer freeing the node until no dialer can see it (must be first),
     TU *tu;                     // The TU structure associated with 'ext',
-    int ext;                    // The 'ext' associated with the TU structure,
-    struct pbx_node *next;      // Pointer to the next pbx structure in the linked list of pbx structures.
+    int ext;                    // The 'ext' associated with the TU structure.
 };
 
+static POOL_DEFINE(node_pool, sizeof(struct pbx_node), 16);
+
+struct pbx_shard {              // A pbx_shard structure contains:
+    _Atomic(struct pbx_node *) *slots;  // The slots of the extensions ext with ext % num_shards equal to this shard's index, at ext / num_shards,
+    atomic_int node_count;      // A counter for number of nodes in this shard,
+    sem_t shard_lock;           // Serializes writers of 'slots' and 'node_count'. Dialers read the slots without it.
+} __attribute__((aligned(64))); // Shards never share a cache line.
+
 typedef struct pbx{             // A pbx structure contains:
-    struct pbx_node *head;      // A head.
-    int node_count;             // A counter for number of nodes.
-    sem_t pbx_lock;             // Protect updates to pbx..
-    sem_t node_count_mutex;     // Protects updates to node_count.
+    struct pbx_shard *shards;   // The registry, partitioned by extension number,
+    int num_shards;             // The number of shards,
+    int capacity;               // The number of extensions the shards can hold,
+    atomic_int shutting_down;   // Set by pbx_shutdown() so that unregistering TUs wake it up,
+    sem_t empty;                // Posted by every pbx_unregister() during shutdown.
 } PBX;
 
-PBX *pbx;
-int pbx_read_cnt = 0;       // Read count for pbx->head.
-sem_t pbx_read_cnt_mutex;   // Mutex for pbx_read_cnt.
+/*
+ * Readers of the slots take no lock.  A writer holding the shard lock publishes
+ * a new node with a release store to its slot, and unpublishes it by storing
+ * NULL and retiring the node, which stays valid for any dialer that loaded
+ * it until that dialer leaves its epoch critical section.
+ *
+ * Registrations on different shards share nothing, so the total number of
+ * registered TUs is only computed, by pbx_count(), when somebody asks.
+ */
+
+static struct pbx_shard *pbx_shard(PBX *pbx, int ext) {
+    return &(pbx->shards[ext % pbx->num_shards]);
+}
+
+static _Atomic(struct pbx_node *) *pbx_slot(PBX *pbx, int ext) {
+    return &(pbx_shard(pbx, ext)->slots[ext / pbx->num_shards]);
+}
 
+/*
+ * Count the registered TUs by summing the per-shard counters.
+ * The result is exact only if no registration is in progress.
+ *
+ * The loads are sequentially consistent, like the decrement in
+ * pbx_unregister(): pbx_shutdown() sets 'shutting_down' and then counts, while
+ * pbx_unregister() decrements and then reads 'shutting_down', and only a
+ * single total order guarantees that at least one of them sees the other's
+ * write, so that shutdown is not left waiting for a post that never comes.
+ */
+static int pbx_count(PBX *pbx) {
+    int count = 0;
+    for (int i = 0; i < pbx->num_shards; i++)
+        count += atomic_load_explicit(&(pbx->shards[i].node_count), memory_order_seq_cst);
+    return count;
+}
 
 /*
  * Initialize a new PBX.
@@ -33,27 +79,41 @@ sem_t pbx_read_cnt_mutex;   // Mutex for pbx_read_cnt.
  */
 #if 1
 PBX *pbx_init() {
-    
+
     debug("Inside pbx_init().\n");
     debug("Initializing pbx instance.\n");
-    
+
     if ((pbx = calloc(1, sizeof(struct pbx))) == NULL)         // Dynamically allocate space for pbx instance, initializing it to 0.
     {
         debug("Error calling calloc(). Returning NULL.\n");
         return NULL;
     }
+    pbx->num_shards = pbx_config.num_shards;
+    pbx->capacity = pbx_config.last_ext + 1;   // Every extension the allocator can hand out has a slot.
+    if (posix_memalign((void **) &(pbx->shards), sizeof(struct pbx_shard), pbx->num_shards * sizeof(struct pbx_shard)) != 0)
+    {
+        debug("Error allocating the shards. Returning NULL.\n");
+        free(pbx);
+        return NULL;
+    }
 
-    Sem_init(&(pbx->pbx_lock), 0, 1);     
-    Sem_init(&(pbx->node_count_mutex), 0, 1);     
-    Sem_init(&(pbx_read_cnt_mutex), 0, 1); 
-    
-    P(&(pbx->pbx_lock));            // Write to pbx->head.
-    pbx->head = NULL;               // Initialize 'tu' member to NULL.
-    V(&(pbx->pbx_lock));
-
-    P(&(pbx->node_count_mutex));    // Write to pbx->node_count.
-    pbx->node_count = 0;            // Initialize 'node_count' member to 0.
-    V(&(pbx->node_count_mutex));
+    int slots_per_shard = (pbx->capacity + pbx->num_shards - 1) / pbx->num_shards;
+    for (int i = 0; i < pbx->num_shards; i++)
+    {
+        struct pbx_shard *shard = &(pbx->shards[i]);
+        if ((shard->slots = calloc(slots_per_shard, sizeof(*shard->slots))) == NULL)  // All slots initially free.
+        {
+            debug("Error calling calloc() for the slots of shard %d. Returning NULL.\n", i);
+            while (--i >= 0)
+                free(pbx->shards[i].slots);
+            free(pbx->shards);
+            free(pbx);
+            return NULL;
+        }
+        atomic_init(&(shard->node_count), 0);
+        Sem_init(&(shard->shard_lock), 0, 1);
+    }
+    Sem_init(&(pbx->empty), 0, 0);
 
     return pbx;
 }
@@ -72,53 +132,50 @@ PBX *pbx_init() {
 #if 1
 void pbx_shutdown(PBX *pbx) {
     debug("Inside pbx_shutdown(). Shutting down all clients.\n");
-    // P(&(shutdown_mutex));
-    
 
-    P(&(pbx->pbx_lock));                            // Writer tries to enter CS of pbx->head.
-    struct pbx_node *curr_node = pbx->head;         // Declare and assign a pbx_node pointer to point to the first pbx_node structure in the linked list.
+    atomic_store_explicit(&(pbx->shutting_down), 1, memory_order_seq_cst);     // From now on, every pbx_unregister() posts 'empty'.
 
-    // Free all tu's
-    while (curr_node != NULL)
+    for (int ext = 0; ext < pbx->capacity; ext++)
     {
-        if (curr_node->ext != -1)                       // If the TU is registered,
-        {
-            debug("curr_node->ext is not -1.\n");
-            tu_unref(curr_node->tu, "pbx_shutdown");    // Unregister a TU.
-
-            int ret;
-            if ((ret = shutdown(curr_node->ext, SHUT_RD)) == -1)    // Shutdown the connection of the TU's connected descriptor, which happens to be the same value as its 'ext' memnber. SHUT_RD means to stop receiving data for this stocket, and reject any further arriving data.
-            {
-                V(&(pbx->pbx_lock));
-                debug("shutdown() error. Returning nothing.\n");    // Return -1 if shutdown() error.
-                return;
-            }
-
-            tu_hangup(curr_node->tu);                               // Hangup the TU and free its resources.
-            free(curr_node->tu);          // Free the 'tu' member of pbx[i].
-            curr_node = curr_node->next;                            // Iterate to the next node in linked list.
-        }
-        else
+        struct pbx_shard *shard = pbx_shard(pbx, ext);
+        P(&(shard->shard_lock));                    // Keep the TU registered while its connection is shut down.
+        struct pbx_node *curr_node = atomic_load_explicit(pbx_slot(pbx, ext), memory_order_relaxed);   // Writers are excluded; no ordering needed.
+        if (curr_node != NULL)
         {
-            debug("curr_node->ext IS -1. curr_node->tu already freed.\n");
-            curr_node = curr_node->next;            // Iterate to the next node in linked list.
+            debug("Shutting down the connection of extension %d.\n", ext);
+            if (shutdown(tu_fileno(curr_node->tu), SHUT_RDWR) == -1)   // The server thread sees EOF and unregisters its TU.
+                debug("shutdown() error on extension %d.\n", ext);
         }
+        V(&(shard->shard_lock));
     }
-    // Free all pbx nodes.
-    curr_node = pbx->head;
-    while (curr_node != NULL)
+
+    while (pbx_count(pbx) > 0)
+        P(&(pbx->empty));                           // Wait for every server thread to unregister its TU.
+    epoch_drain();                                  // Reclaim the nodes of the TUs unregistered last.
+
+    for (int i = 0; i < pbx->num_shards; i++)
     {
-        struct pbx_node *tmp_node = curr_node;
-        free(tmp_node);
-        curr_node = curr_node->next;
+        sem_destroy(&(pbx->shards[i].shard_lock));
+        free(pbx->shards[i].slots);
     }
-    V(&(pbx->pbx_lock));  // Protect the update to pbx->head.
+    free(pbx->shards);
     free(pbx);  // Free pbx itself.
     debug("Finished shutting down all clients.\n");
     return;
 }
 #endif
 
+/*
+ * Free an unregistered node together with its TU, once the grace period
+ * started by pbx_unregister() has elapsed.
+ */
+static void pbx_node_reclaim(struct epoch_entry *entry) {
+    struct pbx_node *node = (struct pbx_node *) entry;     // 'retire' is the first member of the node.
+    debug("Reclaiming the node of extension %d.\n", node->ext);
+    tu_unref(node->tu, "pbx_unregister");     // The registry's reference, kept until no dialer can still see the TU.
+    pool_free(&node_pool, node);
+}
+
 /*
  * Register a telephone unit with a PBX at a specified extension number.
  * This amounts to "plugging a telephone unit into the PBX".
@@ -134,88 +191,37 @@ void pbx_shutdown(PBX *pbx) {
  * @return 0 if registration succeeds, otherwise -1.
  */
 
-void reader_enters(sem_t *mutex, PBX *pbx) {
-
-    P(mutex);
-    pbx_read_cnt += 1;              // The number of readers has increased by 1.
-    if (pbx_read_cnt == 1)
-    {
-        P(&(pbx->pbx_lock));        // Ensure no writer can enter critial section of pbx->head if there is even one reader.
-    }
-    V(mutex);       // Other readers can enter critical section of pbx_head.
-}
-
-void reader_leaves(sem_t *mutex, PBX *pbx) {
-    P(mutex);   // Reader wants to leave critical section.
-    pbx_read_cnt -= 1;          // A reader wants to leave.
-    if (pbx_read_cnt == 0)      // If no more readers left in critical section of pbx->head.
-    {
-        V(&(pbx->pbx_lock));    // Writers can enter the critial section of pbx->head.
-    }
-    V(mutex);   // Reader leaves the critial section of pbx->head.
-}
-
-
 #if 1
 int pbx_register(PBX *pbx, TU *tu, int ext) {
     debug("Inside pbx_register().\n");
 
-    struct pbx_node *new_node;  // Declare a new pbx_node.
-    if ((new_node = calloc(1, sizeof(struct pbx_node))) == NULL)  // Dynamically allocate 1 pbx_node structure.
+    if (ext < 0 || ext >= pbx->capacity)   // The extension must index a slot of the registry.
     {
-        debug("Error calling calloc(). Returning -1.\n");
+        debug("Extension %d is out of range. Returning -1.\n", ext);
         return -1;
     }
 
-    tu_ref(tu, "pbx_register");     // Increment tu->ref_cnt.
-    tu_set_extension(tu, ext);      // Assign 'ext' value to tu->connfd.
+    struct pbx_node *new_node;  // Declare a new pbx_node.
+    new_node = pool_alloc(&node_pool);  // Take a pbx_node structure from the pool.
     new_node->tu = tu;
     new_node->ext = ext;
-    new_node->next = NULL;
 
-    reader_enters(&pbx_read_cnt_mutex, pbx);
-    
-    // Reading pbx->head;
-    struct pbx_node *curr_node = pbx->head; // Assign pbx->head value to a local pbx_node pointer variable.
-
-    if (pbx->head == NULL)  // If pbx is empty.
+    struct pbx_shard *shard = pbx_shard(pbx, ext);
+    _Atomic(struct pbx_node *) *slot = pbx_slot(pbx, ext);
+    P(&(shard->shard_lock));    // Writer enters CS of the shard. Other shards are unaffected.
+    if (atomic_load_explicit(slot, memory_order_relaxed) != NULL)    // The extension is already taken.
     {
-        reader_leaves(&pbx_read_cnt_mutex, pbx);
-
-        // P(&(pbx_read_cnt_mutex));   // Reader wants to leave critical section.
-        // pbx_read_cnt -= 1;          // A reader wants to leave.
-        // if (pbx_read_cnt == 0)      // If no more readers left in critical section of pbx->head.
-        // {
-        //     V(&(pbx->pbx_lock));    // Writers can enter the critial section of pbx->head.
-        // }
-        // V(&(pbx_read_cnt_mutex));   // Reader leaves the critial section of pbx->head.
-
-        // Writing to pbx->head.
-        P(&(pbx->pbx_lock));    // Enters critical section of pbx->head.
-        pbx->head = new_node;   // Writer performs the write.
-        V(&(pbx->pbx_lock));    // Leaves critical section of pbx->head.
-
-        P(&(pbx->node_count_mutex));
-        pbx->node_count += 1;       // Increment node count.
-        V(&(pbx->node_count_mutex));
-
-        return 0;
-    }
-
-    while (curr_node->next != NULL)
-    {
-        curr_node = curr_node->next;
+        V(&(shard->shard_lock));
+        debug("Extension %d is already registered. Returning -1.\n", ext);
+        pool_free(&node_pool, new_node);
+        return -1;
     }
+    atomic_store_explicit(slot, new_node, memory_order_release);     // Publish the node; its fields are visible to any dialer that sees it.
+    atomic_fetch_add_explicit(&(shard->node_count), 1, memory_order_relaxed);   // Increment node count.
+    V(&(shard->shard_lock));    // Writer leaves CS of the shard.
 
-    reader_leaves(&pbx_read_cnt_mutex, pbx);
-    
-    P(&(pbx->pbx_lock));    // Writer can enter CS of pbx->head.
-    curr_node->next = new_node;     // Writer writes.
-    V(&(pbx->pbx_lock));    // Writer can enter CS of pbx->head.
-    
-    P(&(pbx->node_count_mutex));
-    pbx->node_count += 1;       // Increment node count.
-    V(&(pbx->node_count_mutex));
+    tu_ref(tu, "pbx_register");     // Increment tu->ref_cnt.
+    tu_set_extension(tu, ext);      // Assign 'ext' value to tu->connfd.
 
     debug("Registered new client.\n");
     return 0;
@@ -238,43 +244,52 @@ int pbx_register(PBX *pbx, TU *tu, int ext) {
 int pbx_unregister(PBX *pbx, TU *tu) {
     debug("Inside pbx_unregister().\n");
 
-    reader_enters(&pbx_read_cnt_mutex, pbx);
-    
-    // Reading CS of pbx->head.
-    struct pbx_node *curr_node = pbx->head;                        // Declare and assign a pbx_node pointer to point to pbx->head.
-
-    while (curr_node != NULL)
-    {   
-        if (curr_node->tu == tu)                  // If 'tu' is found via address.
-        {
-            debug("Tu has been found. Unregistering it now.\n");
+    int ext = tu_extension(tu);     // The extension indexes the TU's slot directly.
+    if (ext < 0 || ext >= pbx->capacity)
+    {
+        debug("tu has no valid extension. Returning -1.\n");
+        return -1;
+    }
 
-            reader_leaves(&pbx_read_cnt_mutex, pbx);
+    struct pbx_shard *shard = pbx_shard(pbx, ext);
+    _Atomic(struct pbx_node *) *slot = pbx_slot(pbx, ext);
+    P(&(shard->shard_lock));    // Writer enters critical section of the shard.
+    struct pbx_node *curr_node = atomic_load_explicit(slot, memory_order_relaxed);
+    if (curr_node == NULL || curr_node->tu != tu)  // The slot must belong to 'tu'.
+    {
+        V(&(shard->shard_lock));
+        debug("tu was not found in pbx. Returning -1.\n");
+        return -1;
+    }
+    atomic_store_explicit(slot, NULL, memory_order_relaxed);     // Disassociate 'tu' from its extension number. New dialers no longer find it.
+    V(&(shard->shard_lock));    // Writer leaves the CS of the shard.
 
-            tu_set_extension(tu, -1);       // Set the extension number of the now unregistered tu to -1.
-            tu_hangup(tu);               // A hangup operation is performed on the tu to cancel any call that might be in progress.
-            free(curr_node->tu);              // Free the tu structure that is getting unregistered from pbx.
-            
-            // Writing to pbx->head.
-            P(&(pbx->pbx_lock));    // Writer enters critical section of pbx->head.
-            curr_node->ext = -1;            // Disassociate 'tu' from its extension number. Set it to -1.
-            V(&(pbx->pbx_lock));    // Writer leaves the CS of pbx->head.
+    debug("Tu has been found. Unregistering it now.\n");
+    tu_set_extension(tu, -1);       // Set the extension number of the now unregistered tu to -1.
+    tu_hangup(tu);                  // A hangup operation is performed on the tu to cancel any call that might be in progress.
+    epoch_retire(&(curr_node->retire), pbx_node_reclaim);  // A dialer may still be using the TU; free it after the grace period.
 
-            P(&(pbx->node_count_mutex));    // Writer enters critical section of pbx->node_count.
-            pbx->node_count -= 1;       // Decrement node_count.
-            V(&(pbx->node_count_mutex));    // Writer enters critical section of pbx->node_count.
+    atomic_fetch_sub_explicit(&(shard->node_count), 1, memory_order_seq_cst);  // Decrement node count only once the TU is fully unregistered. Ordered before the load below (see pbx_count()).
+    if (atomic_load_explicit(&(pbx->shutting_down), memory_order_seq_cst))
+        V(&(pbx->empty));       // Let pbx_shutdown() recount.
 
-            return 0;
-        }
-        curr_node = curr_node->next;
-    }
-    reader_leaves(&pbx_read_cnt_mutex, pbx);
-    debug("tu was not found in pbx. Returning -1.\n");
-    return -1;
-    // abort();
+    return 0;
 }
 #endif
 
+/*
+ * Find the TU registered with an extension.  Must be called within an epoch
+ * critical section, which keeps the TU from being freed until it ends.
+ *
+ * @return the TU, or NULL if the extension is not registered.
+ */
+static TU *pbx_lookup(PBX *pbx, int ext) {
+    if (ext < 0 || ext >= pbx->capacity)    // Extensions outside the registry can never be registered.
+        return NULL;
+    struct pbx_node *curr_node = atomic_load_explicit(pbx_slot(pbx, ext), memory_order_acquire);  // Direct lookup of the slot for 'ext', without a lock.
+    return (curr_node != NULL) ? curr_node->tu : NULL;
+}
+
 /*
  * Use the PBX to initiate a call from a specified TU to a specified extension.
  *
@@ -287,30 +302,69 @@ int pbx_unregister(PBX *pbx, TU *tu) {
 int pbx_dial(PBX *pbx, TU *tu, int ext) {
     debug("Inside pbx_dial().\n");
 
-    reader_enters(&pbx_read_cnt_mutex, pbx);
-    
-    // Reader reads CS of pbx->head.
-    struct pbx_node *curr_node = pbx->head;                        // Declare and assign a PBX pointer to point to the first PBX structure in the linked list.
+    HUNT_GROUP *group = hunt_find(ext);
+    if (group != NULL)                          // A pilot: ring an idle member of its group instead.
+        return hunt_dial(group, tu);
 
-    while (curr_node != NULL)
-    {
-        if (curr_node->ext == ext)
-        {
-            debug("Ext found. Dialing it now. Returning 0.\n");
+    epoch_enter();                              // Keeps 'target' from being freed until the dial completes.
+    TU *target = pbx_lookup(pbx, ext);
 
-            reader_leaves(&pbx_read_cnt_mutex, pbx);
-            tu_dial(tu, curr_node->tu);     // Dial the TU associated with 'ext'.
-            return 0;
-        }
-
-        curr_node = curr_node->next;
+    if (target == NULL)
+    {
+        debug("ext was not found in pbx. Returning -1.\n");
+        epoch_leave();
+        tu_dial(tu, NULL);                      // If ext was not found in pbx, dial with NULL target.
+        return -1;
     }
-    // V(&(pbx->pbx_lock));
-    reader_leaves(&pbx_read_cnt_mutex, pbx);
 
-    debug("ext was not found in pbx. Returning -1.\n");
-    tu_dial(tu, NULL);                          // If ext was not found in pbx, dial with NULL target.         
-    return -1;                                  // Return -1.
-    // abort();
+    debug("Ext found. Dialing it now. Returning 0.\n");
+    tu_dial(tu, target);                        // Dial the TU associated with 'ext'.
+    epoch_leave();
+    return 0;
 }
 #endif
+
+/*
+ * Use the PBX to camp a TU on an extension: dial it, and if it is busy, wait
+ * for it.  See camp.h.
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU that is camping.
+ * @param ext  The extension number to be called.
+ * @return 0 if the extension is registered, otherwise -1.
+ */
+int pbx_camp(PBX *pbx, TU *tu, int ext) {
+    debug("Inside pbx_camp().\n");
+    epoch_enter();                              // Keeps 'target' from being freed until it has been camped on.
+    TU *target = pbx_lookup(pbx, ext);
+    tu_camp(tu, target);
+    epoch_leave();
+    return (target == NULL) ? -1 : 0;
+}
+
+/*
+ * Use the PBX to make a TU a member of the hunt group with a pilot extension.
+ * See hunt.h.
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU that is joining.
+ * @param pilot  The pilot extension of the group.
+ * @return 0 if the group exists, otherwise -1.
+ */
+int pbx_join(PBX *pbx, TU *tu, int pilot) {
+    debug("Inside pbx_join().\n");
+    return tu_join(tu, hunt_find(pilot));       // Groups are never freed; no epoch is needed.
+}
+
+/*
+ * Use the PBX to take a TU into a conference room.  See conf.h.
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU that is joining.
+ * @param room  The number of the room.
+ * @return 0 if the TU joined the room, otherwise -1.
+ */
+int pbx_conf(PBX *pbx, TU *tu, int room) {
+    debug("Inside pbx_conf().\n");
+    return tu_conf(tu, room);                   // Rooms are not registered extensions; anyone may open one.
+}
@@ -0,0 +1,199 @@
+/*
+ * Pool allocator: per-thread caches of fixed-size objects over a shared depot.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define POOL_MAX_POOLS 16           // Most pools a program may use.
+#define POOL_CACHE_SIZE 32          // Objects a thread caches per pool.
+#define POOL_BATCH (POOL_CACHE_SIZE / 2)    // Objects moved between a cache and the depot at once.
+#define POOL_SLAB_MIN 64            // Objects in a slab carved on demand.
+
+struct pool_free {                  // A free object is overlaid with a pool_free structure,
+    struct pool_free *next;         // linking it to the next free object in the depot.
+};
+
+struct pool_cache {                 // A pool_cache structure contains:
+    POOL *pool;                     // The pool it caches objects of,
+    int count;                      // The number of cached objects,
+    void *objs[POOL_CACHE_SIZE];    // The cached objects, most recently freed last.
+};
+
+static __thread struct pool_cache pool_caches[POOL_MAX_POOLS + 1];    // Indexed by pool id; 0 is unused.
+static __thread int pool_thread_registered = 0;
+static int pool_next_id = 1;
+static POOL *pool_listed[POOL_MAX_POOLS];  // The pools defined with POOL_DEFINE,
+static int pool_num_listed = 0;             // and how many there are.
+static pthread_mutex_t pool_id_lock = PTHREAD_MUTEX_INITIALIZER;   // Protects 'pool_next_id' and the list.
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;      // Flushes a thread's caches when the thread exits.
+
+/*
+ * Give a batch of cached objects back to the depot.
+ */
+static void pool_flush(struct pool_cache *cache, int n) {
+    POOL *pool = cache->pool;
+    pthread_mutex_lock(&(pool->lock));
+    while (n-- > 0)
+    {
+        struct pool_free *obj = cache->objs[--cache->count];
+        obj->next = pool->depot;
+        pool->depot = obj;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+static void pool_thread_exit(void *arg) {
+    for (int id = 1; id <= POOL_MAX_POOLS; id++)
+    {
+        struct pool_cache *cache = &pool_caches[id];
+        if (cache->count > 0)
+            pool_flush(cache, cache->count);
+    }
+}
+
+static void pool_key_init(void) {
+    pthread_key_create(&pool_key, pool_thread_exit);
+}
+
+/*
+ * Find the calling thread's cache for a pool, giving the pool its id on first use.
+ */
+static struct pool_cache *pool_cache(POOL *pool) {
+    int id = atomic_load_explicit(&(pool->id), memory_order_acquire);
+    if (id == 0)
+    {
+        pthread_mutex_lock(&pool_id_lock);
+        if ((id = atomic_load_explicit(&(pool->id), memory_order_relaxed)) == 0)
+        {
+            if (pool_next_id > POOL_MAX_POOLS)
+                app_error("Too many pools");
+            id = pool_next_id++;
+            atomic_store_explicit(&(pool->id), id, memory_order_release);
+        }
+        pthread_mutex_unlock(&pool_id_lock);
+    }
+    if (!pool_thread_registered)
+    {
+        Pthread_once(&pool_once, pool_key_init);
+        pthread_setspecific(pool_key, pool_caches);     // Any non-NULL value makes the destructor run.
+        pool_thread_registered = 1;
+    }
+    struct pool_cache *cache = &pool_caches[id];
+    cache->pool = pool;
+    return cache;
+}
+
+/*
+ * Carve a new slab of 'n' objects and add them to the depot.
+ * Must be called with the lock of the pool held.
+ *
+ * @return 0 if successful, -1 with errno set if there is no memory for the slab.
+ */
+static int pool_grow(POOL *pool, int n) {
+    char *slab;
+    int err;
+    if ((err = posix_memalign((void **) &slab, pool->align, n * pool->size)) != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    memset(slab, 0, n * pool->size);        // Fault the pages in now rather than on the connection path.
+    for (int i = n - 1; i >= 0; i--)
+    {
+        struct pool_free *obj = (struct pool_free *) (slab + i * pool->size);
+        obj->next = pool->depot;
+        pool->depot = obj;
+    }
+    pool->slabs += 1;
+    debug("Pool of %zu-byte objects grew by %d objects.\n", pool->size, n);
+    return 0;
+}
+
+/*
+ * Allocate an object from a pool, if there is memory for it.  The contents of
+ * the object are undefined.
+ *
+ * @return the object, or NULL with errno set if the pool could not grow.
+ */
+void *pool_try_alloc(POOL *pool) {
+    struct pool_cache *cache = pool_cache(pool);
+    if (cache->count == 0)                      // Refill the cache from the depot.
+    {
+        pthread_mutex_lock(&(pool->lock));
+        while (cache->count < POOL_BATCH)
+        {
+            if (pool->depot == NULL && pool_grow(pool, POOL_SLAB_MIN) < 0)
+                break;                          // Make do with what the depot had.
+            struct pool_free *obj = pool->depot;
+            pool->depot = obj->next;
+            cache->objs[cache->count++] = obj;
+        }
+        pthread_mutex_unlock(&(pool->lock));
+        if (cache->count == 0)
+            return NULL;
+    }
+    return cache->objs[--cache->count];
+}
+
+/*
+ * Allocate an object from a pool, exiting if there is no memory for it.  The
+ * contents of the object are undefined.
+ */
+void *pool_alloc(POOL *pool) {
+    void *obj;
+    if ((obj = pool_try_alloc(pool)) == NULL)
+        unix_error("posix_memalign error");
+    return obj;
+}
+
+/*
+ * Return an object to the pool it was allocated from.  Any thread may free it.
+ */
+void pool_free(POOL *pool, void *obj) {
+    struct pool_cache *cache = pool_cache(pool);
+    if (cache->count == POOL_CACHE_SIZE)        // Make room by giving half of the cache back to the depot.
+        pool_flush(cache, POOL_BATCH);
+    cache->objs[cache->count++] = obj;
+}
+
+/*
+ * List a pool for pool_prefill_all().  Called for every pool defined with
+ * POOL_DEFINE, before main() runs.
+ */
+void pool_register(POOL *pool) {
+    pthread_mutex_lock(&pool_id_lock);
+    if (pool_num_listed == POOL_MAX_POOLS)
+        app_error("Too many pools");
+    pool_listed[pool_num_listed++] = pool;
+    pthread_mutex_unlock(&pool_id_lock);
+}
+
+/*
+ * Add 'count' free objects to a pool at once, so that they are allocated and
+ * their pages faulted in now, rather than on the path of the connections
+ * that will use them.
+ */
+void pool_prefill(POOL *pool, int count) {
+    if (count <= 0)
+        return;
+    pthread_mutex_lock(&(pool->lock));
+    if (pool_grow(pool, count) < 0)
+        unix_error("posix_memalign error");
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+/*
+ * Prefill every pool defined with POOL_DEFINE with 'count' objects.
+ * Called by main() for -P, before connections are accepted.
+ */
+void pool_prefill_all(int count) {
+    for (int i = 0; i < pool_num_listed; i++)
+        pool_prefill(pool_listed[i], count);
+}
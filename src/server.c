@@ -3,94 +3,329 @@
  * Manages interaction with a client telephone unit (TU).
  */
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <netinet/tcp.h>
 
 #include "debug.h"
 #include "pbx.h"
 #include "server.h"
+#include "ext_alloc.h"
+#include "pool.h"
+#include "client.h"
+#include "line_reader.h"
+#include "tu_batch.h"
+#include "tu_timeout.h"
+#include "camp.h"
+#include "hunt.h"
+#include "conf.h"
 #include "csapp.h"
 
+POOL_DEFINE(conn_pool, sizeof(int), 16);
+
 /*
- * Thread function for the thread that handles interaction with a client TU.
- * This is called after a network connection has been made via the main server
- * thread and a new thread has been created to handle the connection.
+ * What every accept loop does when accepting failed with error 'err': exit
+ * if the listening socket itself is unusable, and otherwise skip the error,
+ * which concerns one connection or is a passing shortage of descriptors or
+ * memory.  After a shortage, the loop stops accepting for
+ * CLIENT_ACCEPT_PAUSE_MS, to give connections a chance to close, rather than
+ * failing again at once.
+ *
+ * @return nonzero if the loop must pause before accepting again.
  */
-#if 1
-void *pbx_client_service(void *arg) {
-    debug("Inside pbx_client_service().\n");
-    TU *tu;                             // Declare a TU.
-    size_t n;                           // Declare a variable to hold the number of bytes in the line that was ready by the read buffer, 'rio'.
-    char buf[MAXLINE];                  // Initialize a char buffer, 'buf'.
-    rio_t rio;                          // Initialize a read buffer, 'rio'.
+int client_accept_failed(int err) {
+    if (err == EBADF || err == EINVAL || err == ENOTSOCK || err == EFAULT)
+    {
+        errno = err;
+        unix_error("Accept error");         // The listening socket itself is unusable.
+    }
+    debug("accept() error: %s\n", strerror(err));
+    return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
 
-    Pthread_detach(pthread_self());     // To avoid memory leaks in the thread routine, detach each thread so that its memory resources are reclaimed when it terminates.
+/*
+ * Accept a connection, as Accept() does, but with the error policy of
+ * client_accept_failed(): errors that do not concern the listening socket are
+ * skipped, and the next connection is waited for.
+ *
+ * @return the connected descriptor.
+ */
+int client_accept(int listenfd, SA *addr, socklen_t *addrlen) {
+    socklen_t len = (addrlen != NULL) ? *addrlen : 0;
+    while (1)
+    {
+        int connfd = accept(listenfd, addr, addrlen);
+        if (connfd >= 0)
+            return connfd;
+        if (errno != EINTR && client_accept_failed(errno))
+            usleep(CLIENT_ACCEPT_PAUSE_MS * 1000);
+        if (addrlen != NULL)
+            *addrlen = len;
+    }
+}
 
-    int connfd = *((int *) arg);        // Save the descriptor passed as argument to this function.
-    Free(arg);                          // Free the storage occupied by the descriptor.
-    tu = tu_init(connfd);               // Initialize a new TU with descriptor, connfd.
-    pbx_register(pbx, tu, connfd);      // Register the new TU to pbx with a unique extension number. I made the extension number the value of 'connfd'.
-    Rio_readinitb(&rio, connfd);        // Associate a descriptor, 'connfd', with a read buffer, 'rio', and reset its buffer.
+/*
+ * Set up the TU of a newly accepted connection and register it with the PBX.
+ *
+ * @param connfd  The connected descriptor.
+ * @param extp  Where to store the extension assigned to the TU.
+ * @return the TU, holding a reference for the caller, or NULL if the client could
+ * not be registered, in which case the descriptor has been closed.
+ */
+TU *client_open(int connfd, int *extp) {
+    TU *tu;                             // Declare a TU.
+    int one = 1;                        // Output is batched by the server itself; Nagle's algorithm would only
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // hold a batch back until the client's delayed ACK.
+    if ((tu = tu_init(connfd)) == NULL) // Initialize a new TU with descriptor, connfd. We hold its first reference.
+    {
+        Close(connfd);
+        return NULL;
+    }
+    int ext = ext_alloc_get(ext_allocator);     // Take the next free extension number. It has nothing to do with 'connfd'.
+    if (ext == -1 || pbx_register(pbx, tu, ext) == -1)  // Register the new TU to pbx with that extension number.
+    {
+        debug("Could not register the new TU. Closing the connection.\n");
+        if (ext != -1)
+            ext_alloc_put(ext_allocator, ext);
+        tu_unref(tu, "not registered");
+        Close(connfd);
+        return NULL;
+    }
+    *extp = ext;
+    return tu;
+}
 
-    while(1)                            // Infinite service loop that reads client messages, parses, and calls functions.
+/*
+ * Parse the extension of a dial command: digits, after any spaces.
+ *
+ * @return the extension, or -1 if there is none.  No extension is negative,
+ * so -1 is dialed like any extension that is not registered.
+ */
+static int client_parse_ext(const char *p, const char *end) {
+    while (p < end && *p == ' ')
+        p++;
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+    long ext = 0;
+    while (p < end && *p >= '0' && *p <= '9')
     {
-        while ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0)        // Repeatedly read lines of text,
-        {
-            debug("buf: %s\n", buf);
-            // char first_four[5];                                     // Declare a string, 'first_four', to contain the first 4 chars in char buffer, 'buf'.
-            // memset(first_four, 0, sizeof(first_four));
-            // strncpy(first_four, buf, 4);                            // Initialize 'first_four'
-            char *token;    // Pointer to first token in 'buf'
-            char *rest = buf;   // Pointer to first character in 'buf'
-
-            
-            while ((token = strtok_r(rest, " ", &rest)))
+        ext = 10 * ext + (*p++ - '0');
+        if (ext > INT_MAX)                  // Too large to be registered.
+            return -1;
+    }
+    return (int) ext;
+}
+
+/*
+ * Parse one line received from a client.  The command is picked by the first
+ * byte of the line, then checked in full, in place: nothing is copied or
+ * tokenized.
+ *
+ *   pickup\r\n
+ *   hangup\r\n
+ *   dial <ext>\r\n
+ *   chat <message>\r\n     The message is sent on with its terminator.
+ *   camp <ext>\r\n
+ *   join <pilot>\r\n
+ *   conf <room>\r\n
+ *
+ * @param line  The line, including its line terminator, NUL-terminated in place.
+ * @param len  The length of the line.
+ * @param argp  Where to store the extension, pilot or room given, or -1 if there
+ * is none, for CLIENT_DIAL, CLIENT_CAMP, CLIENT_JOIN and CLIENT_CONF.  The
+ * message of CLIENT_CHAT starts at line + 5.
+ * @return the command, or CLIENT_UNKNOWN if the line is not understood.
+ */
+CLIENT_CMD client_parse(char *line, size_t len, int *argp) {
+    char *end = line + len;
+    switch (line[0])
+    {
+        case 'p':
+            if (len == 8 && memcmp(line, "pickup\r\n", 8) == 0)
+                return CLIENT_PICKUP;
+            break;
+        case 'h':
+            if (len == 8 && memcmp(line, "hangup\r\n", 8) == 0)
+                return CLIENT_HANGUP;
+            break;
+        case 'd':
+            if (len > 5 && memcmp(line, "dial ", 5) == 0)
+            {
+                *argp = client_parse_ext(line + 5, end);
+                return CLIENT_DIAL;
+            }
+            break;
+        case 'c':
+            if (len >= 5 && memcmp(line, "chat ", 5) == 0)
+                return CLIENT_CHAT;
+            if (len > 5 && memcmp(line, "camp ", 5) == 0)
+            {
+                *argp = client_parse_ext(line + 5, end);
+                return CLIENT_CAMP;
+            }
+            if (len > 5 && memcmp(line, "conf ", 5) == 0)
+            {
+                *argp = client_parse_ext(line + 5, end);
+                return CLIENT_CONF;
+            }
+            break;
+        case 'j':
+            if (len > 5 && memcmp(line, "join ", 5) == 0)
             {
-                debug("token: %s\n", token);
-
-                // Parse the contents of buf.
-                if (strcmp(token, "pickup\r\n") == 0)                     // If client sends pickup mesage, call tu_pickup.
-                {
-                    debug("The client sent a pickup message.\n");
-                    tu_pickup(tu);
-                }
-                else if ((strcmp(token, "hangup\r\n")) == 0)              // If client sends hangup message, call tu_hangup.
-                {
-                    debug("The client sent a hangup message.\n");
-                    tu_hangup(tu);
-                }
-                else if (strcmp(token, "dial") == 0)               // If client sends dial message, call pbx_dial.
-                {
-                    debug("The client sent a dial message.\n");
-                    // char *buf_p = buf;   
-                    // buf_p = buf_p + 5;                                  // Points to where the number should be.
-                    token = strtok_r(rest, " ", &rest);
-                    int ext = atoi(token);
-                    // (void) ext;
-                    debug("%d\n", ext);
-                    pbx_dial(pbx, tu, ext);
-                }
-                else if (strcmp(token, "chat") == 0)               // If client sends chat message, call tu_chat.
-                {
-                    debug("The client sent a chat message.\n");
-                    char *buf_p = buf;   
-                    buf_p = buf_p + 5;                                  // Points to where the number should be.
-                    // token = strtok_r(rest, " ", &rest);
-                    // int ext = atoi(token);
-                    // (void) ext;
-                    // debug("%d\n", ext);
-                    tu_chat(tu, buf_p);
-                }
-                else
-                {
-                    debug("The client sent an unknown message.\n");     // Do nothing if client sends unknown message.
-                }
+                *argp = client_parse_ext(line + 5, end);
+                return CLIENT_JOIN;
             }
+            break;
+    }
+    return CLIENT_UNKNOWN;
+}
+
+/*
+ * Parse one line received from a client and carry out the command it contains.
+ *
+ * @param tu  The TU of the client.
+ * @param line  The line, including its line terminator, NUL-terminated in place.
+ * @param len  The length of the line.
+ */
+void client_line(TU *tu, char *line, size_t len) {
+    debug("line: %s\n", line);
+    tu_touch(tu);                                               // Any line, even one not understood, shows the client is alive.
+    int arg;
+    switch (client_parse(line, len, &arg))
+    {
+        case CLIENT_PICKUP:                                     // If client sends pickup mesage, call tu_pickup.
+            debug("The client sent a pickup message.\n");
+            tu_pickup(tu);
+            break;
+        case CLIENT_HANGUP:                                     // If client sends hangup message, call tu_hangup.
+            debug("The client sent a hangup message.\n");
+            tu_hangup(tu);
+            break;
+        case CLIENT_DIAL:                                       // If client sends dial message, call pbx_dial.
+            debug("The client sent a dial message: %d\n", arg);
+            pbx_dial(pbx, tu, arg);
+            break;
+        case CLIENT_CHAT:                                       // If client sends chat message, call tu_chat.
+            debug("The client sent a chat message.\n");
+            tu_chat(tu, line + 5);                              // The message starts after "chat ".
+            break;
+        case CLIENT_CAMP:                                       // If client sends camp message, call pbx_camp.
+            debug("The client sent a camp message: %d\n", arg);
+            pbx_camp(pbx, tu, arg);
+            break;
+        case CLIENT_JOIN:                                       // If client sends join message, call pbx_join.
+            debug("The client sent a join message: %d\n", arg);
+            pbx_join(pbx, tu, arg);
+            break;
+        case CLIENT_CONF:                                       // If client sends conf message, call pbx_conf.
+            debug("The client sent a conf message: %d\n", arg);
+            pbx_conf(pbx, tu, arg);
+            break;
+        case CLIENT_UNKNOWN:
+            debug("The client sent an unknown message.\n");     // Do nothing if client sends unknown message.
+            break;
+    }
+}
+
+/*
+ * Carry out every complete line in a buffer of input from a client, and move
+ * what is left of an incomplete line to the front of the buffer.  A line that
+ * fills the whole buffer is cut, as Rio_readlineb() would.
+ *
+ * @param tu  The TU of the client.
+ * @param buf  The input, with room for one byte after 'size'.  It is modified.
+ * @param len  The number of bytes of input in 'buf'.
+ * @param size  The number of bytes the buffer can hold.
+ * @return the number of bytes left in 'buf'.
+ */
+size_t client_input(TU *tu, char *buf, size_t len, size_t size) {
+    tu_batch_begin(tu);                             // The notifications caused by all the lines go out together.
+    char *start = buf;
+    char *end = buf + len;
+    while (start < end)
+    {
+        char *nl = memchr(start, '\n', end - start);
+        if (nl == NULL && !(start == buf && len == size))
+            break;                                  // Wait for the rest of the line.
+        char *next = (nl == NULL) ? end : nl + 1;
+        char saved = *next;                         // The line is carried out as a string, in place.
+        *next = '\0';
+        client_line(tu, start, next - start);
+        *next = saved;
+        start = next;
+    }
+    tu_batch_end();
+    len = end - start;
+    memmove(buf, start, len);
+    return len;
+}
+
+/*
+ * Tear down a connection whose client has gone away.
+ *
+ * @param tu  The TU of the client.  The caller's reference is dropped.
+ * @param ext  The extension assigned by client_open().
+ * @param connfd  The connected descriptor, which is closed.
+ */
+void client_close(TU *tu, int ext, int connfd) {
+    pbx_unregister(pbx, tu);                                    // Unregister tu from pbx.
+    ext_alloc_put(ext_allocator, ext);                          // The extension can be handed out again.
+    tu_unref(tu, "client disconnected");                        // Drop this reference; the TU is freed when the last one goes.
+    Close(connfd);                                              // Close the connected descriptor because it is no longer needed.
+}
+
+/*
+ * Serve a client connection until the client goes away, in the calling thread.
+ *
+ * @param connfd  The connected descriptor, which is closed before returning.
+ */
+void client_serve(int connfd) {
+    TU *tu;                             // Declare a TU.
+    int ext;                            // The extension of the TU.
+    LINE_READER lr;                     // The reader of the client's lines.
+    char *line;                         // The current line, in the reader's buffer.
+    size_t len;                         // Its length.
+
+    if ((tu = client_open(connfd, &ext)) == NULL)
+        return;
+    line_reader_init(&lr, connfd);      // Associate the descriptor, 'connfd', with the reader.
 
+    int batched = 0;                    // Whether a batch of commands is open.
+    while (line_reader_next(&lr, &line, &len) > 0)      // Repeatedly take lines of text, and carry them out.
+    {
+        if (!batched && line_reader_ready(&lr))         // More commands have already arrived: answer them together.
+        {
+            tu_batch_begin(tu);
+            batched = 1;
+        }
+        client_line(tu, line, len);
+        if (batched && !line_reader_ready(&lr))         // The batch is done; send before waiting for input.
+        {
+            tu_batch_end();
+            batched = 0;
         }
-        debug("Outside line reading loop.\n");                      // If client disconnects itself,
-        pbx_unregister(pbx, tu);                                    // Unregister tu from pbx.
-        Close(connfd);                                              // Close the connected descriptor because it is no longer needed.
-        return NULL;
     }
-    // abort();
+    if (batched)
+        tu_batch_end();
+
+    debug("Outside line reading loop.\n");              // If client disconnects itself, or the connection failed,
+    client_close(tu, ext, connfd);
+}
+
+/*
+ * Thread function for the thread that handles interaction with a client TU.
+ * This is called after a network connection has been made via the main server
+ * thread and a new thread has been created to handle the connection.
+ */
+#if 1
+void *pbx_client_service(void *arg) {
+    debug("Inside pbx_client_service().\n");
+    Pthread_detach(pthread_self());     // To avoid memory leaks in the thread routine, detach each thread so that its memory resources are reclaimed when it terminates.
+
+    int connfd = *((int *) arg);        // Save the descriptor passed as argument to this function.
+    pool_free(&conn_pool, arg);         // Free the storage occupied by the descriptor.
+    client_serve(connfd);
+    return NULL;
 }
 #endif
@@ -0,0 +1,281 @@
+/*
+ * Hierarchical timer wheel, driven by a timer thread.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "timer_wheel.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Each slot is a circular list behind a sentinel head, and each level keeps a
+ * bitmap of the slots that hold timers, so that the timer thread can sleep
+ * through empty slots instead of waking up every millisecond.  'now' is the
+ * next millisecond to be processed; it lags behind the clock while the timer
+ * thread sleeps or runs callbacks, and the thread catches up one millisecond
+ * at a time, so that no slot that must be moved down is skipped.  When no
+ * timer is pending, the thread waits for one, and 'now' is set to the clock
+ * by the first timer armed.
+ */
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_NUM_SLOTS (TIMER_SLOTS * TIMER_LEVELS)
+#define TIMER_IDLE ULONG_MAX                    // 'wake' while the thread waits for a timer.
+
+_Static_assert(TIMER_SLOTS == 64, "A level's bitmap is a 64-bit word.");
+
+static struct wheel {                           // The wheel structure contains:
+    TIMER slots[TIMER_NUM_SLOTS];               // The heads of the slots, level by level,
+    uint64_t occupied[TIMER_LEVELS];            // The slots of each level that hold timers,
+    unsigned long now;                          // The next millisecond to be processed,
+    unsigned long count;                        // The number of pending timers,
+    unsigned long wake;                         // The millisecond the thread sleeps until, TIMER_IDLE, or 0 if it is awake,
+    pthread_mutex_t lock;                       // Protects the fields above and the links of pending timers,
+    pthread_cond_t cond;                        // Wakes the thread when a timer is due before 'wake'.
+} wheel;
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static atomic_ulong timer_warped;               // Milliseconds added to the clock by timer_warp().
+
+static void *timer_thread(void *arg);
+
+static void timer_start(void) {
+    for (int i = 0; i < TIMER_NUM_SLOTS; i++)
+    {
+        wheel.slots[i].next = &wheel.slots[i];
+        wheel.slots[i].prev = &wheel.slots[i];
+    }
+    wheel.wake = TIMER_IDLE;
+    pthread_mutex_init(&wheel.lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);     // Sleeps are timed on the clock of timer_now().
+    pthread_cond_init(&wheel.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_t tid;
+    Pthread_create(&tid, NULL, timer_thread, NULL);
+}
+
+/*
+ * @return the current time in milliseconds, on a clock that never goes back.
+ */
+unsigned long timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000
+           + atomic_load_explicit(&timer_warped, memory_order_relaxed);
+}
+
+/*
+ * Move the clock of timer_now() forward, as if that much time had passed at
+ * once.  The timer thread catches up one millisecond at a time, running what
+ * comes due on the way.  This is for tests, to bring far-off timers due
+ * without waiting for them; the server never calls it.
+ */
+void timer_warp(unsigned long ms) {
+    Pthread_once(&timer_once, timer_start);
+    pthread_mutex_lock(&wheel.lock);
+    atomic_fetch_add_explicit(&timer_warped, ms, memory_order_relaxed);
+    pthread_cond_signal(&wheel.cond);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+/*
+ * Link a timer into the slot that covers its expiry time: the lowest level
+ * whose range, counted from 'now', reaches it.  A timer due beyond the reach
+ * of the wheel, as one armed for TIMER_MAX_MS is while 'now' lags behind the
+ * clock, goes to the farthest slot, and is linked again when that comes round.
+ * Must be called with the wheel's lock held.
+ */
+static void timer_insert(TIMER *timer) {
+    if (timer->expires < wheel.now)                 // Overdue: run it with the next millisecond processed.
+        timer->expires = wheel.now;
+    unsigned long slot_time = timer->expires;
+    if (slot_time - wheel.now > TIMER_MAX_MS)
+        slot_time = wheel.now + TIMER_MAX_MS;
+    unsigned long delta = slot_time - wheel.now;
+    int level = 0;
+    while (delta >> (TIMER_BITS * (level + 1)) != 0)
+        level++;
+    int index = (slot_time >> (TIMER_BITS * level)) & TIMER_MASK;
+    TIMER *head = &wheel.slots[level * TIMER_SLOTS + index];
+    timer->slot = level * TIMER_SLOTS + index;
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel.occupied[level] |= (uint64_t) 1 << index;
+    wheel.count += 1;
+}
+
+/*
+ * Must be called with the wheel's lock held, on a pending timer.
+ */
+static void timer_unlink(TIMER *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    TIMER *head = &wheel.slots[timer->slot];
+    if (head->next == head)
+        wheel.occupied[timer->slot / TIMER_SLOTS] &= ~((uint64_t) 1 << (timer->slot & TIMER_MASK));
+    timer->slot = -1;
+    wheel.count -= 1;
+}
+
+/*
+ * Move the timers of a slot down to the levels below, now that the time it
+ * covers has come.  None of them goes back to the same slot.
+ */
+static void timer_cascade(int slot) {
+    TIMER *head = &wheel.slots[slot];
+    while (head->next != head)
+    {
+        TIMER *timer = head->next;
+        timer_unlink(timer);
+        timer_insert(timer);
+    }
+}
+
+/*
+ * Process the millisecond 'now': move down what is due within the next round
+ * of each level that comes round, then run the timers of its slot.
+ * Must be called with the wheel's lock held, which is released during callbacks.
+ */
+static void timer_tick(void) {
+    unsigned long t = wheel.now;
+    if ((t & TIMER_MASK) == 0)
+    {
+        for (int level = 1; level < TIMER_LEVELS; level++)
+        {
+            int index = (t >> (TIMER_BITS * level)) & TIMER_MASK;
+            timer_cascade(level * TIMER_SLOTS + index);
+            if (index != 0)                         // The level above only comes round when this one wraps.
+                break;
+        }
+    }
+    TIMER *head = &wheel.slots[t & TIMER_MASK];
+    while (head->next != head)                      // A callback may add to the slot, or cancel what is in it.
+    {
+        TIMER *timer = head->next;
+        timer_unlink(timer);
+        pthread_mutex_unlock(&wheel.lock);
+        timer->fn(timer);
+        pthread_mutex_lock(&wheel.lock);
+    }
+    wheel.now = t + 1;
+}
+
+/*
+ * @return the millisecond the timer thread has to process next: the next
+ * occupied slot of level 0 in this round, or else the start of a round, when
+ * slots of the levels above come down.  That may be 'now' itself.
+ */
+static unsigned long timer_next(void) {
+    uint64_t ahead = wheel.occupied[0] >> (wheel.now & TIMER_MASK);
+    if (ahead != 0)
+        return wheel.now + __builtin_ctzll(ahead);
+    return (wheel.now + TIMER_MASK) & ~(unsigned long) TIMER_MASK;
+}
+
+/*
+ * The timer thread.
+ */
+static void *timer_thread(void *arg) {
+    Pthread_detach(pthread_self());
+    sigset_t mask;                                  // SIGHUP is left to the main thread.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&wheel.lock);
+    while (1)
+    {
+        if (wheel.count == 0)
+        {
+            wheel.wake = TIMER_IDLE;
+            while (wheel.count == 0)
+                pthread_cond_wait(&wheel.cond, &wheel.lock);
+            wheel.wake = 0;
+            continue;
+        }
+        if (wheel.now <= timer_now())
+        {
+            timer_tick();
+            continue;
+        }
+        wheel.wake = timer_next();
+        unsigned long wake = wheel.wake - atomic_load_explicit(&timer_warped, memory_order_relaxed);
+        struct timespec ts = { .tv_sec = wake / 1000, .tv_nsec = (wake % 1000) * 1000000 };
+        pthread_cond_timedwait(&wheel.cond, &wheel.lock, &ts);
+        wheel.wake = 0;
+    }
+    return NULL;
+}
+
+/*
+ * Prepare a timer, which is not pending until it is armed.
+ *
+ * @param fn  The function to be called in the timer thread when it expires.
+ */
+void timer_init(TIMER *timer, void (*fn)(TIMER *)) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->slot = -1;
+    timer->fn = fn;
+}
+
+/*
+ * Arm a timer to expire after a delay, or move it if it is already pending.
+ *
+ * @param ms  The delay in milliseconds; a longer one than TIMER_MAX_MS is cut to it.
+ * @return 1 if the timer was pending, 0 otherwise.
+ */
+int timer_arm(TIMER *timer, unsigned long ms) {
+    Pthread_once(&timer_once, timer_start);
+    unsigned long now = timer_now();
+    pthread_mutex_lock(&wheel.lock);
+    int pending = (timer->slot != -1);
+    if (pending)
+        timer_unlink(timer);
+    if (wheel.count == 0 && wheel.wake == TIMER_IDLE)   // The wheel is empty and has not been turned since.
+        wheel.now = now;
+    if (ms > TIMER_MAX_MS)
+        ms = TIMER_MAX_MS;
+    timer->expires = now + ms + 1;                  // 'now' is rounded down; a timer never expires early.
+    timer_insert(timer);
+    if (timer->expires < wheel.wake)                // The thread sleeps past it, or waits for a timer.
+        pthread_cond_signal(&wheel.cond);
+    pthread_mutex_unlock(&wheel.lock);
+    return pending;
+}
+
+/*
+ * Cancel a timer.  Its callback is not called, unless the timer thread has
+ * already picked it.
+ *
+ * @return 1 if the timer was pending, 0 otherwise.
+ */
+int timer_cancel(TIMER *timer) {
+    Pthread_once(&timer_once, timer_start);
+    pthread_mutex_lock(&wheel.lock);
+    int pending = (timer->slot != -1);
+    if (pending)
+        timer_unlink(timer);
+    pthread_mutex_unlock(&wheel.lock);
+    return pending;
+}
+
+/*
+ * @return 1 if the timer is armed and has not expired yet, 0 otherwise.
+ */
+int timer_pending(TIMER *timer) {
+    Pthread_once(&timer_once, timer_start);
+    pthread_mutex_lock(&wheel.lock);
+    int pending = (timer->slot != -1);
+    pthread_mutex_unlock(&wheel.lock);
+    return pending;
+}
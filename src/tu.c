@@ -2,52 +2,637 @@
  * TU: simulates a "telephone unit", which interfaces a client with the PBX.
  */
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
 
 #include "pbx.h"
+#include "tu_table.h"
+#include "epoch.h"
+#include "outq.h"
+#include "tu_batch.h"
+#include "tu_timeout.h"
+#include "timer_wheel.h"
+#include "hunt.h"
+#include "conf.h"
+#include "config.h"
+#include "pool.h"
 #include "debug.h"
 #include "csapp.h"
 
-struct tu_node {
-    int ref_cnt;
+/*
+ * A TU is a single object aligned on a cache line.  The fields that every
+ * transition reads (state, peer, extension, queue) share the first line; the
+ * timers, the camp-on queue, and the hunt group and conference memberships,
+ * which are only touched when a call rings, a line is busy, a client goes idle
+ * or a member goes on or off hook, follow.  The lock, which waiting threads
+ * write to, is kept on a line of its own.
+ */
+typedef struct tu {
+    atomic_uint state;      // The TU_STATE of this TU structure.
+    int ext;                // The extension number assigned by the PBX, or -1 if not registered.
+    _Atomic(TU *) peer;     // The TU structure's peer.
+    int peer_ext;           // The extension of the peer when they became peers, for "CONNECTED <ext>".
+    OUTQ *outq;             // The outbound queue of the connection. All output to the client goes through it.
     int connfd;             // The connected descriptor associated with this TU structure.
-    char *state;            // The state associated with this TU structure.
-    TU *peer;               // The TU structure's peer.
+    atomic_int ref_cnt;     // The TU is freed when this drops to 0.
+    TIMER ring_timer;       // Abandons the call ringing the TU if it is not answered in time.
+    TIMER idle_timer;       // Disconnects the client once it has sent nothing for too long.
+    atomic_ulong last_input;        // When the client last sent something, on the clock of timer_now().
+    struct tu *camp_on;     // The TU whose line this one waits for, or NULL.
+    struct tu *camp_next;   // Links in the queue of 'camp_on',
+    struct tu *camp_prev;
+    int camp_queued;        // ... and whether the TU is in it.
+    int camp_closed;        // Whether TUs may no longer wait for this one.
+    struct tu *camp_head;   // The queue of the TUs waiting for this one, oldest first.
+    struct tu *camp_tail;
+    atomic_int camp_waiters;        // The length of the queue.
+    sem_t camp_lock;        // Protects the queue, and the links and 'camp_queued' of the TUs in it.
+    HUNT_MEMBER *hunt;      // The TU's membership of a hunt group, or NULL.
+    CONF_ROOM *room;        // The conference room the TU is in, or NULL.  Only changed by the client's own commands.
+    sem_t tu_lock __attribute__((aligned(64)));     // Held while 'ext', 'state', 'peer' or 'peer_ext' is changed.
+} __attribute__((aligned(64))) TU;
+
+static POOL_DEFINE(tu_pool, sizeof(TU), 64);
+
+/*
+ * The state and the peer of a TU can be read at any time without a lock, which
+ * is how tu_dispatch() looks up the transition to make.  The transition is then
+ * made with the lock of the TU held, and with that of the other TU as well if
+ * the transition involves it; the locks are taken in address order.  The state
+ * is committed by compare-and-swap against the state the lookup was made with,
+ * so that a lookup that raced with another thread is detected and redone.
+ *
+ * A TU is freed as soon as its last reference is dropped.  References are held
+ * by the client's server thread, by the PBX registry, and by each peer.  The
+ * registry drops its reference only after an epoch grace period that starts
+ * once the TU has been hung up, so a peer pointer read within an epoch critical
+ * section stays valid until the section ends.
+ */
+
+static TU_STATE tu_state(TU *tu) {
+    return atomic_load(&(tu->state));
+}
+
+static int tu_cas_state(TU *tu, TU_STATE from, TU_STATE to) {
+    unsigned int expected = from;
+    return atomic_compare_exchange_strong(&(tu->state), &expected, to);
+}
+
+static void tu_set_state(TU *tu, TU_STATE to) {
+    atomic_store(&(tu->state), to);
+}
+
+static TU *tu_peer(TU *tu) {
+    return atomic_load(&(tu->peer));
+}
+
+static void tu_set_peer(TU *tu, TU *peer) {
+    atomic_store(&(tu->peer), peer);
+}
+
+/*
+ * Lock two distinct TUs in address order, so that two threads locking the same
+ * pair can never deadlock.
+ */
+static void tu_lock_pair(TU *tu, TU *other) {
+    if (tu < other)
+    {
+        P(&(tu->tu_lock));
+        P(&(other->tu_lock));
+    }
+    else
+    {
+        P(&(other->tu_lock));
+        P(&(tu->tu_lock));
+    }
+}
+
+static void tu_unlock_pair(TU *tu, TU *other) {
+    V(&(tu->tu_lock));
+    V(&(other->tu_lock));
+}
+
+/*
+ * Notifications are built on the stack from a precomputed prefix for each state
+ * (which must agree with tu_state_names), followed for TU_ON_HOOK and
+ * TU_CONNECTED by an extension number.  No notification allocates memory.
+ */
+#define TU_PREFIX(text, ext) { text, sizeof(text) - 1, ext }
+
+static const struct tu_prefix {
+    const char *text;
+    size_t len;
+    int has_ext;                    // Whether an extension number and newline follow the prefix.
+} tu_prefixes[] = {
+    [TU_ON_HOOK]       TU_PREFIX("ON HOOK ", 1),
+    [TU_RINGING]       TU_PREFIX("RINGING\n", 0),
+    [TU_DIAL_TONE]     TU_PREFIX("DIAL TONE\n", 0),
+    [TU_RING_BACK]     TU_PREFIX("RING BACK\n", 0),
+    [TU_BUSY_SIGNAL]   TU_PREFIX("BUSY SIGNAL\n", 0),
+    [TU_CONNECTED]     TU_PREFIX("CONNECTED ", 1),
+    [TU_ERROR]         TU_PREFIX("ERROR\n", 0)
 };
 
-typedef struct tu {
-    struct tu_node *head;
-    sem_t tu_lock;
-    int tu_read_cnt;
-    sem_t tu_read_cnt_mutex;
-} TU;    
-
-/* This function adds one reader into the critial section of the shared resource, a linked list of tu_node
-structures. The first reader into the critical section will lock it, preventing any writer from entering while 
-still allowing other readers to enter.
-*/
-
-void tu_reader_enters(TU *tu) {
-    P(&(tu->tu_read_cnt_mutex));    // Reader wants enters the CS of tu->head.
-    tu->tu_read_cnt += 1;           // Number of readers trying to enter CS of tu->head increased by 1.
-    if (tu->tu_read_cnt == 1)
+#define TU_NOTIFY_MAX 32                        // Longest prefix, plus the digits of an int and a newline.
+
+#define TU_CHAT_PREFIX "CHAT "
+#define TU_CHAT_PREFIX_LEN (sizeof(TU_CHAT_PREFIX) - 1)
+
+/*
+ * Format a non-negative number in decimal, ending just before 'end'.
+ *
+ * @return a pointer to the first digit.
+ */
+static char *tu_format_uint(char *end, unsigned int n) {
+    do
+    {
+        *--end = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    return end;
+}
+
+/*
+ * Send a state-change notification to the client of a TU.
+ *
+ * @param q  The outbound queue of the client.
+ * @param state  The state to be reported.
+ * @param ext  The extension that goes with the state: the TU's own extension
+ * for TU_ON_HOOK, the peer's for TU_CONNECTED, ignored otherwise.
+ */
+static void tu_notify(OUTQ *q, TU_STATE state, int ext) {
+    char buf[TU_NOTIFY_MAX];
+    const struct tu_prefix *prefix = &tu_prefixes[state];
+    memcpy(buf, prefix->text, prefix->len);
+    size_t len = prefix->len;
+    if (prefix->has_ext)
+    {
+        char digits[12];                                        // Enough for any int.
+        char *end = digits + sizeof(digits);
+        char *start = tu_format_uint(end, ext);                 // Extensions are never negative.
+        memcpy(buf + len, start, end - start);
+        len += end - start;
+        buf[len++] = '\n';
+    }
+    outq_write(q, buf, len);                                    // Queue the notification; this never blocks on the socket.
+}
+
+/*
+ * Notify the client of a TU of its current state.  Must be called with the lock
+ * of the TU held, so that notifications go out in the order of the transitions.
+ * A TU that is no longer registered has no client, and nothing is sent.
+ */
+static void tu_report(TU *tu) {
+    int ext = tu->ext;
+    if (ext == -1)
+        return;
+    TU_STATE state = tu_state(tu);
+    if (state == TU_CONNECTED)
+        ext = tu->peer_ext;                 // Not the peer's 'ext', which its own lock protects.
+    tu_notify(tu->outq, state, ext);
+}
+
+/*
+ * Send the chat message "CHAT <msg>" to the client of a TU.  The message goes
+ * out from where it was received, behind the constant prefix, in one write:
+ * it is neither copied nor allocated unless the client's queue has to keep it.
+ * Must be called with the lock of the TU held.
+ */
+static void tu_send_chat(TU *tu, char *msg) {
+    struct iovec iov[2] = {
+        { .iov_base = TU_CHAT_PREFIX, .iov_len = TU_CHAT_PREFIX_LEN },
+        { .iov_base = msg, .iov_len = strlen(msg) }
+    };
+    outq_writev(tu->outq, iov, 2);
+}
+
+/*
+ * The batch of the calling thread: the TUs whose output it holds back, each
+ * with a reference, so that they outlive the batch.  A batch touching more
+ * TUs than it can hold sends to the others at once.
+ */
+#define TU_BATCH_MAX 16
+
+static __thread struct tu_batch {   // A tu_batch structure contains:
+    int depth;                      // The nesting depth of tu_batch_begin(), or 0 if no batch is open,
+    int count;                      // The number of TUs held back,
+    TU *tus[TU_BATCH_MAX];          // The TUs held back.
+} tu_batch;
+
+/*
+ * Hold back the output of a TU until the calling thread's batch ends, if it
+ * has one open.  The TU must not be freed during the call.
+ */
+static void tu_batch_add(TU *tu) {
+    if (tu_batch.depth == 0)
+        return;
+    for (int i = 0; i < tu_batch.count; i++)
+        if (tu_batch.tus[i] == tu)
+            return;
+    if (tu_batch.count == TU_BATCH_MAX)
+        return;
+    tu_ref(tu, "batched");
+    outq_cork(tu->outq);
+    tu_batch.tus[tu_batch.count++] = tu;
+}
+
+/*
+ * Open a batch of commands from the client of a TU.
+ */
+void tu_batch_begin(TU *tu) {
+    tu_batch.depth += 1;
+    tu_batch_add(tu);
+}
+
+/*
+ * End the batch opened by the matching tu_batch_begin(), and, if it is the
+ * outermost one, send what it held back.
+ */
+void tu_batch_end(void) {
+    if (--tu_batch.depth > 0)
+        return;
+    for (int i = 0; i < tu_batch.count; i++)
+    {
+        outq_uncork(tu_batch.tus[i]->outq);
+        tu_unref(tu_batch.tus[i], "batch ended");
+    }
+    tu_batch.count = 0;
+    conf_flush();                               // And what was held back for conference rooms.
+}
+
+/*
+ * A pending timer holds a reference to its TU, so that the TU outlives it.
+ * Whoever stops the timer, by cancelling it or by running its callback, drops
+ * the reference.
+ */
+static void tu_timer_arm(TU *tu, TIMER *timer, unsigned long ms) {
+    tu_ref(tu, "timer armed");                  // Taken first: the timer may expire as soon as it is armed.
+    if (timer_arm(timer, ms))
+        tu_unref(tu, "timer moved");            // It already held one.  Never the last: the caller holds one too.
+}
+
+/*
+ * The caller must hold a reference to the TU besides that of the timer.
+ */
+static void tu_timer_cancel(TU *tu, TIMER *timer) {
+    if (timer_cancel(timer))
+        tu_unref(tu, "timer cancelled");
+}
+
+/*
+ * Camp-on.  A TU that camps on a busy line waits in the queue of the TU it
+ * called, hearing a busy signal.  Each time that TU goes back on hook, the
+ * oldest TU in its queue is called back: it dials the line again, and if the
+ * line has been taken again in the meantime, it goes back to the head of the
+ * queue.  A TU stops waiting when it hangs up.
+ *
+ * The queues are intrusive doubly linked lists, threaded through the waiting
+ * TUs, so that joining, leaving and waking take constant time and no memory.
+ * A queue and the links of the TUs in it are protected by the 'camp_lock' of
+ * the TU it belongs to, which is taken after any TU lock.  'camp_on' is only
+ * changed with the lock of the waiting TU held.  The queue holds a reference
+ * to each TU in it, and a TU holds one to the TU it waits for for as long as
+ * its 'camp_on' is set.
+ */
+
+/*
+ * Put a TU in the queue of the TU it camps on, at the tail, or at the head if
+ * it is going back there.  Must be called with the locks of both TUs held.
+ * Nobody can wait for a TU that has been unregistered.
+ */
+static void tu_camp_enqueue(TU *target, TU *tu, int first) {
+    P(&(target->camp_lock));
+    if (target->camp_closed)
+    {
+        V(&(target->camp_lock));
+        return;
+    }
+    if (tu->camp_on == NULL)
     {
-        P(&(tu->tu_lock));          // If the first reader, lock CS of tu->head from any writer. Readers can still access it.
+        tu->camp_on = target;
+        tu_ref(target, "camped on");
+    }
+    tu_ref(tu, "queued");
+    tu->camp_queued = 1;
+    if (first)
+    {
+        tu->camp_prev = NULL;
+        tu->camp_next = target->camp_head;
+        if (target->camp_head != NULL)
+            target->camp_head->camp_prev = tu;
+        else
+            target->camp_tail = tu;
+        target->camp_head = tu;
+    }
+    else
+    {
+        tu->camp_next = NULL;
+        tu->camp_prev = target->camp_tail;
+        if (target->camp_tail != NULL)
+            target->camp_tail->camp_next = tu;
+        else
+            target->camp_head = tu;
+        target->camp_tail = tu;
+    }
+    atomic_fetch_add_explicit(&(target->camp_waiters), 1, memory_order_relaxed);
+    V(&(target->camp_lock));
+}
+
+/*
+ * Must be called with the queue's lock held, on a TU that is in it.
+ * The queue's reference to the TU passes to the caller.
+ */
+static void tu_camp_unlink(TU *target, TU *tu) {
+    if (tu->camp_prev != NULL)
+        tu->camp_prev->camp_next = tu->camp_next;
+    else
+        target->camp_head = tu->camp_next;
+    if (tu->camp_next != NULL)
+        tu->camp_next->camp_prev = tu->camp_prev;
+    else
+        target->camp_tail = tu->camp_prev;
+    tu->camp_queued = 0;
+    atomic_fetch_sub_explicit(&(target->camp_waiters), 1, memory_order_relaxed);
+}
+
+/*
+ * Stop a TU waiting for the line it camped on.  Must be called with the lock
+ * of the TU held.
+ *
+ * @return the TU it waited for, whose reference the caller must drop once the
+ * lock is released, or NULL if it was not waiting.
+ */
+static TU *tu_camp_leave(TU *tu) {
+    TU *target = tu->camp_on;
+    if (target == NULL)
+        return NULL;
+    P(&(target->camp_lock));
+    int queued = tu->camp_queued;
+    if (queued)                                 // Otherwise it is being called back.
+        tu_camp_unlink(target, tu);
+    V(&(target->camp_lock));
+    if (queued)
+        tu_unref(tu, "left the queue");         // Never the last: the caller holds one.
+    tu->camp_on = NULL;
+    return target;
+}
+
+static int tu_dispatch(TU *tu, TU_COMMAND cmd, TU *target, char *msg);
+
+/*
+ * Call back the oldest TU waiting for a TU that has just gone back on hook,
+ * and the next ones while the line stays free, as it does if the TU called
+ * back has hung up since it camped.  The caller must hold a reference to the
+ * TU, and no TU lock.  Waiters join with the lock of the TU they wait for held,
+ * so one that joined before the TU went on hook is seen here.
+ */
+static void tu_camp_wake(TU *target) {
+    while (atomic_load_explicit(&(target->camp_waiters), memory_order_relaxed) > 0
+           && tu_state(target) == TU_ON_HOOK)
+    {
+        P(&(target->camp_lock));
+        TU *tu = target->camp_head;
+        if (tu != NULL)
+            tu_camp_unlink(target, tu);
+        V(&(target->camp_lock));
+        if (tu == NULL)
+            return;
+        tu_dispatch(tu, TU_CALLBACK_CMD, target, NULL);
+        tu_unref(tu, "called back");
+    }
+}
+
+/*
+ * Empty the queue of a TU that is being unregistered, and keep it empty.
+ * The TUs that waited for it are left with a busy signal.
+ */
+static void tu_camp_close(TU *target) {
+    P(&(target->camp_lock));
+    target->camp_closed = 1;
+    TU *tu = target->camp_head;
+    target->camp_head = NULL;
+    target->camp_tail = NULL;
+    atomic_store_explicit(&(target->camp_waiters), 0, memory_order_relaxed);
+    for (TU *next = tu; next != NULL; next = next->camp_next)
+        next->camp_queued = 0;
+    V(&(target->camp_lock));
+    while (tu != NULL)
+    {
+        TU *next = tu->camp_next;
+        tu_unref(tu, "queue closed");           // Never the last: a queued TU has not hung up yet, so its client holds one.
+        tu = next;
+    }
+}
+
+/*
+ * Whether a TU that was taken out of the queue of 'target' to be called back
+ * still waits for it, rather than having hung up and camped again since.
+ * Must be called with the lock of the TU held.
+ */
+static int tu_camp_current(TU *tu, TU *target) {
+    if (tu->camp_on != target)
+        return 0;
+    P(&(target->camp_lock));
+    int queued = tu->camp_queued;
+    V(&(target->camp_lock));
+    return !queued;
+}
+
+/*
+ * What a command from the server does once it has been overtaken: a ring
+ * timeout for a TU that has been rung again since the timer expired, for the
+ * new call has a timer of its own, or a callback for a TU that waits again.
+ */
+static const struct tu_transition tu_overtaken = { TU_ACT_IGNORE, 0, 0, 0 };
+
+/*
+ * Keep the hunt group of a TU told whether the TU is idle, that is, on hook.
+ * Must be called with the lock of the TU held, as its state changes.
+ */
+static void tu_hunt_note(TU *tu, TU_STATE from, TU_STATE to) {
+    if (tu->hunt != NULL && (from == TU_ON_HOOK) != (to == TU_ON_HOOK))
+        hunt_set_idle(tu->hunt, to == TU_ON_HOOK);
+}
+
+/*
+ * Take a TU out of its conference room if it leaves TU_DIAL_TONE.  Only the
+ * commands of the TU's own client do that.  Must be called with the lock of
+ * the TU held.
+ */
+static void tu_conf_note(TU *tu, TU_STATE from, TU_STATE to) {
+    if (tu->room != NULL && from == TU_DIAL_TONE && to != TU_DIAL_TONE)
+    {
+        conf_leave(tu->room, tu->outq);
+        tu->room = NULL;
     }
-    V(&(tu->tu_read_cnt_mutex));    // Readers can still access CS of tu->head.
 }
 
 /*
-This function removed one reader from critical section of the shared resource, a linked list of tu_node
-structures. The last reader that leaves the critical section will unlock it, allowing any writer to enter.
-*/ 
-void tu_reader_leaves(TU *tu) {
-    P(&(tu->tu_read_cnt_mutex));        // Reader is trying to leave the CS of tu->head.
-    tu->tu_read_cnt -= 1;               // One fewer reader.
-    if (tu->tu_read_cnt == 0)
+ * Carry out a command on a TU, as given by the transition table.
+ *
+ * @param tu  The TU the command is issued to.
+ * @param cmd  The command, TU_PICKUP_CMD through TU_CHAT_CMD, or one of those the
+ * server adds in tu_table.h.
+ * @param target  The TU to be dialed, or NULL, for TU_DIAL_CMD and TU_HUNT_CMD, or
+ * the TU camped on, for TU_CAMP_CMD and TU_CALLBACK_CMD.  Ignored otherwise.
+ * @param msg  The message to be sent, for TU_CHAT_CMD.  Ignored otherwise.
+ * @return the result given by the transition table.
+ */
+static int tu_dispatch(TU *tu, TU_COMMAND cmd, TU *target, char *msg) {
+    const struct tu_transition *t;
+    TU_STATE state;
+    TU *other;
+    TU *camped = NULL;                          // The TU this one stopped waiting for, if any.
+
+    epoch_enter();
+    while (1)
     {
-        V(&(tu->tu_lock));              // If the last reader, unlock the CS of tu->head. Writers can now write to CS of tu->head.
+        state = tu_state(tu);
+        other = TU_HAS_TARGET(cmd) ? target : tu_peer(tu);
+        int other_state = (other == NULL) ? TU_PEER_NONE : tu_state(other);
+        t = &tu_transitions[state][cmd][other_state];
+        debug("%s in state %s: action %d.\n", (cmd < TU_NUM_COMMANDS) ? tu_command_names[cmd] : "server command",
+              tu_state_names[state], t->action);
+
+        if (!TU_ACTION_PAIRED(t->action))
+        {
+            P(&(tu->tu_lock));
+            if (t->action == TU_ACT_RETRY || !tu_cas_state(tu, state, t->next))
+            {
+                V(&(tu->tu_lock));          // Taking the lock waited out whoever was changing the TU.
+                continue;
+            }
+            tu_hunt_note(tu, state, t->next);
+            tu_conf_note(tu, state, t->next);
+            if (state == TU_BUSY_SIGNAL && t->next != TU_BUSY_SIGNAL)
+                camped = tu_camp_leave(tu);
+            if (t->action != TU_ACT_IGNORE)
+                tu_report(tu);
+            V(&(tu->tu_lock));
+            break;
+        }
+
+        tu_lock_pair(tu, other);
+        if ((cmd == TU_TIMEOUT_CMD && timer_pending(&(tu->ring_timer)))   // Checked under the locks, which LINK holds to arm it.
+            || (cmd == TU_CALLBACK_CMD && !tu_camp_current(tu, other)))
+        {
+            tu_unlock_pair(tu, other);
+            t = &tu_overtaken;
+            break;
+        }
+        TU *expected = (t->action == TU_ACT_LINK || t->action == TU_ACT_CAMP) ? NULL : other;    // Whether the TUs are peers now.
+        if (tu_peer(tu) != expected || (t->action != TU_ACT_CAMP && tu_peer(other) != (expected ? tu : NULL))
+            || tu_state(other) != other_state || !tu_cas_state(tu, state, t->next))
+        {
+            tu_unlock_pair(tu, other);
+            continue;
+        }
+        tu_set_state(other, t->peer_next);
+        tu_hunt_note(tu, state, t->next);
+        tu_hunt_note(other, other_state, t->peer_next);
+        tu_conf_note(tu, state, t->next);       // Only a TU's own commands take it out of TU_DIAL_TONE, never another's.
+        tu_batch_add(other);                    // 'other' is notified below.
+        if (t->action == TU_ACT_LINK)             // Each TU holds a reference to its peer for as long as they are peers.
+        {
+            tu_set_peer(tu, other);
+            tu_set_peer(other, tu);
+            tu->peer_ext = other->ext;          // Both locks are held, so neither extension is changing.
+            other->peer_ext = tu->ext;
+            tu_ref(tu, "became a peer");
+            tu_ref(other, "became a peer");
+            if (pbx_config.ring_timeout > 0)    // 'other' is being rung.
+                tu_timer_arm(other, &(other->ring_timer), pbx_config.ring_timeout);
+            if (cmd == TU_CALLBACK_CMD)         // The wait is over.
+            {
+                camped = tu->camp_on;
+                tu->camp_on = NULL;
+            }
+        }
+        else if (t->action == TU_ACT_UNLINK || t->action == TU_ACT_DISCONNECT)
+        {
+            tu_set_peer(tu, NULL);
+            tu_set_peer(other, NULL);
+        }
+        else if (t->action == TU_ACT_CHAT)
+        {
+            tu_send_chat(other, msg);
+        }
+        else if (t->action == TU_ACT_CAMP)
+        {
+            tu_camp_enqueue(other, tu, cmd == TU_CALLBACK_CMD);
+        }
+        if ((t->action == TU_ACT_ANSWER || t->action == TU_ACT_UNLINK) && pbx_config.ring_timeout > 0)
+        {
+            TU *rung = (state == TU_RINGING) ? tu : other;
+            tu_timer_cancel(rung, &(rung->ring_timer));     // The peers still hold references to each other.
+        }
+        if (t->action != TU_ACT_CAMP || cmd == TU_CAMP_CMD)     // A TU called back in vain goes on hearing a busy signal.
+            tu_report(tu);
+        if (t->action != TU_ACT_CHAT && t->action != TU_ACT_CAMP)
+            tu_report(other);
+        tu_unlock_pair(tu, other);
+        break;
+    }
+    epoch_leave();
+
+    if (camped != NULL)
+        tu_unref(camped, "no longer camped on");
+    if (t->action != TU_ACT_IGNORE && state != TU_ON_HOOK && t->next == TU_ON_HOOK)
+        tu_camp_wake(tu);                       // The line has come free.
+    if (TU_ACTION_PAIRED(t->action) && t->peer_next == TU_ON_HOOK)
+        tu_camp_wake(other);
+    if (t->action == TU_ACT_UNLINK || t->action == TU_ACT_DISCONNECT)
+    {
+        tu_unref(tu, "no longer a peer");
+        tu_unref(other, "no longer a peer");
+    }
+    return t->result;
+}
+
+/*
+ * Abandon the call ringing a TU, which was not answered in time: the TU goes
+ * back on hook, and the caller gets a dial tone again.
+ */
+static void tu_ring_expired(TIMER *timer) {
+    TU *tu = (TU *) ((char *) timer - offsetof(TU, ring_timer));
+    debug("Ring timeout.\n");
+    tu_dispatch(tu, TU_TIMEOUT_CMD, NULL, NULL);
+    tu_unref(tu, "timer expired");
+}
+
+/*
+ * Disconnect the client of a TU if it has sent nothing for the idle timeout.
+ * Input does not move the timer, which would take the wheel's lock for every
+ * line; the time of the last input is recorded instead, and a timer that finds
+ * the client was not idle all along is armed again for the time that is left.
+ */
+static void tu_idle_expired(TIMER *timer) {
+    TU *tu = (TU *) ((char *) timer - offsetof(TU, idle_timer));
+    unsigned long last = atomic_load_explicit(&(tu->last_input), memory_order_relaxed);
+    unsigned long idle = timer_now() - last;
+    P(&(tu->tu_lock));
+    if (tu->ext != -1)                          // Otherwise the client is gone, and its descriptor may have been reused.
+    {
+        if (idle >= (unsigned long) pbx_config.idle_timeout)
+        {
+            debug("Client of extension %d idle for %lu ms. Disconnecting it.\n", tu->ext, idle);
+            shutdown(tu->connfd, SHUT_RDWR);    // Its thread or loop sees EOF and unregisters it, as if it had hung up.
+        }
+        else
+            tu_timer_arm(tu, &(tu->idle_timer), pbx_config.idle_timeout - idle);
     }
-    V(&(tu->tu_read_cnt_mutex));        // Reader is trying to leave the CS of tu->head.
+    V(&(tu->tu_lock));
+    tu_unref(tu, "timer expired");
+}
+
+/*
+ * Record that the client of a TU has sent something.
+ */
+void tu_touch(TU *tu) {
+    if (pbx_config.idle_timeout > 0)
+        atomic_store_explicit(&(tu->last_input), timer_now(), memory_order_relaxed);
 }
 
 /*
@@ -62,38 +647,57 @@ TU *tu_init(int fd) {
 
     debug("Inside tu_init(). Initializing tu with fd %d.\n", fd);
     TU *tu;                                             // Declare TU pointer.
-    if ((tu = malloc(sizeof(struct tu))) == NULL)       // Dynamically allocate memory for the new TU. Check for Error and return NULL.
+    if ((tu = pool_try_alloc(&tu_pool)) == NULL)        // Take the new TU, on its own cache lines, from the pool.
     {
-        debug("Error calling malloc(). Returning NULL.\n"); 
+        debug("No memory for a TU. Returning NULL.\n");
         return NULL;
     }
-
-    Sem_init(&(tu->tu_lock), 0 ,1);
-    Sem_init(&(tu->tu_read_cnt_mutex), 0 ,1);
-
-    P(&tu->tu_lock);    // Writer enters CS of tu->head.
-    if ((tu->head = malloc(sizeof(struct tu_node))) == NULL)
+    if ((tu->outq = outq_init(fd, pbx_config.outq_size)) == NULL)
     {
-        debug("Error mallocing tu->head. Returning NULL.\n");
+        debug("No memory for the queue of a TU. Returning NULL.\n");
+        pool_free(&tu_pool, tu);
         return NULL;
     }
-    // Write initial values of tu->head.
-    tu->head->ref_cnt = 0;
-    tu->head->connfd = fd;
-    tu->head->state = tu_state_names[TU_ON_HOOK];
-    tu->head->peer = NULL;
-
-    // Write value of tu->tu_read_cnt to 0.
-    P(&tu->tu_read_cnt_mutex);
-    tu->tu_read_cnt = 0;
-    V(&tu->tu_read_cnt_mutex);
-    
-    V(&tu->tu_lock);    // Writer releases the lock. Writers are allowed in if there are no readers requesting.
-    
+
+    Sem_init(&(tu->tu_lock), 0 ,1);
+
+    // Write initial values of tu. Nobody else can see the TU yet.
+    atomic_init(&(tu->ref_cnt), 1);                     // The caller's reference.
+    tu->connfd = fd;
+    tu->ext = -1;
+    atomic_init(&(tu->state), TU_ON_HOOK);
+    atomic_init(&(tu->peer), NULL);
+    tu->peer_ext = -1;
+    timer_init(&(tu->ring_timer), tu_ring_expired);
+    timer_init(&(tu->idle_timer), tu_idle_expired);
+    atomic_init(&(tu->last_input), 0);
+    tu->camp_on = NULL;
+    tu->camp_queued = 0;
+    tu->camp_closed = 0;
+    tu->camp_head = NULL;
+    tu->camp_tail = NULL;
+    atomic_init(&(tu->camp_waiters), 0);
+    Sem_init(&(tu->camp_lock), 0, 1);
+    tu->hunt = NULL;
+    tu->room = NULL;
+
     return tu;                                          // Return the newly initialized TU structure.
 }
 #endif
 
+/*
+ * Free a TU and everything it owns, once its last reference has been dropped.
+ *
+ * @param tu  The TU to be freed.
+ */
+static void tu_free(TU *tu) {
+    debug("Inside tu_free().\n");
+    outq_free(tu->outq);
+    sem_destroy(&(tu->tu_lock));
+    sem_destroy(&(tu->camp_lock));
+    pool_free(&tu_pool, tu);
+}
+
 /*
  * Increment the reference count on a TU.
  *
@@ -106,11 +710,11 @@ void tu_ref(TU *tu, char *reason) {
     debug("Inside tu_ref().\n");
     if (reason)                                 // Print 'reason' if defined.
         debug("Reason: %s\n", reason);
-    
-    P(&(tu->tu_lock));                      // Writer entered CS of tu->head.
-    tu->head->ref_cnt += 1;                              // Increment the reference count on 'tu'.
-    debug("tu->ref now: %d\n", tu->head->ref_cnt);
-    V(&(tu->tu_lock));                      // Writer leaves CS of tu->head.
+
+    // Whoever calls this already holds a reference, so nothing needs ordering.
+    int refs = atomic_fetch_add_explicit(&(tu->ref_cnt), 1, memory_order_relaxed) + 1;
+    debug("tu->ref now: %d\n", refs);
+    (void) refs;
     return;
 }
 #endif
@@ -127,11 +731,12 @@ void tu_unref(TU *tu, char *reason) {
     debug("Inside tu_unref().\n");
     if (reason)                                     // Print reason if defined.
         debug("Reason: %s\n", reason);
-    
-    P(&(tu->tu_lock));                      // Writer entered CS of tu->head.
-    tu->head->ref_cnt -= 1;                              // Decrement the reference count on 'tu'.
-    debug("tu->ref now: %d\n", tu->head->ref_cnt);
-    V(&(tu->tu_lock));  
+
+    // Release our writes to the TU; the thread that drops the last reference acquires them all before freeing it.
+    int refs = atomic_fetch_sub_explicit(&(tu->ref_cnt), 1, memory_order_acq_rel) - 1;
+    debug("tu->ref now: %d\n", refs);
+    if (refs == 0)
+        tu_free(tu);
     return;
 }
 #endif
@@ -148,14 +753,7 @@ void tu_unref(TU *tu, char *reason) {
 #if 1
 int tu_fileno(TU *tu) {
     debug("Inside tu_fileno().\n");
-    
-    tu_reader_enters(tu);
-
-    // Reader reads tu->head.
-    int fileno = tu->head->connfd;                        // Save the value of tu->connfd in a variable.
-
-    tu_reader_leaves(tu);
-    return fileno;                                  // Return the value of the file descriptor. Will return -1 if tu->connfd == -1.
+    return tu->connfd;                        // Never changes after tu_init().
 }
 #endif
 
@@ -172,13 +770,10 @@ int tu_fileno(TU *tu) {
 #if 1
 int tu_extension(TU *tu) {
     debug("Inside tu_extension().\n");
-    tu_reader_enters(tu);
-
-    // Reader reads tu->head.
-    int extension = tu->head->connfd;                     // Save the value of tu->connfd in a variable.
-
-    tu_reader_leaves(tu);
-    return extension;                               // Return the value of the extension. Will return -1 if tu->connfd == -1.
+    P(&(tu->tu_lock));
+    int extension = tu->ext;                  // Save the value of tu->ext in a variable.
+    V(&(tu->tu_lock));
+    return extension;                               // Return the value of the extension. Will return -1 if tu->ext == -1.
 }
 #endif
 
@@ -194,25 +789,31 @@ int tu_set_extension(TU *tu, int ext) {
     debug("Inside tu_set_extension().\n");
 
     P(&(tu->tu_lock));
-    tu->head->connfd = ext;                 // Update 'tu->connfd' to 'ext'.
-    V(&(tu->tu_lock));
-
-    if (ext == -1)                                   // If ext is -1, then do nothing.
+    tu->ext = ext;                    // Update 'tu->ext' to 'ext'.
+    tu_report(tu);                          // Nothing is sent if 'ext' is -1.
+    if (ext == -1)                          // The client is gone, and its descriptor is about to be closed.
     {
-        debug("tu->connfd is -1. Return 0 here.\n");
-        return 0;
+        outq_discard(tu->outq);
+        tu_timer_cancel(tu, &(tu->ring_timer));
+        tu_timer_cancel(tu, &(tu->idle_timer));
+        tu_camp_close(tu);
+        if (tu->hunt != NULL)               // Nobody can reach it through its group any more.
+        {
+            hunt_remove(tu->hunt);
+            tu->hunt = NULL;
+        }
+        if (tu->room != NULL)               // Before the TU can be freed: see conf.c.
+        {
+            conf_leave(tu->room, tu->outq);
+            tu->room = NULL;
+        }
     }
-
-    char *bp;                                               // Declare a char buffer pointer.
-    size_t size;                                            // Declare size location.
-    FILE *stream;                                           // Declare a FILE pointer.
-    stream = open_memstream(&bp, &size);
-    fprintf(stream, "%s", tu_state_names[TU_ON_HOOK]);      // Place characters into the stream.
-    fflush(stream);
-    fprintf(stream, " %d\n", ext);                          // Place more characters into the stream.
-    fclose(stream);                                         // Close the stream. Closing the stream frees the dynamic buffer.
-    Rio_writen(ext, bp, size);                       // Write those characters to tu's connected descriptor.
-    free(bp);
+    else if (pbx_config.idle_timeout > 0)   // The client is disconnected if it stays silent that long.
+    {
+        atomic_store_explicit(&(tu->last_input), timer_now(), memory_order_relaxed);
+        tu_timer_arm(tu, &(tu->idle_timer), pbx_config.idle_timeout);
+    }
+    V(&(tu->tu_lock));
     return 0;
 }
 #endif
@@ -222,233 +823,12 @@ int tu_set_extension(TU *tu, int ext) {
  * @param target  The target TU, or NULL if the caller of this function was unable to
  * identify a TU to be dialed.
  * @return 0 if successful, -1 if any error occurs that results in the originating
- * TU transitioning to the TU_ERROR state. 
+ * TU transitioning to the TU_ERROR state.
  */
 #if 1
 int tu_dial(TU *tu, TU *target) {
-    char *bp;                                       // Declare a char buffer pointer.
-    size_t size;                                    // Declare size location.
-    FILE *stream;                                   // Declare a FILE pointer.
-    stream = open_memstream(&bp, &size);
-
-    tu_reader_enters(tu);
-
-    if (!target)                                                        // If NULL was passed in as argument for 'target',
-    {
-        if ((strcmp(tu->head->state, tu_state_names[TU_DIAL_TONE]) == 0))     // If target is NULL and the originating TU is in DIAL_TONE state,
-        {
-            debug("Transitioning to ERROR state. And returning -1.\n");
-            printf("Transitioning to ERROR state. And returning -1.\n");
-            
-            int fileno_tu = tu->head->connfd;
-
-            tu_reader_leaves(tu);
-
-            P(&(tu->tu_lock));                      // Writer entered CS of tu->head.
-            tu->head->state = tu_state_names[TU_ERROR];                       // Then the originating TU will transition to the ERROR state.
-            V(&(tu->tu_lock));                      // Writer leaves CS of tu->head.
-
-            fprintf(stream, "%s\n", tu_state_names[TU_ERROR]);                         // Place characters into the stream.
-            fclose(stream);                                             // Close the stream. Closing the stream frees the dynamic buffer.
-            Rio_writen(fileno_tu, bp, size);                        // Write characters in 'stream' to tu's connected descriptor.
-            free(bp);
-            return -1;
-        }
-
-        if(strcmp(tu->head->state, tu_state_names[TU_DIAL_TONE]) != 0)        // If target is NULL and 'tu' is not in DIAL_TONE state, then no effect.
-        {
-            debug("Target's state is not DIAL TONE, there will be no effect. Returning 0.\n");
-            printf("Target's state is not DIAL TONE, there will be no effect. Returning 0.\n");
-            fprintf(stream, "%s", tu->head->state);                           // Place characters into the stream.
-            fflush(stream);
-
-            int fileno_tu = tu->head->connfd;
-            int fileno_peer_tu;
-            char *peer_tu_state;
-            (void) fileno_peer_tu;
-            (void) peer_tu_state;
-            if (tu->head->peer)
-            {
-                fileno_peer_tu = tu->head->peer->head->connfd;
-                peer_tu_state = strdup(tu->head->peer->head->state);
-            }
-            char *tu_state = strdup(tu->head->state);
-            
-            tu_reader_leaves(tu);
-
-            if (strcmp(tu_state, tu_state_names[TU_CONNECTED]) == 0)       // If tu is in CONNECTED state,
-                fprintf(stream, " %d\n", fileno_peer_tu);               // Print notification.
-            else if (strcmp(tu_state, tu_state_names[TU_ON_HOOK]) == 0)    // If tu in in ON HOOK state
-                fprintf(stream, " %d\n", fileno_tu);                    // Print notification.
-            else
-                fprintf(stream, "\n");                                      // Print notification.
-            fclose(stream);                                                 // Close the stream. Closing the stream frees the dynamic buffer.
-            Rio_writen(fileno_tu, bp, size);                            // Write characters in 'stream' to tu's connected descriptor.
-            free(bp);
-            free(tu_state);
-            if (tu->head->peer)
-                free(peer_tu_state);
-
-            return 0;
-        }
-        else
-        {
-            debug("Control should not reach here.\n");
-            printf("Control should not reach here.\n");
-            tu_reader_leaves(tu);
-            return -1;
-        }
-    }
-    if (target)                                                             // If 'target' is not NULL,
-    {
-
-        if (strcmp(tu->head->state, tu_state_names[TU_DIAL_TONE]) != 0)           // If 'target' is not NULL and if tu is not in DIAL TONE state, then no effect.
-        {
-            debug("Origination TU is not in DIAL TONE state. There is no effect. Returning 0.\n");
-            printf("Origination TU is not in DIAL TONE state. There is no effect. Returning 0.\n");
-            fprintf(stream, "%s", tu->head->state);                               // Place characters into the stream.
-            fflush(stream);                                                 // Flush the stream.
-
-            int fileno_tu = tu->head->connfd;
-            int fileno_peer_tu;
-            char *peer_tu_state;
-            (void) fileno_peer_tu;
-            (void) peer_tu_state;
-            if (tu->head->peer)
-            {
-                fileno_peer_tu = tu->head->peer->head->connfd;
-                peer_tu_state = strdup(tu->head->peer->head->state);
-            }
-            char *tu_state = strdup(tu->head->state);
-
-            tu_reader_leaves(tu);
-            
-            if (strcmp(tu_state, tu_state_names[TU_CONNECTED]) == 0)       // If tu is in CONNECTED state, print notif.
-                fprintf(stream, " %d\n", fileno_peer_tu);
-            else if (strcmp(tu_state, tu_state_names[TU_ON_HOOK]) == 0)    // If tu in in ON HOOK state, print notif.
-                fprintf(stream, " %d\n", fileno_tu);
-            else
-                fprintf(stream, "\n");                                      // Print notif.
-
-            fclose(stream);                                                 // Close the stream. Closing the stream frees the dynamic buffer.
-            Rio_writen(tu_fileno(tu), bp, size);                            // Write characters in 'stream' to tu's connected descriptor.
-            free(bp);
-            free(tu_state);
-            if (tu->head->peer)
-                free(peer_tu_state);
-
-            return 0;
-        }
-        
-        if (target == tu)                                                   // It target is defined, and if 'target' is the same as 'tu', then 'tu' transitions to BUSY_SIGNAL state.
-        {
-            debug("Target TU and origination TU are the same. Origination TU transitioning to BUSY SIGNAL.\n");
-            printf("Target TU and origination TU are the same. Origination TU transitioning to BUSY SIGNAL.\n");
-
-            int fileno_tu = tu->head->connfd;
-
-            tu_reader_leaves(tu);
-            
-            P(&tu->tu_lock);                                    // Writer tries to enter CS of tu->head.
-            tu->head->state = tu_state_names[TU_BUSY_SIGNAL];         // Writer enters CS, writes to tu->head.
-            V(&tu->tu_lock);                                    // Writer leaves CS.
-            
-            fprintf(stream, "%s\n", tu_state_names[TU_BUSY_SIGNAL]);                 // Place characters into the stream.
-            fclose(stream);                                     // Close the stream. Closing the stream frees the dynamic buffer.
-            Rio_writen(fileno_tu, bp, size);                // Write characters in 'stream' to tu's connected descriptor.
-            free(bp);
-
-            return 0;
-        }
-        
-        tu_reader_enters(target);
-        
-        if ((target->head->peer) || (strcmp(target->head->state, tu_state_names[TU_ON_HOOK]) != 0)) // If target TU already has a peer or if target TU  is not in the ON HOOK state, then originating TU transitions to BUSY SIGNAL state.
-        {
-            debug("Target TU already has a peer, or target TU is not on ON HOOK state. Originating TU transitioning to BUSY SIGNAL state.\n");
-            printf("Target TU already has a peer, or target TU is not on ON HOOK state. Originating TU transitioning to BUSY SIGNAL state.\n");
-
-            int fileno_tu = tu->head->connfd;
-
-            tu_reader_leaves(target);
-            
-            tu_reader_leaves(tu);
-            
-            P(&tu->tu_lock);                            // Writer trying to enter CS of tu->head.
-            tu->head->state = tu_state_names[TU_BUSY_SIGNAL];     // Change origin tu's state to BUSY SIGNAL.
-            V(&tu->tu_lock);                            // Writer leaves CS of tu->head.
-            
-            fprintf(stream, "%s\n", tu_state_names[TU_BUSY_SIGNAL]);             // Place characters into the stream.
-            fclose(stream);                                 // Close the stream. Closing the stream frees the dynamic buffer.
-            Rio_writen(fileno_tu, bp, size);            // Write characters in 'stream' to tu's connected descriptor.
-            free(bp);
-
-            return 0;
-        }
-
-        if ((!target->head->peer) && (strcmp(target->head->state, tu_state_names[TU_ON_HOOK]) == 0))    // If target tu does not have a peer and it is in ON HOOK state, then connect origination tu and target tu and make them peers.
-        {
-            debug("Target TU does not have a peer and it is in ON HOOK state. Recording originating TU and target TU as peers.\n");
-            printf("Target TU does not have a peer and it is in ON HOOK state. Recording originating TU and target TU as peers.\n");
-
-            int fileno_tu = tu->head->connfd;
-            int fileno_target = target->head->connfd;
-
-            tu_reader_leaves(target);
-            
-            tu_reader_leaves(tu);
-            
-            // Write to tu->head and target->head simultaneously.
-            if (tu < target)    // If tu is a lower address than target, lock in this particular order.
-            {
-                debug("tu is a lower address than target. Locking tu and target state mutexes in order 1.\n");
-                P(&(tu->tu_lock));          // Writer is trying to enter CS of tu->head.
-                P(&(target->tu_lock));      // Writer is trying to enter CS of target->head.
-            }
-            else
-            {
-                debug("tu is a greater address than target. Locking tu and target state mutexes in order 2.\n");
-                P(&(target->tu_lock));  // Writer is trying to enter CS of target->head.
-                P(&(tu->tu_lock));  // Writer is trying to enter CS of tu->head.
-            }
-            
-            // P(&tu->state_mutex);                            // Protect the update of `tu->state` by surrounding it with P and V operations.
-            tu->head->state = tu_state_names[TU_RING_BACK];       // Writer writes in CS of tu->head. Assign tu's state to RING BACK.
-            target->head->state = tu_state_names[TU_RINGING];   // Writer writes in CS of target->head. Assign target's state to RINGING.
-            tu->head->peer = target;        // Writer writes in CS of tu->head. Assign tu->head->peer.
-            target->head->peer = tu;    // Writer writes in CS of target->head. Assign target->head->peer.
-            
-            V(&(target->tu_lock));      // Writer leaves CS of target->head.
-            V(&(tu->tu_lock));          // Writer leaves CS of tu->head.
-
-            fprintf(stream, "%s\n",  tu_state_names[TU_RING_BACK]);             // Place characters into the stream.
-            fclose(stream);
-            Rio_writen(fileno_tu, bp, size);            // Write characters in 'stream' to tu's connected descriptor.
-            free(bp);
-            
-            char *bp2;                                              // Declare a char buffer pointer to be used in another stream.
-            size_t size2;                                           // Declare size location.
-            FILE *stream2;                                          // Declare a FILE pointer.
-            stream2 = open_memstream(&bp2, &size2);                 // Create another stream.
-            fprintf(stream2, "%s\n", tu_state_names[TU_RINGING]);                // Place characters into the stream.
-            fclose(stream2);
-            Rio_writen(fileno_target, bp2, size2);      // Write characters in 'stream2' to targets's connected descriptor.
-            free(bp2);
-            
-            return 0;
-        }
-
-        debug("No conditions met in tu_dial. Returning -1.\n");
-        printf("No conditions met in tu_dial. Returning -1.\n");
-
-        tu_reader_leaves(tu);
-        tu_reader_leaves(target);
-        return -1;
-    }
-    
-    debug("No conditions met in tu_dial. Returning -1.\n");
-    tu_reader_leaves(tu);
-    return -1;
+    debug("Inside tu_dial().\n");
+    return tu_dispatch(tu, TU_DIAL_CMD, target, NULL);
 }
 #endif
 
@@ -467,331 +847,40 @@ int tu_dial(TU *tu, TU *target) {
  *
  * @param tu  The TU that is to be picked up.
  * @return 0 if successful, -1 if any error occurs that results in the originating
- * TU transitioning to the TU_ERROR state. 
+ * TU transitioning to the TU_ERROR state.
  */
 #if 1
 int tu_pickup(TU *tu) {
-    char *bp;                                       // Declare a char buffer pointer.
-    size_t size;                                    // Declare size location.
-    FILE *stream;                                   // Declare a FILE pointer.
-    stream = open_memstream(&bp, &size);
-
-    tu_reader_enters(tu);
-    
-    if ((strcmp(tu->head->state, tu_state_names[TU_ON_HOOK]) != 0) && (strcmp(tu->head->state, tu_state_names[TU_RINGING]) != 0))
-    {
-        debug("TU is not in ON HOOK or RINGING state. No effect. Returning 0.\n");
-        fprintf(stream, "%s", tu->head->state);    // Place characters into the stream.
-        fflush(stream);
-        
-        if (strcmp(tu->head->state, tu_state_names[TU_CONNECTED]) == 0)       // If tu is in CONNECTED state, print notif.
-            fprintf(stream, " %d\n", tu_fileno(tu->head->peer));
-        else if (strcmp(tu->head->state, tu_state_names[TU_ON_HOOK]) == 0)    // If tu in in ON HOOK state, print notif.
-            fprintf(stream, " %d\n", tu_fileno(tu));
-        else
-            fprintf(stream, "\n");                                      // Print notif.
-
-        fclose(stream);                                                 // Close the stream. Closing the stream frees the dynamic buffer.
-        Rio_writen(tu_fileno(tu), bp, size);                            // Write characters in 'stream' to tu's connected descriptor.
-        free(bp);
-
-        tu_reader_leaves(tu);
-        return 0;
-    }
-    
-    if (strcmp(tu->head->state, tu_state_names[TU_ON_HOOK]) == 0)
-    {
-        debug("TU is in ON HOOK state. TU will transition to DIAL TONE state. Returning 0.\n");
-
-        tu_reader_leaves(tu);
-        
-        P(&tu->tu_lock);        // Writer enteres CS of tu->head.
-        tu->head->state = tu_state_names[TU_DIAL_TONE];       // Writer writes to CS of tu->head. tu will transition to DIAL TONE state.
-        V(&tu->tu_lock);        // Writer leaves CS of tu->head.
-
-        fprintf(stream, "%s\n", tu_state_names[TU_DIAL_TONE]);             // Place characters into the stream.
-        fclose(stream);
-        Rio_writen(tu_fileno(tu), bp, size);            // Write characters in 'stream' to tu's connected descriptor.
-        free(bp);
-        return 0;
-    }
-    
-    if (strcmp(tu->head->state, tu_state_names[TU_RINGING]) == 0)
-    {
-        debug("Tu is in RINGING state. Tu will transition to CONNECTED state.");
-        
-        tu_reader_leaves(tu);
-        
-        if (tu < tu->head->peer)    // If tu is a lower address than its peer, lock in this particular order.
-        {
-            debug("tu is a lower address than tu->peer. Locking tu and target state mutexes in order 1.\n");
-            P(&(tu->tu_lock));              // Writer tries to enter CS of tu->head.
-            P(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_peer->head.
-        }
-        else
-        {
-            debug("tu is a greater address than tu->peer. Locking tu and target state mutexes in order 2.\n");
-            P(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_peer->head.
-            P(&(tu->tu_lock));  // Writer tries to enter CS of tu->head.
-        }
-
-
-        tu->head->state = tu_state_names[TU_CONNECTED];               // Change tu's state to CONNECTED.
-        tu->head->peer->head->state = tu_state_names[TU_CONNECTED];          // Change peer_tu's state to CONNECTED.
-        V(&tu->head->peer->tu_lock);                                     // Writer leaves Cs of tu->head.
-        V(&tu->tu_lock);                                     // Writer leaves Cs of tu_peer->head.
-
-        fprintf(stream, "%s", tu_state_names[TU_CONNECTED]);                       // Print tu's notification.
-        fflush(stream);
-        fprintf(stream, " %d\n", tu_fileno(tu->head->peer));
-        fclose(stream);
-        Rio_writen(tu_fileno(tu), bp, size);                    // Write characters in 'stream' to tu's connected descriptor.
-        free(bp);
-
-        char *bp2;                                              // Declare a char buffer pointer to be used in another stream.
-        size_t size2;                                           // Declare size location.
-        FILE *stream2;                                          // Declare a FILE pointer.
-        stream2 = open_memstream(&bp2, &size2);                 // Create another stream.
-        fprintf(stream2, "%s", tu_state_names[TU_CONNECTED]);                      // Print peer_tu's notification.
-        fflush(stream2);
-        fprintf(stream2, " %d\n", tu_fileno(tu));                  
-        fclose(stream2);
-        Rio_writen(tu_fileno(tu->head->peer), bp2, size2);             // Write characters in 'stream2' to peer_tu's connected descriptor.
-        free(bp2);
-
-        tu_ref(tu, "tu_pickup");                                // Increment tu's reference count.
-        tu_ref(tu->head->peer, "tu_pickup");                           // Increment peer_tu's reference count.
-        
-        return 0;
-    }
-    tu_reader_leaves(tu);
-    
-    debug("No conditions met in tu_pickup(). Returning -1.\n");
-    return -1;
-    // abort();
+    debug("Inside tu_pickup().\n");
+    return tu_dispatch(tu, TU_PICKUP_CMD, NULL, NULL);
 }
 #endif
 
 /*
+ * Hang up a TU (i.e. replace the handset on the switchhook).
+ *
+ *   If the TU is in the TU_CONNECTED or TU_RINGING state, then it goes to the
+ *     TU_ON_HOOK state.  In addition, in this case the peer TU (the one to which
+ *     the call is currently connected) simultaneously transitions to the TU_DIAL_TONE
+ *     state.
+ *   If the TU was in the TU_RING_BACK state, then it goes to the TU_ON_HOOK state.
+ *     In addition, in this case the calling TU (which is in the TU_RINGING state)
+ *     simultaneously transitions to the TU_ON_HOOK state.
+ *   If the TU was in the TU_DIAL_TONE, TU_BUSY_SIGNAL, or TU_ERROR state,
+ *     then it goes to the TU_ON_HOOK state.
+ *   If the TU was in any other state, then there is no effect.
+ *
+ * A TU that is no longer registered (its extension is -1) is hung up the same
+ * way, except that its own client, which is gone, is not notified.
+ *
  * @param tu  The tu that is to be hung up.
  * @return 0 if successful, -1 if any error occurs that results in the originating
- * TU transitioning to the TU_ERROR state. 
+ * TU transitioning to the TU_ERROR state.
  */
 #if 1
 int tu_hangup(TU *tu) {
     debug("Inside tu_hangup().\n");
-
-    tu_reader_enters(tu);
-
-    if (tu->head->connfd == -1)
-    {
-        debug("Tu's connfd is -1. Going to unref tu's peer if it has one and set 'peer' to NULL.\n");
-
-        if (tu->head->peer)
-        {
-            debug("Tu has a peer. Going to transition the peer tu's state to DIAL TONE, unreference peer_tu, and set 'peer' to NULL for both.\n");
-
-            int tu_peer_fileno = tu->head->peer->head->connfd;
-            
-            tu_reader_leaves(tu);
-            
-            tu_unref(tu->head->peer, "Peer tu disconnected.");     // Decrement peer_tu's reference count.
-            tu_unref(tu, "Tu has disconnected.");           // Decrement tu's reference count.
-
-            if (tu < tu->head->peer)    // If tu is a lower address than its peer, lock in this particular order.
-            {
-                debug("tu is a lower address than tu->peer. Locking tu and target peer mutexes in order 1.\n");
-                P(&(tu->tu_lock));              // Writer tries to enter CS of tu->head.
-                P(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_PEER->head.
-            }
-            else
-            {
-                debug("tu is a greater address than tu->peer. Locking tu and target peer mutexes in order 2.\n");
-                P(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_peer->head.
-                P(&(tu->tu_lock));  // Writer tries to enter CS of tu->head.
-            }
-
-            tu->head->peer->head->state = tu_state_names[TU_DIAL_TONE];  // Writer writes in CS of tu_peer->head. Changing peer tu's state to DIAL TONE state.
-            
-
-            tu->head->peer->head->peer = NULL;      // Writer writes in Cs of tu_peer->head. Assigns its peer value to NULL.
-            V(&(tu->head->peer->tu_lock));  // Writer leaves CS of tu_PEER->head.
-            tu->head->peer = NULL;                // Writer writes in Cs of tu->head. Assigns its peer value to NULL.
-            V(&(tu->tu_lock));              // Writer leaves CS of tu->head.
-            
-            char *bp;                                       // Declare a char buffer pointer.
-            size_t size;                                    // Declare size location.
-            FILE *stream;                                   // Declare a FILE pointer.
-            stream = open_memstream(&bp, &size);
-
-            fprintf(stream, "%s\n", tu_state_names[TU_DIAL_TONE]);        // Print the notification.
-            fclose(stream);
-            Rio_writen(tu_peer_fileno, bp, size);            // Write the notification to peer_tu's connfd.
-            free(bp);
-            free(tu->head);
-
-            return 0;
-        }
-        else
-        {
-            tu_reader_leaves(tu);
-
-            debug("Tu did not have a peer. Going to unref tu.");
-            tu_unref(tu, "Tu has disconnected");
-            free(tu->head);
-            return 0;
-        }
-    }
-
-    char *bp;                                       // Declare a char buffer pointer.
-    size_t size;                                    // Declare size location.
-    FILE *stream;                                   // Declare a FILE pointer.
-    stream = open_memstream(&bp, &size);
-
-    if ((strcmp(tu->head->state, tu_state_names[TU_CONNECTED]) == 0) ||
-        (strcmp(tu->head->state, tu_state_names[TU_RINGING]) == 0))
-    {
-        debug("Tu is in the CONNECTED or RINGING state. Tu is transitioning to ON HOOK state. The peer tu simulatenously transition to DIAL TONE. Returning 0.\n");
-        
-        int fileno_tu = tu->head->connfd;
-        int fileno_peer_tu = tu->head->peer->head->connfd;
-
-        tu_reader_leaves(tu);
-        
-        if (strcmp(tu->head->state, tu_state_names[TU_CONNECTED]) == 0)   // If tu is in CONNECTED state,
-        {
-            tu_unref(tu, "tu_hangup");                          // Decrement tu reference count.
-            tu_unref(tu->head->peer, "tu_hangup");                     // Decrement peer_tu reference count.
-        }
-
-        if (tu < tu->head->peer)    // If tu is a lower address than its peer, lock in this particular order.
-        {
-            debug("tu is a lower address than tu->peer. Locking tu and target peer mutexes in order 1.\n");
-            P(&(tu->tu_lock));              // Writer tries to enter CS of tu->head.
-            P(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_PEER->head.
-        }
-        else
-        {
-            debug("tu is a greater address than tu->peer. Locking tu and target peer mutexes in order 2.\n");
-            P(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_peer->head.
-            P(&(tu->tu_lock));  // Writer tries to enter CS of tu->head.
-        }
-
-        tu->head->state = tu_state_names[TU_ON_HOOK];                 // Change tu's state to ON HOOK.
-        tu->head->peer->head->state = tu_state_names[TU_DIAL_TONE];          // Change peer_tu's state to DIAL TONE.
-        tu->head->peer->head->peer = NULL;
-        V(&(tu->head->peer->tu_lock));  // Writer tries to leave CS of tu_PEER->head.
-        tu->head->peer = NULL;
-        V(&(tu->tu_lock));              // Writer tries to leave CS of tu->head.
-
-        fprintf(stream, "%s", tu_state_names[TU_ON_HOOK]);                       // Place characters into the stream.
-        fflush(stream);
-        fprintf(stream, " %d\n", fileno_tu);            // Add descriptor number to the notification.
-        fclose(stream);
-        Rio_writen(fileno_tu, bp, size);                    // Write characters in 'stream' to tu's connected descriptor.
-        free(bp);
-
-        char *bp2;                                              // Declare a char buffer pointer to be used in another stream.
-        size_t size2;                                           // Declare size location.
-        FILE *stream2;                                          // Declare a FILE pointer.
-        stream2 = open_memstream(&bp2, &size2);                 // Create another stream.
-        fprintf(stream2, "%s\n", tu_state_names[TU_DIAL_TONE]);                 // Place characters into the stream.
-        fclose(stream2);
-        Rio_writen(fileno_peer_tu, bp2, size2);             // Write characters in 'stream2' to targets's connected descriptor.
-        free(bp2);
-
-        return 0;
-    }
-
-    if (strcmp(tu->head->state, tu_state_names[TU_RING_BACK]) == 0)
-    {
-        debug("Tu is in RING BACK state. Tu is transitioning to ON HOOK state. The peer tu simultaneously transitions from RINGING to ON HOOK state. Returning 0.\n");
-        
-        int fileno_tu = tu->head->connfd;
-        int fileno_peer_tu = tu->head->peer->head->connfd;
-
-        tu_reader_leaves(tu);
-        
-        if (tu < tu->head->peer)    // If tu is a lower address than its peer, lock in this particular order.
-        {
-            debug("tu is a lower address than tu->peer. Locking tu and target peer mutexes in order 1.\n");
-            P(&(tu->tu_lock));              // Writer tries to enter CS of tu->head.
-            P(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_PEER->head.
-        }
-        else
-        {
-            debug("tu is a greater address than tu->peer. Locking tu and target peer mutexes in order 2.\n");
-            P(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_peer->head.
-            P(&(tu->tu_lock));  // Writer tries to enter CS of tu->head.
-        }
-
-        tu->head->state = tu_state_names[TU_ON_HOOK];         // Change the tu->state to ON HOOK.
-        tu->head->peer->head->state = tu_state_names[TU_ON_HOOK];    // Change the peer_tu->state to ON HOOK.
-
-        V(&(tu->head->peer->tu_lock));  // Writer tries to enter CS of tu_PEER->head.
-        V(&(tu->tu_lock));              // Writer tries to enter CS of tu->head.
-
-        fprintf(stream, "%s", tu_state_names[TU_ON_HOOK]);              // Place characters into the stream.
-        fflush(stream);
-        fprintf(stream, " %d\n", fileno_tu);       // Place more characters into the stream.
-        fclose(stream);
-        Rio_writen(fileno_tu, bp, size);            // Write characters in 'stream' to tu's connected descriptor.
-        free(bp);
-
-        char *bp2;                                              // Declare a char buffer pointer to be used in another stream.
-        size_t size2;                                           // Declare size location.
-        FILE *stream2;                                          // Declare a FILE pointer.
-        stream2 = open_memstream(&bp2, &size2);                 // Create another stream.
-        fprintf(stream2, "%s", tu_state_names[TU_ON_HOOK]);                 // Place characters into the stream.
-        fflush(stream2);
-        fprintf(stream2, " %d\n", fileno_peer_tu);          // Place more characters into the stream.
-        fclose(stream2);
-        Rio_writen(fileno_peer_tu, bp2, size2);             // Write characters in 'stream2' to targets's connected descriptor.
-        free(bp2);
-
-        return 0;
-    }
-
-    if ((strcmp(tu->head->state, tu_state_names[TU_DIAL_TONE]) == 0) ||
-        (strcmp(tu->head->state, tu_state_names[TU_BUSY_SIGNAL]) == 0) || 
-        (strcmp(tu->head->state, tu_state_names[TU_ERROR]) == 0))
-    {
-        debug("Tu is in DIAL TONE, BUSY SIGNAL, or ERROR state. Tu is transitioning to ON HOOK state. Returning 0.\n");
-        
-        int fileno_tu = tu->head->connfd;
-
-        tu_reader_leaves(tu);
-
-        P(&tu->tu_lock);                    // Protect the update of `tu->state` by surrounding it with P and V operations.
-        tu->head->state = tu_state_names[TU_ON_HOOK];
-        V(&tu->tu_lock);                    // Protect the update of `tu->state` by surrounding it with P and V operations.
-
-        fprintf(stream, "%s", tu_state_names[TU_ON_HOOK]);                  // Place characters into the stream.
-        fflush(stream);
-        fprintf(stream, " %d\n", fileno_tu);           // Place more characters into the stream.
-        fclose(stream);
-        Rio_writen(tu_fileno(tu), bp, size);                // Write characters in 'stream' to tu's connected descriptor.
-        free(bp);
-
-        return 0;
-    }
-
-    debug("No conditions met in tu_hangup(). Returning -1.\n");
-    
-    int fileno_tu = tu->head->connfd;
-    char *tu_state = strdup(tu->head->state);
-    
-    tu_reader_leaves(tu);
-    
-    fprintf(stream, "%s", tu_state);                  // Place characters into the stream.
-    fflush(stream);
-    fprintf(stream, " %d\n", fileno_tu);           // Place more characters into the stream.
-    fclose(stream);
-    Rio_writen(fileno_tu, bp, size);                // Write characters in 'stream' to tu's connected descriptor.
-    free(bp);
-    free(tu_state);
-    return -1;
-    // abort();
+    return tu_dispatch(tu, TU_HANGUP_CMD, NULL, NULL);
 }
 #endif
 
@@ -803,6 +892,9 @@ int tu_hangup(TU *tu) {
  * In all cases, the states of the TUs are left unchanged and a notification containing
  * the current state is sent to the TU sending the chat.
  *
+ * A TU in a conference room sends the message to the other members of the room
+ * instead.
+ *
  * @param tu  The tu sending the chat.
  * @param msg  The message to be sent.
  * @return 0  If the chat was successfully sent, -1 if there is no call in progress
@@ -811,66 +903,97 @@ int tu_hangup(TU *tu) {
 #if 1
 int tu_chat(TU *tu, char *msg) {
     debug("Inside tu_chat().\n");
-    char *bp;                                       // Declare a char buffer pointer.
-    size_t size;                                    // Declare size location.
-    FILE *stream;                                   // Declare a FILE pointer.
-    stream = open_memstream(&bp, &size);
-
-    tu_reader_enters(tu);
+    if (tu->room != NULL)                       // Read without the lock: only this client's commands change it.
+    {
+        conf_say(tu->room, tu->outq, msg, tu_batch.depth > 0);
+        P(&(tu->tu_lock));
+        tu_report(tu);
+        V(&(tu->tu_lock));
+        return 0;
+    }
+    return tu_dispatch(tu, TU_CHAT_CMD, NULL, msg);
+}
+#endif
 
-    int fileno_tu = tu->head->connfd;
+/*
+ * Dial a TU, and if its line is busy, wait for it to come free, with a busy
+ * signal, then ring it.  A TU that camps on itself gets a busy signal, as if
+ * it had dialed itself.
+ *
+ * @param tu  The originating TU.
+ * @param target  The target TU, or NULL if the extension is not registered.
+ * @return 0 if successful, -1 if the originating TU went to the TU_ERROR state.
+ */
+int tu_camp(TU *tu, TU *target) {
+    debug("Inside tu_camp().\n");
+    if (target == tu)
+        return tu_dispatch(tu, TU_DIAL_CMD, target, NULL);
+    return tu_dispatch(tu, TU_CAMP_CMD, target, NULL);
+}
 
-    if (strcmp(tu->head->state, tu_state_names[TU_CONNECTED]) != 0)
+/*
+ * Make a TU a member of a hunt group, taking it out of any group it was in.
+ * The TU's current state is reported to its client either way.
+ *
+ * @param tu  The TU.
+ * @param group  The group, or NULL if the extension given is not a pilot.
+ * @return 0 if the TU joined the group, -1 if there is no such group or it
+ * is full, in which case the TU stays in the group it was in.
+ */
+int tu_join(TU *tu, HUNT_GROUP *group) {
+    debug("Inside tu_join().\n");
+    int result = -1;
+    P(&(tu->tu_lock));
+    if (group != NULL && tu->ext != -1)
     {
-        debug("Tu is not in CONNECTED state. Nothing will happen. Return -1.\n");
-        fprintf(stream, "%s", tu->head->state);    // Place characters into the stream.
-        fflush(stream);
-        
-        if (strcmp(tu->head->state, tu_state_names[TU_ON_HOOK]) == 0)    // If tu in in ON HOOK state
-            fprintf(stream, " %d\n", fileno_tu);
-        else
-            fprintf(stream, "\n");
-        
+        HUNT_MEMBER *member = hunt_add(group, tu, tu_state(tu) == TU_ON_HOOK);
+        if (member != NULL)
+        {
+            if (tu->hunt != NULL)
+                hunt_remove(tu->hunt);
+            tu->hunt = member;
+            result = 0;
+        }
+    }
+    tu_report(tu);
+    V(&(tu->tu_lock));
+    return result;
+}
 
-        tu_reader_leaves(tu);
+/*
+ * Dial the member of a hunt group chosen by hunt_dial().
+ *
+ * @param tu  The originating TU.
+ * @param member  The member, or NULL if no member is idle.
+ * @return 0 if successful, -1 if the originating TU went to the TU_ERROR state,
+ * or TU_RESULT_MISSED if the member is no longer on hook.
+ */
+int tu_hunt(TU *tu, TU *member) {
+    debug("Inside tu_hunt().\n");
+    return tu_dispatch(tu, TU_HUNT_CMD, member, NULL);
+}
 
-        fclose(stream);                                 // Close the stream. Closing the stream frees the dynamic buffer.
-        Rio_writen(fileno_tu, bp, size); // Write characters in 'stream' to tu's connected descriptor.
-        free(bp);
-        return -1;
-    }
-    else
+/*
+ * Take a TU that hears a dial tone into a conference room, out of any room it
+ * was in.  See conf.h.  The TU's current state is reported to its client
+ * either way.
+ *
+ * @param tu  The TU.
+ * @param room  The number of the room.
+ * @return 0 if the TU joined the room, -1 if it is not in TU_DIAL_TONE.
+ */
+int tu_conf(TU *tu, int room) {
+    debug("Inside tu_conf().\n");
+    int result = -1;
+    P(&(tu->tu_lock));
+    if (tu_state(tu) == TU_DIAL_TONE && tu->ext != -1 && room >= 0)
     {
-        debug("Tu is in CONNECTED state. msg will be sent to peer tu. Returning 0.\n");
-
-        int fileno_tu = tu->head->connfd;
-        int fileno_peer_tu = tu->head->peer->head->connfd;
-        char *tu_state = strdup(tu->head->state);
-        
-        tu_reader_leaves(tu);
-
-        fprintf(stream, "%s", "CHAT");
-        fflush(stream);
-        fprintf(stream, " %s", msg);
-        fclose(stream);
-        Rio_writen(fileno_peer_tu, bp, size);
-        free(bp);
-
-        // Write notification to sending Tu.
-        char *bp2;                                              // Declare a char buffer pointer to be used in another stream.
-        size_t size2;                                           // Declare size location.
-        FILE *stream2;                                          // Declare a FILE pointer.
-        stream2 = open_memstream(&bp2, &size2);                 // Create another stream.
-
-        fprintf(stream2, "%s", tu_state);                      // Place characters into the stream.
-        fflush(stream2);
-        fprintf(stream2, " %d\n", fileno_peer_tu);          // Place more characters into the stream.
-        fclose(stream2);
-        Rio_writen(fileno_tu, bp2, size2);                  // Write characters in 'stream' to tu's connected descriptor.
-        free(bp2);
-        
-        free(tu_state);
-        return 0;
+        if (tu->room != NULL)
+            conf_leave(tu->room, tu->outq);
+        tu->room = conf_join(room, tu->outq);
+        result = 0;
     }
+    tu_report(tu);
+    V(&(tu->tu_lock));
+    return result;
 }
-#endif
@@ -0,0 +1,118 @@
+/*
+ * Transition table of the TU state machine.
+ */
+#include "tu_table.h"
+
+#define ANY_PEER 0 ... TU_NUM_PEER_STATES-1
+
+#define STAY(state, result)             { TU_ACT_STAY, state, 0, result }
+#define IGNORE(state)                   { TU_ACT_IGNORE, state, 0, 0 }
+#define SELF(next, result)              { TU_ACT_SELF, next, 0, result }
+#define PAIR(action, next, peer_next)   { action, next, peer_next, 0 }
+#define RETRY                           { TU_ACT_RETRY, 0, 0, 0 }
+#define CAMP(state)                     { TU_ACT_CAMP, TU_BUSY_SIGNAL, state, 0 }
+#define MISS(state)                     { TU_ACT_IGNORE, state, 0, TU_RESULT_MISSED }
+
+/*
+ * Camping on a line that is off hook, whatever it is doing.
+ */
+#define CAMP_BUSY \
+    [TU_RINGING] = CAMP(TU_RINGING), [TU_DIAL_TONE] = CAMP(TU_DIAL_TONE), \
+    [TU_RING_BACK] = CAMP(TU_RING_BACK), [TU_BUSY_SIGNAL] = CAMP(TU_BUSY_SIGNAL), \
+    [TU_CONNECTED] = CAMP(TU_CONNECTED), [TU_ERROR] = CAMP(TU_ERROR)
+
+/*
+ * A TU in TU_ON_HOOK, TU_DIAL_TONE, TU_BUSY_SIGNAL or TU_ERROR has no peer, so
+ * its row does not depend on the peer state, except for the target of a dial.
+ * A TU in TU_RINGING, TU_RING_BACK or TU_CONNECTED always has a peer in the
+ * matching state; any other combination was read while another thread was
+ * changing the pair, and is looked up again.  A ring timeout only has an effect
+ * on a TU that is still ringing; in any other state the call it was set for has
+ * already been answered or abandoned.  A TU camps on a line from TU_DIAL_TONE,
+ * as it would dial it, and waits in TU_BUSY_SIGNAL; when it is called back, the
+ * line is rung if it is still free, and otherwise the TU goes on waiting.  A
+ * callback to a TU that has hung up since it camped does nothing.  Dialing the
+ * pilot of a hunt group dials the member chosen, except that a member that is
+ * no longer on hook is missed rather than busy, so that another one can be
+ * chosen, and that having no member to ring is a busy signal, not an error.
+ */
+const struct tu_transition tu_transitions[TU_NUM_STATES][TU_NUM_TABLE_COMMANDS][TU_NUM_PEER_STATES] = {
+    [TU_ON_HOOK] = {
+        [TU_PICKUP_CMD] = { [ANY_PEER] = SELF(TU_DIAL_TONE, 0) },
+        [TU_HANGUP_CMD] = { [ANY_PEER] = STAY(TU_ON_HOOK, -1) },
+        [TU_DIAL_CMD]   = { [ANY_PEER] = STAY(TU_ON_HOOK, 0) },
+        [TU_CHAT_CMD]   = { [ANY_PEER] = STAY(TU_ON_HOOK, -1) },
+        [TU_TIMEOUT_CMD] = { [ANY_PEER] = IGNORE(TU_ON_HOOK) },
+        [TU_CAMP_CMD]   = { [ANY_PEER] = STAY(TU_ON_HOOK, 0) },
+        [TU_CALLBACK_CMD] = { [ANY_PEER] = IGNORE(TU_ON_HOOK) },
+        [TU_HUNT_CMD]   = { [ANY_PEER] = STAY(TU_ON_HOOK, 0) },
+    },
+    [TU_RINGING] = {
+        [TU_PICKUP_CMD] = { [ANY_PEER] = RETRY, [TU_RING_BACK] = PAIR(TU_ACT_ANSWER, TU_CONNECTED, TU_CONNECTED) },
+        [TU_HANGUP_CMD] = { [ANY_PEER] = RETRY, [TU_RING_BACK] = PAIR(TU_ACT_UNLINK, TU_ON_HOOK, TU_DIAL_TONE) },
+        [TU_DIAL_CMD]   = { [ANY_PEER] = STAY(TU_RINGING, 0) },
+        [TU_CHAT_CMD]   = { [ANY_PEER] = STAY(TU_RINGING, -1) },
+        [TU_TIMEOUT_CMD] = { [ANY_PEER] = RETRY, [TU_RING_BACK] = PAIR(TU_ACT_UNLINK, TU_ON_HOOK, TU_DIAL_TONE) },
+        [TU_CAMP_CMD]   = { [ANY_PEER] = STAY(TU_RINGING, 0) },
+        [TU_CALLBACK_CMD] = { [ANY_PEER] = IGNORE(TU_RINGING) },
+        [TU_HUNT_CMD]   = { [ANY_PEER] = STAY(TU_RINGING, 0) },
+    },
+    [TU_DIAL_TONE] = {
+        [TU_PICKUP_CMD] = { [ANY_PEER] = STAY(TU_DIAL_TONE, 0) },
+        [TU_HANGUP_CMD] = { [ANY_PEER] = SELF(TU_ON_HOOK, 0) },
+        [TU_DIAL_CMD]   = { [ANY_PEER] = SELF(TU_BUSY_SIGNAL, 0),      // Includes dialing oneself.
+                            [TU_ON_HOOK] = PAIR(TU_ACT_LINK, TU_RING_BACK, TU_RINGING),
+                            [TU_PEER_NONE] = SELF(TU_ERROR, -1) },
+        [TU_CHAT_CMD]   = { [ANY_PEER] = STAY(TU_DIAL_TONE, -1) },
+        [TU_TIMEOUT_CMD] = { [ANY_PEER] = IGNORE(TU_DIAL_TONE) },
+        [TU_CAMP_CMD]   = { CAMP_BUSY,
+                            [TU_ON_HOOK] = PAIR(TU_ACT_LINK, TU_RING_BACK, TU_RINGING),
+                            [TU_PEER_NONE] = SELF(TU_ERROR, -1) },
+        [TU_CALLBACK_CMD] = { [ANY_PEER] = IGNORE(TU_DIAL_TONE) },
+        [TU_HUNT_CMD]   = { [ANY_PEER] = MISS(TU_DIAL_TONE),
+                            [TU_ON_HOOK] = PAIR(TU_ACT_LINK, TU_RING_BACK, TU_RINGING),
+                            [TU_PEER_NONE] = SELF(TU_BUSY_SIGNAL, 0) },
+    },
+    [TU_RING_BACK] = {
+        [TU_PICKUP_CMD] = { [ANY_PEER] = STAY(TU_RING_BACK, 0) },
+        [TU_HANGUP_CMD] = { [ANY_PEER] = RETRY, [TU_RINGING] = PAIR(TU_ACT_UNLINK, TU_ON_HOOK, TU_ON_HOOK) },
+        [TU_DIAL_CMD]   = { [ANY_PEER] = STAY(TU_RING_BACK, 0) },
+        [TU_CHAT_CMD]   = { [ANY_PEER] = STAY(TU_RING_BACK, -1) },
+        [TU_TIMEOUT_CMD] = { [ANY_PEER] = IGNORE(TU_RING_BACK) },
+        [TU_CAMP_CMD]   = { [ANY_PEER] = STAY(TU_RING_BACK, 0) },
+        [TU_CALLBACK_CMD] = { [ANY_PEER] = IGNORE(TU_RING_BACK) },
+        [TU_HUNT_CMD]   = { [ANY_PEER] = STAY(TU_RING_BACK, 0) },
+    },
+    [TU_BUSY_SIGNAL] = {
+        [TU_PICKUP_CMD] = { [ANY_PEER] = STAY(TU_BUSY_SIGNAL, 0) },
+        [TU_HANGUP_CMD] = { [ANY_PEER] = SELF(TU_ON_HOOK, 0) },
+        [TU_DIAL_CMD]   = { [ANY_PEER] = STAY(TU_BUSY_SIGNAL, 0) },
+        [TU_CHAT_CMD]   = { [ANY_PEER] = STAY(TU_BUSY_SIGNAL, -1) },
+        [TU_TIMEOUT_CMD] = { [ANY_PEER] = IGNORE(TU_BUSY_SIGNAL) },
+        [TU_CAMP_CMD]   = { [ANY_PEER] = STAY(TU_BUSY_SIGNAL, 0) },
+        [TU_CALLBACK_CMD] = { CAMP_BUSY,
+                              [TU_ON_HOOK] = PAIR(TU_ACT_LINK, TU_RING_BACK, TU_RINGING),
+                              [TU_PEER_NONE] = IGNORE(TU_BUSY_SIGNAL) },
+        [TU_HUNT_CMD]   = { [ANY_PEER] = STAY(TU_BUSY_SIGNAL, 0) },
+    },
+    [TU_CONNECTED] = {
+        [TU_PICKUP_CMD] = { [ANY_PEER] = RETRY, [TU_CONNECTED] = STAY(TU_CONNECTED, 0) },
+        [TU_HANGUP_CMD] = { [ANY_PEER] = RETRY, [TU_CONNECTED] = PAIR(TU_ACT_DISCONNECT, TU_ON_HOOK, TU_DIAL_TONE) },
+        [TU_DIAL_CMD]   = { [ANY_PEER] = STAY(TU_CONNECTED, 0) },
+        [TU_CHAT_CMD]   = { [ANY_PEER] = RETRY, [TU_CONNECTED] = PAIR(TU_ACT_CHAT, TU_CONNECTED, TU_CONNECTED) },
+        [TU_TIMEOUT_CMD] = { [ANY_PEER] = IGNORE(TU_CONNECTED) },
+        [TU_CAMP_CMD]   = { [ANY_PEER] = STAY(TU_CONNECTED, 0) },
+        [TU_CALLBACK_CMD] = { [ANY_PEER] = IGNORE(TU_CONNECTED) },
+        [TU_HUNT_CMD]   = { [ANY_PEER] = STAY(TU_CONNECTED, 0) },
+    },
+    [TU_ERROR] = {
+        [TU_PICKUP_CMD] = { [ANY_PEER] = STAY(TU_ERROR, 0) },
+        [TU_HANGUP_CMD] = { [ANY_PEER] = SELF(TU_ON_HOOK, 0) },
+        [TU_DIAL_CMD]   = { [ANY_PEER] = STAY(TU_ERROR, 0) },
+        [TU_CHAT_CMD]   = { [ANY_PEER] = STAY(TU_ERROR, -1) },
+        [TU_TIMEOUT_CMD] = { [ANY_PEER] = IGNORE(TU_ERROR) },
+        [TU_CAMP_CMD]   = { [ANY_PEER] = STAY(TU_ERROR, 0) },
+        [TU_CALLBACK_CMD] = { [ANY_PEER] = IGNORE(TU_ERROR) },
+        [TU_HUNT_CMD]   = { [ANY_PEER] = STAY(TU_ERROR, 0) },
+    },
+};
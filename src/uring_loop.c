@@ -0,0 +1,395 @@
+/*
+ * io_uring loops: serve many client connections from a few threads with io_uring.
+ */
+#include <stdlib.h>
+
+#include "uring_loop.h"
+
+#ifdef PBX_IO_URING
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "client.h"
+#include "acceptor.h"
+#include "pool.h"
+#include "config.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define URING_ENTRIES 256           // Submission queue entries of each loop.
+#define URING_BATCH (URING_ENTRIES / 2)     // Most completions handled between submissions; each queues at most two requests.
+#define URING_BUFS 256              // Receive buffers of each loop. A power of two.
+#define URING_BUF_SIZE 4096         // Size of each receive buffer.
+#define URING_BGID 0                // The buffer group of the receive buffers.
+#define URING_ACCEPT_TIMER 1        // The user data of the timeout that ends a pause in accepting; no connection is at address 1.
+
+struct uring_conn {                 // A uring_conn structure contains:
+    int fd;                         // The connected descriptor,
+    int ext;                        // The extension of its TU,
+    TU *tu;                         // The TU of the client,
+    size_t len;                     // The number of bytes in 'buf',
+    char buf[MAXLINE + 1];          // Input not yet carried out, with room for a terminating NUL.
+};
+
+/*
+ * The head and tail indices of the rings are shared with the kernel.  Each
+ * side only writes its own, with release stores, and reads the other's with
+ * acquire loads.  The GCC builtins are used because the indices live in
+ * memory mapped from the kernel and are not declared _Atomic.
+ */
+struct uring_loop {                 // A uring_loop structure contains:
+    int ringfd;                     // The io_uring instance of the loop,
+    int listenfd;                   // The listening descriptor, possibly shared with other loops,
+    int cpu;                        // The CPU the loop is pinned to, or -1,
+    void *rings;                    // The mapping of the submission and completion rings,
+    size_t rings_size;              // Its size,
+    struct io_uring_sqe *sqes;      // The submission queue entries,
+    size_t sqes_size;               // Their size,
+    unsigned *sq_head;              // The submission ring, advanced by the kernel,
+    unsigned *sq_tail;              // ... and by us,
+    unsigned *sq_array;             // Its indices into 'sqes',
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;         // The tail including entries not yet published,
+    unsigned pending;               // The number of entries not yet submitted,
+    unsigned *cq_head;              // The completion ring, advanced by us,
+    unsigned *cq_tail;              // ... and by the kernel,
+    struct io_uring_cqe *cqes;
+    unsigned cq_mask;
+    struct io_uring_buf_ring *br;   // The ring of receive buffers offered to the kernel,
+    unsigned short br_tail;         // Its tail, including buffers not yet published,
+    char *bufs;                     // The receive buffers themselves,
+    struct __kernel_timespec accept_pause;  // The length of a pause in accepting.
+};
+
+static POOL uring_conn_pool = POOL_INITIALIZER(sizeof(struct uring_conn), 64);
+
+static void uring_teardown(struct uring_loop *loop) {
+    if (loop->br != NULL)
+        munmap(loop->br, URING_BUFS * sizeof(struct io_uring_buf));
+    if (loop->sqes != NULL)
+        munmap(loop->sqes, loop->sqes_size);
+    if (loop->rings != NULL)
+        munmap(loop->rings, loop->rings_size);
+    free(loop->bufs);
+    close(loop->ringfd);
+}
+
+/*
+ * Give a receive buffer back to the kernel.  It is published with the others
+ * by uring_bufs_publish().
+ */
+static void uring_buf_put(struct uring_loop *loop, unsigned short bid) {
+    struct io_uring_buf *buf = &loop->br->bufs[loop->br_tail & (URING_BUFS - 1)];
+    buf->addr = (uintptr_t) (loop->bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->br_tail++;
+}
+
+static void uring_bufs_publish(struct uring_loop *loop) {
+    __atomic_store_n(&loop->br->tail, loop->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Create the io_uring instance of a loop and register its receive buffers.
+ * IORING_SETUP_SINGLE_ISSUER, which suits a ring used by one thread only, is
+ * also how kernels older than 6.0, which lack multishot receive, are told apart.
+ *
+ * @return 0, or -1 if the kernel does not support what the loop needs.
+ */
+static int uring_setup(struct uring_loop *loop) {
+    struct io_uring_params params;
+    loop->rings = NULL;                         // 'listenfd' and 'cpu' are the caller's.
+    loop->sqes = NULL;
+    loop->br = NULL;
+    loop->bufs = NULL;
+    loop->br_tail = 0;
+    loop->pending = 0;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER;
+    if ((loop->ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(loop->ringfd);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    loop->rings_size = (sq_size > cq_size) ? sq_size : cq_size;
+    loop->rings = mmap(NULL, loop->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       loop->ringfd, IORING_OFF_SQ_RING);
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->ringfd, IORING_OFF_SQES);
+    loop->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);    // Page-aligned, as the kernel requires.
+    if (loop->rings == MAP_FAILED || loop->sqes == MAP_FAILED || loop->br == MAP_FAILED)
+    {
+        if (loop->rings == MAP_FAILED)
+            loop->rings = NULL;
+        if (loop->sqes == MAP_FAILED)
+            loop->sqes = NULL;
+        if (loop->br == MAP_FAILED)
+            loop->br = NULL;
+        uring_teardown(loop);
+        return -1;
+    }
+
+    char *rings = loop->rings;
+    loop->sq_head = (unsigned *) (rings + params.sq_off.head);
+    loop->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+    loop->sq_array = (unsigned *) (rings + params.sq_off.array);
+    loop->sq_mask = *(unsigned *) (rings + params.sq_off.ring_mask);
+    loop->sq_entries = params.sq_entries;
+    loop->sq_local_tail = *loop->sq_tail;
+    loop->cq_head = (unsigned *) (rings + params.cq_off.head);
+    loop->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+    loop->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+    loop->cq_mask = *(unsigned *) (rings + params.cq_off.ring_mask);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) loop->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, loop->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        uring_teardown(loop);
+        return -1;
+    }
+    loop->bufs = Malloc((size_t) URING_BUFS * URING_BUF_SIZE);
+    for (int i = 0; i < URING_BUFS; i++)
+        uring_buf_put(loop, i);
+    uring_bufs_publish(loop);
+    return 0;
+}
+
+/*
+ * Submit the queued requests and, if 'wait' is set, wait for a completion.
+ */
+static void uring_enter(struct uring_loop *loop, int wait) {
+    __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+    while (1)
+    {
+        int n = syscall(__NR_io_uring_enter, loop->ringfd, loop->pending, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0)
+        {
+            loop->pending -= n;
+            return;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EBUSY)  // Completions must be reaped first.
+            return;
+        unix_error("io_uring_enter error");
+    }
+}
+
+/*
+ * Queue a request.  It is submitted by the next uring_enter().
+ */
+static struct io_uring_sqe *uring_sqe(struct uring_loop *loop) {
+    if (loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) == loop->sq_entries)
+        uring_enter(loop, 0);                   // Cannot happen with URING_BATCH, but costs nothing to handle.
+    unsigned index = loop->sq_local_tail & loop->sq_mask;
+    struct io_uring_sqe *sqe = &loop->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_array[index] = index;
+    loop->sq_local_tail++;
+    loop->pending++;
+    return sqe;
+}
+
+/*
+ * Ask for every connection on the listening socket.  Completions carry no connection.
+ */
+static void uring_accept(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = uring_sqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = 0;
+}
+
+/*
+ * Ask for every connection on the listening socket again, but only once
+ * CLIENT_ACCEPT_PAUSE_MS have passed: a timeout is queued, and its completion
+ * queues the accept.
+ */
+static void uring_accept_later(struct uring_loop *loop) {
+    loop->accept_pause.tv_sec = 0;
+    loop->accept_pause.tv_nsec = CLIENT_ACCEPT_PAUSE_MS * 1000000L;
+    struct io_uring_sqe *sqe = uring_sqe(loop);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &(loop->accept_pause);
+    sqe->len = 1;
+    sqe->off = 0;                               // Only the time counts, not completions.
+    sqe->user_data = URING_ACCEPT_TIMER;
+}
+
+/*
+ * Ask for everything a client sends, each piece in a buffer the kernel picks.
+ */
+static void uring_recv(struct uring_loop *loop, struct uring_conn *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t) conn;
+}
+
+static void uring_open(struct uring_loop *loop, int connfd) {
+    struct uring_conn *conn = pool_alloc(&uring_conn_pool);
+    conn->fd = connfd;
+    conn->len = 0;
+    if ((conn->tu = client_open(connfd, &(conn->ext))) == NULL)
+    {
+        pool_free(&uring_conn_pool, conn);
+        return;
+    }
+    uring_recv(loop, conn);
+}
+
+static void uring_close(struct uring_conn *conn) {
+    debug("Closing the connection of extension %d.\n", conn->ext);
+    client_close(conn->tu, conn->ext, conn->fd);
+    pool_free(&uring_conn_pool, conn);
+}
+
+/*
+ * Carry out the lines in a piece of input, which may be longer than what is
+ * left of the connection's buffer.
+ */
+static void uring_input(struct uring_conn *conn, char *data, size_t n) {
+    while (n > 0)
+    {
+        size_t room = MAXLINE - 1 - conn->len;
+        size_t k = (n < room) ? n : room;
+        memcpy(conn->buf + conn->len, data, k);
+        conn->len = client_input(conn->tu, conn->buf, conn->len + k, MAXLINE - 1);
+        data += k;
+        n -= k;
+    }
+}
+
+static void uring_complete(struct uring_loop *loop, struct io_uring_cqe *cqe) {
+    struct uring_conn *conn = (struct uring_conn *) (uintptr_t) cqe->user_data;
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+
+    if (cqe->user_data == URING_ACCEPT_TIMER)  // A pause in accepting is over.
+    {
+        uring_accept(loop);
+        return;
+    }
+    if (conn == NULL)                           // The listening socket.
+    {
+        int pause = 0;
+        if (res >= 0)
+            uring_open(loop, res);
+        else if (res != -EINTR)
+            pause = client_accept_failed(-res); // The same policy as the other accept loops.
+        if (!(flags & IORING_CQE_F_MORE))       // The kernel has stopped accepting for us.
+        {
+            if (pause)
+                uring_accept_later(loop);
+            else
+                uring_accept(loop);
+        }
+        return;
+    }
+
+    if (res > 0)
+    {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        uring_input(conn, loop->bufs + (size_t) bid * URING_BUF_SIZE, res);
+        uring_buf_put(loop, bid);
+    }
+    if (flags & IORING_CQE_F_MORE)
+        return;
+    if (res > 0 || res == -ENOBUFS)             // Receiving stopped, but the connection is still open.
+        uring_recv(loop, conn);
+    else                                        // EOF, or the connection failed. Nothing refers to it any more.
+        uring_close(conn);
+}
+
+static void *uring_loop_thread(void *arg) {
+    struct uring_loop *loop = arg;
+    Pthread_detach(pthread_self());
+
+    sigset_t mask;                              // SIGHUP is left to the main thread, which shuts the loops' connections down.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (loop->cpu >= 0)
+        acceptor_pin_cpu(loop->cpu);
+
+    if (uring_setup(loop) < 0)                  // The ring belongs to the thread that creates it.
+        unix_error("io_uring setup error");
+    uring_accept(loop);
+    while (1)
+    {
+        uring_enter(loop, 1);
+        unsigned head = *loop->cq_head;
+        unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        for (int n = 0; head != tail && n < URING_BATCH; n++, head++)
+            uring_complete(loop, &loop->cqes[head & loop->cq_mask]);
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+        uring_bufs_publish(loop);
+    }
+    return NULL;
+}
+
+/*
+ * Start the io_uring loops.  They run until the process exits.
+ *
+ * @param listenfds  The listening descriptors.  Loop i accepts from listenfds[i % num_listenfds].
+ * @param num_listenfds  The number of listening descriptors.  If there are
+ * more than one, they are SO_REUSEPORT sockets and loop i is pinned to CPU i.
+ * @param num_loops  The number of loops, each in a thread of its own.
+ * There are at least as many loops as listening descriptors.
+ * @return 0, or -1 if io_uring cannot be used, in which case no loop was started.
+ */
+int uring_loops_start(int *listenfds, int num_listenfds, int num_loops) {
+    struct uring_loop probe;
+    if (uring_setup(&probe) < 0)
+    {
+        debug("io_uring setup failed: %s\n", strerror(errno));
+        return -1;
+    }
+    uring_teardown(&probe);
+
+    if (num_loops < num_listenfds)              // Every socket needs a loop accepting from it.
+        num_loops = num_listenfds;
+    pool_prefill(&uring_conn_pool, pbx_config.pool_prefill);   // Only this mode uses the pool, so it is not prefilled with the others.
+
+    for (int i = 0; i < num_loops; i++)
+    {
+        struct uring_loop *loop = Malloc(sizeof(struct uring_loop));
+        loop->listenfd = listenfds[i % num_listenfds];
+        loop->cpu = (num_listenfds > 1) ? i : -1;
+        pthread_t tid;
+        Pthread_create(&tid, NULL, uring_loop_thread, loop);
+    }
+    return 0;
+}
+
+#else
+
+int uring_loops_start(int *listenfds, int num_listenfds, int num_loops) {
+    return -1;                                  // Not built with io_uring.
+}
+
+#endif
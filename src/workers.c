@@ -0,0 +1,215 @@
+/*
+ * Worker pool: a fixed set of threads serving the input of client connections.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+#include "workers.h"
+#include "client.h"
+#include "config.h"
+#include "pool.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define READYQ_SIZE 1024                // Connections that may wait for a worker. A power of two.
+#define WORKERS_EVENT_BATCH 64          // Most events taken from epoll at once.
+
+struct worker_conn {                    // A worker_conn structure contains:
+    int fd;                             // The connected descriptor,
+    int ext;                            // The extension of its TU,
+    TU *tu;                             // The TU of the client,
+    size_t len;                         // The number of bytes in 'buf',
+    char buf[MAXLINE + 1];              // Input not yet carried out, with room for a terminating NUL.
+};
+
+/*
+ * Bounded multi-producer, multi-consumer queue of connections that have input
+ * (D. Vyukov's design).  Each cell carries a sequence number that tells
+ * producers and consumers whether it is free for the lap they are on, so both
+ * sides claim a cell with a single compare-and-swap on their own index.  The
+ * semaphores are only used to sleep: 'items' counts connections ready to be
+ * taken and 'slots' free cells, so a push or pop that has passed its semaphore
+ * always finds a cell.
+ */
+struct readyq_cell {                    // A readyq_cell structure contains:
+    atomic_size_t seq;                  // The sequence number of the cell,
+    struct worker_conn *conn;           // The connection stored in it.
+};
+
+static struct readyq {                  // The readyq structure contains:
+    struct readyq_cell cells[READYQ_SIZE];     // The cells of the ring,
+    atomic_size_t enq __attribute__((aligned(64)));    // The position of the next push,
+    atomic_size_t deq __attribute__((aligned(64)));    // The position of the next pop,
+    sem_t items;                        // The number of connections in the queue,
+    sem_t slots;                        // The number of free cells.
+} readyq;
+
+static int workers_epfd;                // The epoll instance watching every connection of the pool.
+
+static POOL worker_conn_pool = POOL_INITIALIZER(sizeof(struct worker_conn), 64);
+
+static void readyq_push(struct worker_conn *conn) {
+    P(&readyq.slots);
+    size_t pos = atomic_load_explicit(&readyq.enq, memory_order_relaxed);
+    struct readyq_cell *cell;
+    while (1)
+    {
+        cell = &readyq.cells[pos & (READYQ_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq == pos)                 // Free on this lap; try to claim it.
+        {
+            if (atomic_compare_exchange_weak_explicit(&readyq.enq, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;                  // On failure 'pos' has been reloaded.
+        }
+        else
+            pos = atomic_load_explicit(&readyq.enq, memory_order_relaxed);    // Another producer got there first.
+    }
+    cell->conn = conn;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);  // Publish the connection.
+    V(&readyq.items);
+}
+
+static struct worker_conn *readyq_pop(void) {
+    P(&readyq.items);
+    size_t pos = atomic_load_explicit(&readyq.deq, memory_order_relaxed);
+    struct readyq_cell *cell;
+    while (1)
+    {
+        cell = &readyq.cells[pos & (READYQ_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq == pos + 1)             // Filled on this lap; try to claim it.
+        {
+            if (atomic_compare_exchange_weak_explicit(&readyq.deq, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else
+            pos = atomic_load_explicit(&readyq.deq, memory_order_relaxed);
+    }
+    struct worker_conn *conn = cell->conn;
+    atomic_store_explicit(&cell->seq, pos + READYQ_SIZE, memory_order_release);  // Free the cell for the next lap.
+    V(&readyq.slots);
+    return conn;
+}
+
+static void workers_block_sighup(void) {
+    sigset_t mask;                      // SIGHUP is left to the main thread, which shuts the pool's connections down.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+/*
+ * Thread that waits for input on every connection of the pool and queues each
+ * connection that has some for the workers.  A connection is watched with
+ * EPOLLONESHOT, so that it is queued once, and is watched again only when the
+ * worker that served it has finished.
+ */
+static void *workers_poller_thread(void *arg) {
+    Pthread_detach(pthread_self());
+    workers_block_sighup();
+
+    struct epoll_event events[WORKERS_EVENT_BATCH];
+    while (1)
+    {
+        int n = epoll_wait(workers_epfd, events, WORKERS_EVENT_BATCH, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (int i = 0; i < n; i++)
+            readyq_push(events[i].data.ptr);    // Waits while the queue is full.
+    }
+    return NULL;
+}
+
+static void workers_close(struct worker_conn *conn) {
+    debug("Closing the connection of extension %d.\n", conn->ext);
+    epoll_ctl(workers_epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    client_close(conn->tu, conn->ext, conn->fd);
+    pool_free(&worker_conn_pool, conn);
+}
+
+/*
+ * Read what the client has sent, carry out every complete line, and watch the
+ * connection again.  More input than one read takes is reported again by epoll.
+ */
+static void workers_serve(struct worker_conn *conn) {
+    ssize_t n = read(conn->fd, conn->buf + conn->len, MAXLINE - 1 - conn->len);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        workers_close(conn);                    // EOF, or the connection failed.
+        return;
+    }
+    if (n > 0)
+        conn->len = client_input(conn->tu, conn->buf, conn->len + n, MAXLINE - 1);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(workers_epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+    {
+        debug("epoll_ctl() error: %s\n", strerror(errno));
+        workers_close(conn);
+    }
+}
+
+static void *worker_thread(void *arg) {
+    Pthread_detach(pthread_self());
+    workers_block_sighup();
+
+    while (1)
+    {
+        struct worker_conn *conn = readyq_pop();
+        debug("Worker serving fd %d.\n", conn->fd);
+        workers_serve(conn);
+    }
+    return NULL;
+}
+
+/*
+ * Start the worker threads and the thread that hands them connections with
+ * input.  They run until the process exits.
+ */
+void workers_start(int num_workers) {
+    for (size_t i = 0; i < READYQ_SIZE; i++)
+        atomic_init(&readyq.cells[i].seq, i);
+    atomic_init(&readyq.enq, 0);
+    atomic_init(&readyq.deq, 0);
+    Sem_init(&readyq.items, 0, 0);
+    Sem_init(&readyq.slots, 0, READYQ_SIZE);
+    if ((workers_epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    pool_prefill(&worker_conn_pool, pbx_config.pool_prefill);     // Only this mode uses the pool, so it is not prefilled with the others.
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, workers_poller_thread, NULL);
+    for (int i = 0; i < num_workers; i++)
+        Pthread_create(&tid, NULL, worker_thread, NULL);
+}
+
+/*
+ * Register the client of an accepted connection and hand the connection to
+ * the pool.  Does not wait for a worker.
+ */
+void workers_submit(int connfd) {
+    fcntl(connfd, F_SETFL, O_NONBLOCK);         // A worker must never wait for one client.
+    struct worker_conn *conn = pool_alloc(&worker_conn_pool);
+    conn->fd = connfd;
+    conn->len = 0;
+    if ((conn->tu = client_open(connfd, &(conn->ext))) == NULL)
+    {
+        pool_free(&worker_conn_pool, conn);
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(workers_epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)  // Out of memory: give up on this client only.
+    {
+        debug("epoll_ctl() error: %s\n", strerror(errno));
+        client_close(conn->tu, conn->ext, connfd);
+        pool_free(&worker_conn_pool, conn);
+    }
+}
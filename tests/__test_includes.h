@@ -26,6 +26,29 @@
 #define SERVER_STARTUP_SLEEP 1
 #define SERVER_SHUTDOWN_SLEEP 1
 
+/*
+ * Meta-commands of the tester beyond those of server.h.
+ */
+#define TU_RESET_CMD       110  // Close the connection abortively, so that the server sees a reset
+#define TU_FLOOD_CMD       111  // Send ID_TO_DIAL chat messages of FLOOD_MSG_LEN bytes, reading nothing
+#define TU_DRAIN_CMD       112  // Read ID_TO_DIAL responses of the kind expected; see script_tester.c
+#define TU_TRICKLE_CMD     113  // Send ID_TO_DIAL flood messages, each once the one before has been answered
+
+#define FLOOD_MSG_LEN 4000
+#define TU_CHAT_MSG NUM_STATES  // As the response of a step: a chat message
+
+/*
+ * Commands of the extensions to the protocol.  Those from TU_FIRST_EXT_CMD on,
+ * like the commands of server.h, count as the last command sent.  Those below
+ * it only make the server report the current state, so the states expected
+ * after them are those of the last command.
+ */
+#define TU_JOIN_CMD        115  // "join" the hunt group whose pilot is ID_TO_DIAL
+#define TU_CONF_CMD        116  // "conf": enter the conference room numbered ID_TO_DIAL
+#define TU_FIRST_EXT_CMD   120
+#define TU_CAMP_ON_CMD     120  // "camp" on the extension of TU ID_TO_DIAL
+#define TU_DIAL_PILOT_CMD  121  // "dial" the pilot ID_TO_DIAL of a hunt group
+
 /*
  * Structure describing a single step in a test script.
  */
@@ -50,12 +50,15 @@ static void wait_for_no_server() {
     } while(1);
 }
 
-static void init() {
+/*
+ * Start the server with the given argument vector, which includes "-p".
+ */
+static void start_server(char *const argv[]) {
     server_pid = 0;
     wait_for_no_server();
     fprintf(stderr, "***Starting server...");
     if((server_pid = fork()) == 0) {
-	execlp("bin/pbx", "pbx", "-p", SERVER_PORT_STR, NULL);
+	execv("bin/pbx", argv);
 	fprintf(stderr, "Failed to exec server\n");
 	abort();
     }
@@ -64,6 +67,10 @@ static void init() {
     wait_for_server();
 }
 
+static void init() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, NULL });
+}
+
 static void fini(int chk) {
     int ret;
     cr_assert(server_pid != 0, "No server was started!\n");
@@ -183,3 +190,660 @@ Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
     fini(0);
 }
 #undef TEST_NAME
+
+/*
+ * With a pool of one worker, every client is still registered and served:
+ * the worker is handed input, not whole connections.
+ */
+static void init_one_worker() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-w", "1", NULL });
+}
+
+#define TEST_NAME more_clients_than_workers_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_CMD,        0,           TU_RING_BACK,   TEN_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DIAL_CMD,        2,           TU_BUSY_SIGNAL, TEN_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_one_worker, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+/*
+ * A client that resets its connection while output for it is still queued
+ * must only lose its call: the server stays up, and shuts down cleanly when
+ * told to.  The flood is larger than the kernel buffers a client that reads
+ * nothing can hold on loopback (about 4MB), so that the rest waits in the
+ * server's queue, which is made large enough for it.
+ */
+static void init_large_queue() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-q", "16777216", NULL });
+}
+
+#define TEST_NAME reset_during_chat_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_FLOOD_CMD,      1500,         TU_CONNECTED,   ONE_SEC  },
+    {   1,  TU_RESET_CMD,      -1,           -1,             ZERO_SEC },
+    {   0,  TU_FLOOD_CMD,      100,          TU_CONNECTED,   ONE_SEC  },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   ONE_SEC  },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_large_queue, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * The same, with the connections served by an io_uring loop.
+ */
+static void init_large_queue_uring() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-q", "16777216", "-u", "1", NULL });
+}
+
+Test(SUITE, reset_during_chat_uring_test, .init = init_large_queue_uring, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/reset_during_chat_uring_test";
+    int ret = run_test_script(name, SCRIPT(reset_during_chat_test), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+
+/*
+ * A call that rings longer than the ring timeout (-R) is abandoned: the caller
+ * hears a dial tone again, and the line that rang goes back on hook.
+ */
+static void init_ring_timeout() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-R", "200", NULL });
+}
+
+#define TEST_NAME ring_timeout_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   ONE_SEC  },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_ring_timeout, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * A client that sends nothing for longer than the idle timeout (-I) is
+ * disconnected, while one that keeps sending commands is not.  The delays are
+ * taken by a TU that is not connected, so that no responses are read meanwhile.
+ */
+static void init_idle_timeout() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-I", "300", NULL });
+}
+
+#define TEST_NAME idle_timeout_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_DELAY_CMD,      -1,           -1,             { 0, 200000 } },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DELAY_CMD,      -1,           -1,             { 0, 200000 } },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           -1,             ONE_SEC  },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_idle_timeout, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * A TU that camps on a busy extension hears a busy signal until the
+ * extension hangs up, and is then rung back: the extension rings, and the
+ * call can be answered.
+ */
+#define TEST_NAME camp_on_busy_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DIAL_CMD,        2,           TU_RING_BACK,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_CAMP_ON_CMD,     1,           TU_BUSY_SIGNAL, FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_RINGING,     FTY_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_RING_BACK,   FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * A TU that hangs up stops waiting: when the extension it camped on hangs
+ * up, the extension is not rung, and can be called by someone else.
+ */
+#define TEST_NAME camp_hangup_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DIAL_CMD,        2,           TU_RING_BACK,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_CAMP_ON_CMD,     1,           TU_BUSY_SIGNAL, FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_DIAL_CMD,        1,           TU_RING_BACK,   FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   3,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * When the extension camped on unregisters, the TU that waited for it is left
+ * with a busy signal, and nothing else happens to it: it can hang up and
+ * place another call.
+ */
+#define TEST_NAME camp_unregister_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_CAMP_ON_CMD,     1,           TU_BUSY_SIGNAL, FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        2,           TU_RING_BACK,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * Hunt groups.  The pilot lies outside the default range of extensions.
+ * Three members join in order, and TU 0 calls the pilot; which member rings
+ * shows the policy at work.
+ */
+#define PILOT 100000
+#define PILOT_STR "100000"
+
+static void init_hunt_linear() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-H", PILOT_STR ":linear", NULL });
+}
+
+static void init_hunt_rr() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-H", PILOT_STR ":rr", NULL });
+}
+
+static void init_hunt_idle() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-H", PILOT_STR ":idle", NULL });
+}
+
+#define HUNT_SETUP \
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC }, \
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC }, \
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC }, \
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC }, \
+    {   1,  TU_JOIN_CMD,       PILOT,        TU_ON_HOOK,     FTY_MSEC }, \
+    {   2,  TU_JOIN_CMD,       PILOT,        TU_ON_HOOK,     FTY_MSEC }, \
+    {   3,  TU_JOIN_CMD,       PILOT,        TU_ON_HOOK,     FTY_MSEC }
+
+// TU 0 calls the pilot, the member rings, and TU 0 gives up.
+#define HUNT_CALL(member) \
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC }, \
+    {   0,  TU_DIAL_PILOT_CMD, PILOT,        TU_RING_BACK,   FTY_MSEC }, \
+    {   member, TU_AWAIT_CMD,  -1,           TU_RINGING,     FTY_MSEC }, \
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC }, \
+    {   member, TU_AWAIT_CMD,  -1,           TU_ON_HOOK,     FTY_MSEC }
+
+#define HUNT_TEARDOWN \
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC }, \
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC }, \
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC }, \
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC }, \
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+
+/*
+ * Linear: the first idle member in the order they joined, every time, and the
+ * next one while it is busy.
+ */
+#define TEST_NAME hunt_linear_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    HUNT_SETUP,
+    HUNT_CALL(1),
+    HUNT_CALL(1),
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    HUNT_CALL(2),
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    HUNT_CALL(1),
+    HUNT_TEARDOWN
+};
+
+Test(SUITE, TEST_NAME, .init = init_hunt_linear, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * Round robin: the next idle member after the one rung last, wrapping around,
+ * and skipping one that is busy.
+ */
+#define TEST_NAME hunt_rr_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    HUNT_SETUP,
+    HUNT_CALL(1),
+    HUNT_CALL(2),
+    HUNT_CALL(3),
+    HUNT_CALL(1),
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    HUNT_CALL(3),
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    HUNT_TEARDOWN
+};
+
+Test(SUITE, TEST_NAME, .init = init_hunt_rr, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * Longest idle: the member that went on hook first.  The members are idle
+ * from when they join, and a member that rang, or that picked up and hung up,
+ * has been idle for the shortest time.
+ */
+#define TEST_NAME hunt_idle_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    HUNT_SETUP,
+    HUNT_CALL(1),
+    HUNT_CALL(2),
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    HUNT_CALL(1),
+    HUNT_CALL(2),
+    HUNT_CALL(3),
+    HUNT_TEARDOWN
+};
+
+Test(SUITE, TEST_NAME, .init = init_hunt_idle, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * A group none of whose members is on hook gives a busy signal, and rings a
+ * member again once one hangs up.
+ */
+#define TEST_NAME hunt_all_busy_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    HUNT_SETUP,
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   3,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_PILOT_CMD, PILOT,        TU_BUSY_SIGNAL, FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    HUNT_CALL(2),
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    HUNT_TEARDOWN
+};
+
+Test(SUITE, TEST_NAME, .init = init_hunt_linear, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * Conference rooms.  Members take turns flooding the room, and every other
+ * member must get each message whole and in order.  A sender gets its state
+ * reported after every message, which it drains as well.
+ */
+#define ROOM 7
+
+#define CONF_ENTER(tu) \
+    {   tu, TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC }, \
+    {   tu, TU_CONF_CMD,       ROOM,         TU_DIAL_TONE,   FTY_MSEC }
+
+#define CONF_SETUP \
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC }, \
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC }, \
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC }, \
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC }, \
+    CONF_ENTER(0), \
+    CONF_ENTER(1), \
+    CONF_ENTER(2), \
+    CONF_ENTER(3)
+
+#define CONF_TEARDOWN \
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC }, \
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC }, \
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC }, \
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC }, \
+    HUNT_TEARDOWN
+
+#define TEST_NAME conf_broadcast_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    CONF_SETUP,
+    {   0,  TU_FLOOD_CMD,      1,            TU_DIAL_TONE,   ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      1,            TU_CHAT_MSG,    ONE_SEC  },
+    {   2,  TU_DRAIN_CMD,      1,            TU_CHAT_MSG,    ONE_SEC  },
+    {   3,  TU_DRAIN_CMD,      1,            TU_CHAT_MSG,    ONE_SEC  },
+    {   2,  TU_FLOOD_CMD,      100,          TU_DIAL_TONE,   ONE_SEC  },
+    {   2,  TU_DRAIN_CMD,      99,           TU_DIAL_TONE,   ONE_SEC  },
+    {   0,  TU_DRAIN_CMD,      100,          TU_CHAT_MSG,    ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      100,          TU_CHAT_MSG,    ONE_SEC  },
+    {   3,  TU_DRAIN_CMD,      100,          TU_CHAT_MSG,    ONE_SEC  },
+    CONF_TEARDOWN
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * A member hangs up while a broadcast to it is under way, and disconnects.
+ * It may get some of the messages, but those who stay get them all.
+ */
+#define TEST_NAME conf_leave_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    CONF_SETUP,
+    {   1,  TU_FLOOD_CMD,      200,          TU_DIAL_TONE,   ONE_SEC  },
+    {   3,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     ONE_SEC  },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      199,          TU_DIAL_TONE,   ONE_SEC  },
+    {   0,  TU_DRAIN_CMD,      200,          TU_CHAT_MSG,    ONE_SEC  },
+    {   2,  TU_DRAIN_CMD,      200,          TU_CHAT_MSG,    ONE_SEC  },
+    {   0,  TU_FLOOD_CMD,      1,            TU_DIAL_TONE,   ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      1,            TU_CHAT_MSG,    ONE_SEC  },
+    {   2,  TU_DRAIN_CMD,      1,            TU_CHAT_MSG,    ONE_SEC  },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * Every member leaves, which closes the room, and the room opens again for
+ * those who come back.
+ */
+#define TEST_NAME conf_empty_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    CONF_ENTER(0),
+    CONF_ENTER(1),
+    {   0,  TU_FLOOD_CMD,      3,            TU_DIAL_TONE,   ONE_SEC  },
+    {   0,  TU_DRAIN_CMD,      2,            TU_DIAL_TONE,   ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      3,            TU_CHAT_MSG,    ONE_SEC  },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    CONF_ENTER(1),
+    CONF_ENTER(0),
+    {   1,  TU_FLOOD_CMD,      3,            TU_DIAL_TONE,   ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      2,            TU_DIAL_TONE,   ONE_SEC  },
+    {   0,  TU_DRAIN_CMD,      3,            TU_CHAT_MSG,    ONE_SEC  },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * Three members flood the room while three others keep leaving and coming
+ * back, so that the array of members is replaced and retired while
+ * broadcasts are reading it.  Those who stay get every message, and those who
+ * come and go get what they get in order and intact.
+ */
+#define CONF_CHURN(tu) \
+    {   tu, TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     ONE_SEC  }, \
+    CONF_ENTER(tu)
+
+// Each of TUs 0, 1 and 2 sends 100 messages, and each of 3, 4 and 5 leaves and
+// comes back while they are being broadcast.
+#define CONF_ROUND \
+    {   0,  TU_FLOOD_CMD,      100,          TU_DIAL_TONE,   ONE_SEC  }, \
+    CONF_CHURN(3), \
+    {   1,  TU_FLOOD_CMD,      100,          TU_DIAL_TONE,   ONE_SEC  }, \
+    CONF_CHURN(4), \
+    {   2,  TU_FLOOD_CMD,      100,          TU_DIAL_TONE,   ONE_SEC  }, \
+    CONF_CHURN(5)
+
+#define TEST_NAME conf_churn_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    CONF_SETUP,
+    {   4,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   5,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    CONF_ENTER(4),
+    CONF_ENTER(5),
+    CONF_ROUND,
+    CONF_ROUND,
+    CONF_ROUND,
+    CONF_ROUND,
+    CONF_ROUND,
+    CONF_ROUND,
+    {   0,  TU_DRAIN_CMD,      594,          TU_DIAL_TONE,   ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      594,          TU_DIAL_TONE,   ONE_SEC  },
+    {   2,  TU_DRAIN_CMD,      594,          TU_DIAL_TONE,   ONE_SEC  },
+    {   0,  TU_DRAIN_CMD,      1200,         TU_CHAT_MSG,    ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      1200,         TU_CHAT_MSG,    ONE_SEC  },
+    {   2,  TU_DRAIN_CMD,      1200,         TU_CHAT_MSG,    ONE_SEC  },
+    {   4,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     ONE_SEC  },
+    {   5,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     ONE_SEC  },
+    {   4,  TU_DISCONNECT_CMD, -1,           -1,             ONE_SEC  },
+    {   5,  TU_DISCONNECT_CMD, -1,           -1,             ONE_SEC  },
+    CONF_TEARDOWN
+};
+
+Test(SUITE, TEST_NAME, .init = init_large_queue, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+/*
+ * A peer that does not read while chat is sent to it, one message at a time,
+ * so that each is relayed on its own.  Once the socket fills, the server sends
+ * part of a message and queues the rest, and then queues whole messages, which
+ * it must copy out of the sender's input buffer before reading into it again.
+ * Every message must then reach the peer whole and in order.
+ */
+#define TEST_NAME slow_reader_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_TRICKLE_CMD,    1500,         TU_CONNECTED,   ONE_SEC  },
+    {   1,  TU_DRAIN_CMD,      1500,         TU_CHAT_MSG,    ONE_SEC  },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_AWAIT_CMD,      -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_large_queue, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+static void init_large_queue_epoll() {
+    start_server((char *[]){ "pbx", "-p", SERVER_PORT_STR, "-q", "16777216", "-e", "1", NULL });
+}
+
+Test(SUITE, slow_reader_epoll_test, .init = init_large_queue_epoll, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/slow_reader_epoll_test";
+    int ret = run_test_script(name, SCRIPT(slow_reader_test), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+
+Test(SUITE, slow_reader_uring_test, .init = init_large_queue_uring, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/slow_reader_uring_test";
+    int ret = run_test_script(name, SCRIPT(slow_reader_test), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
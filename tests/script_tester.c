@@ -11,6 +11,7 @@
 
 #include "pbx.h"
 #include "server.h"
+#include "tu_table.h"
 #include "__test_includes.h"
 #include "debug.h"
 
@@ -63,63 +64,116 @@
 
 #define RESYNC NUM_STATES
 
+/*
+ * The "normal case" states are those that the server's own transition table
+ * (tu_table.h) can produce in response to a command, and are filled in from it
+ * by init_next_states().  The "abnormal case" states are given here.
+ */
 int next_states[NUM_STATES][NUM_COMMANDS] = {
   [TU_ON_HOOK] {
-      1<<TU_DIAL_TONE | 1<<(TU_RINGING+RESYNC) | 1<<(TU_ON_HOOK+RESYNC),    // TU_PICKUP_CMD
-      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_HANGUP_CMD
-      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_DIAL_CMD
-      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_CHAT_CMD
+      1<<(TU_RINGING+RESYNC) | 1<<(TU_ON_HOOK+RESYNC),                      // TU_PICKUP_CMD
+      1<<(TU_RINGING+RESYNC),                                               // TU_HANGUP_CMD
+      1<<(TU_RINGING+RESYNC),                                               // TU_DIAL_CMD
+      1<<(TU_RINGING+RESYNC),                                               // TU_CHAT_CMD
       1<<(TU_ON_HOOK+RESYNC) | 1<<(TU_RINGING+RESYNC)                       // DELAY
   },
   [TU_RINGING] {
-      1<<TU_CONNECTED | 1<<(TU_ON_HOOK+RESYNC) | 1<<(TU_RINGING+RESYNC),    // TU_PICKUP_CMD
-      1<<TU_ON_HOOK | 1<<(TU_RINGING+RESYNC),                               // TU_HANGUP_CMD
-      1<<TU_RINGING | 1<<(TU_ON_HOOK+RESYNC),                               // TU_DIAL_CMD
-      1<<TU_RINGING | 1<<(TU_ON_HOOK+RESYNC),                               // TU_CHAT_CMD
+      1<<(TU_ON_HOOK+RESYNC) | 1<<(TU_RINGING+RESYNC),                      // TU_PICKUP_CMD
+      1<<(TU_RINGING+RESYNC),                                               // TU_HANGUP_CMD
+      1<<(TU_ON_HOOK+RESYNC),                                               // TU_DIAL_CMD
+      1<<(TU_ON_HOOK+RESYNC),                                               // TU_CHAT_CMD
       1<<(TU_RINGING+RESYNC) | 1<<(TU_ON_HOOK+RESYNC)                       // DELAY
   },
   [TU_DIAL_TONE] {
-      1<<TU_DIAL_TONE,                                                      // TU_PICKUP_CMD
-      1<<TU_ON_HOOK | 1<<(TU_DIAL_TONE+RESYNC),                             // TU_HANGUP_CMD
-      1<<TU_RING_BACK | 1<<TU_BUSY_SIGNAL | 1<<TU_ERROR
-                      | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_DIAL_CMD
-      1<<TU_DIAL_TONE,                                                      // TU_CHAT_CMD
+      0,                                                                    // TU_PICKUP_CMD
+      1<<(TU_DIAL_TONE+RESYNC),                                             // TU_HANGUP_CMD
+      1<<(TU_DIAL_TONE+RESYNC),                                             // TU_DIAL_CMD
+      0,                                                                    // TU_CHAT_CMD
       1<<(TU_DIAL_TONE+RESYNC)                                              // DELAY
   },
   [TU_RING_BACK] {
-      1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_PICKUP_CMD
-      1<<TU_ON_HOOK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC)
-                    | 1<<(TU_RING_BACK+RESYNC),                             // TU_HANGUP_CMD
-      1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_DIAL_CMD
-      1<<TU_RING_BACK | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),// TU_CHAT_CMD
+      1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),                  // TU_PICKUP_CMD
+      1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC)
+                               | 1<<(TU_RING_BACK+RESYNC),                  // TU_HANGUP_CMD
+      1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),                  // TU_DIAL_CMD
+      1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC),                  // TU_CHAT_CMD
       1<<(TU_RING_BACK+RESYNC) | 1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC) // DELAY
   },
   [TU_BUSY_SIGNAL] {
-      1<<TU_BUSY_SIGNAL,                                                    // TU_PICKUP_CMD
-      1<<TU_ON_HOOK | 1<<(TU_BUSY_SIGNAL+RESYNC),                           // TU_HANGUP_CMD
-      1<<TU_BUSY_SIGNAL,                                                    // TU_DIAL_CMD
-      1<<TU_BUSY_SIGNAL,                                                    // TU_CHAT_CMD
+      0,                                                                    // TU_PICKUP_CMD
+      1<<(TU_BUSY_SIGNAL+RESYNC),                                           // TU_HANGUP_CMD
+      0,                                                                    // TU_DIAL_CMD
+      0,                                                                    // TU_CHAT_CMD
       1<<(TU_BUSY_SIGNAL+RESYNC)                                            // DELAY
   },
   [TU_CONNECTED] {
-      1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC) | 1<<(TU_CONNECTED+RESYNC),// TU_PICKUP_CMD
-      1<<TU_ON_HOOK | 1<<(TU_DIAL_TONE+RESYNC) | 1<<(TU_CONNECTED+RESYNC),  // TU_HANGUP_CMD
-      1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_DIAL_CMD
-      1<<TU_CONNECTED | 1<<(TU_DIAL_TONE+RESYNC),                           // TU_CHAT_CMD
+      1<<(TU_DIAL_TONE+RESYNC) | 1<<(TU_CONNECTED+RESYNC),                  // TU_PICKUP_CMD
+      1<<(TU_DIAL_TONE+RESYNC) | 1<<(TU_CONNECTED+RESYNC),                  // TU_HANGUP_CMD
+      1<<(TU_DIAL_TONE+RESYNC),                                             // TU_DIAL_CMD
+      1<<(TU_DIAL_TONE+RESYNC),                                             // TU_CHAT_CMD
       1<<(TU_CONNECTED+RESYNC) | 1<<(TU_DIAL_TONE+RESYNC)                   // DELAY
   },
   [TU_ERROR] {
-      1<<TU_ERROR,                                                          // TU_PICKUP_CMD
-      1<<TU_ON_HOOK | 1<<(TU_ERROR+RESYNC),                                 // TU_HANGUP_CMD
-      1<<TU_ERROR,                                                          // TU_DIAL_CMD
-      1<<TU_ERROR,                                                          // TU_CHAT_CMD
+      0,                                                                    // TU_PICKUP_CMD
+      1<<(TU_ERROR+RESYNC),                                                 // TU_HANGUP_CMD
+      0,                                                                    // TU_DIAL_CMD
+      0,                                                                    // TU_CHAT_CMD
       1<<(TU_ERROR+RESYNC)                                                  // DELAY
   }
 };
 
+/*
+ * The states that the server's transition table can produce from a state,
+ * for a row of the table, whatever the state of the other TU.
+ */
+static int table_states(TU_STATE s, int row) {
+    int set = 0;
+    for(int p = 0; p < TU_NUM_PEER_STATES; p++) {
+	const struct tu_transition *t = &tu_transitions[s][row][p];
+	if(t->action != TU_ACT_RETRY)
+	    set |= 1<<t->next;
+    }
+    return set;
+}
+
+/*
+ * Add to next_states the states that the server's transition table can
+ * produce from each state and command, whatever the state of the other TU.
+ */
+static void init_next_states(void) {
+    static int done = 0;
+    if(done)
+	return;
+    for(int s = 0; s < TU_NUM_STATES; s++) {
+	for(int c = 0; c < TU_NUM_COMMANDS; c++)
+	    next_states[s][c] |= table_states(s, c);
+    }
+    done = 1;
+}
+
+/*
+ * The set of states expected from a state after a command.  A command of the
+ * extensions can cross in transit the same notifications as a dial, and can
+ * bring whatever the transition table gives for the commands the server
+ * carries out on its behalf, then or later.
+ */
+static int expected_states(TU_STATE s, int cmd) {
+    switch(cmd) {
+    case TU_CAMP_ON_CMD:
+	return next_states[s][TU_DIAL_CMD] | table_states(s, TU_CAMP_CMD)
+	       | table_states(s, TU_CALLBACK_CMD);
+    case TU_DIAL_PILOT_CMD:
+	return next_states[s][TU_DIAL_CMD] | table_states(s, TU_HUNT_CMD);
+    default:
+	return next_states[s][cmd];
+    }
+}
+
 /*
  * Structure that records the state of a single TU under test.
  */
+#define MAX_TUS 20
+
 typedef struct tu {
     /* File descriptor for input from server connection, or 0 if not connected. */
     int infd;
@@ -160,12 +214,27 @@ typedef struct tu {
      * notification is received.
      */
     TU_COMMAND last_command;
+
+    /*
+     * Flag that indicates whether the TU has entered a conference room.  Chat
+     * from a room may still arrive after the TU has left it, from a member
+     * that found it in the room before, so it is then accepted in any state.
+     */
+    int in_conf;
+
+    /* The number of chat messages the TU has sent with TU_FLOOD_CMD. */
+    int flood_sent;
+
+    /* The lowest number of the next flood message expected from each TU. */
+    int flood_next[MAX_TUS];
+
+    /* The number of chat messages received and not yet counted by a drain. */
+    int chats;
 } TU;
 
 /*
  * Table giving the states of all TUs under test.
  */
-#define MAX_TUS 20
 TU tus[MAX_TUS];
 
 #define TU_ID(tu) ((tu) - &tus[0])
@@ -211,6 +280,10 @@ static void trim_eol(char *msg);
 static char *timestamp(void);
 static int connect_command(TU *tu, int port);
 static void disconnect_command(TU *tu);
+static void reset_command(TU *tu);
+static void flood_command(TU *tu, int count);
+static char *flood_message(int from, int seq, char *buf);
+static int check_flood_message(TU *tu, char *msg);
 static int connect_to_server(struct in_addr *addr, int port);
 static int read_responses(TU *tu, TU_STATE exp, struct timeval tv);
 
@@ -241,6 +314,7 @@ static void alert(int sig) {
  */
 int run_test_script(char *name, TEST_STEP *scr, int port) {
     fprintf(stderr, "Running test %s\n", name);
+    init_next_states();
     signal(SIGPIPE, alert);
     signal(SIGSEGV, alert);
     signal(SIGHUP, alert);
@@ -257,7 +331,7 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	TU *tu = &tus[ts->id];
 
 	// First, deal with performing any explicit action.
-	switch(ts->command) {
+	switch(cmd) {
 	// Meta-commands
 	case TU_NO_CMD:
 	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_NO_CMD\n", timestamp(), TU_ID(tu), ts - scr);
@@ -293,6 +367,27 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	    // Process incoming messages until specified state seen
 	    // or timeout occurs.
 	    break;
+	case TU_RESET_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_RESET_CMD\n", timestamp(), TU_ID(tu), ts - scr);
+	    if(!tu->infd) {
+		fprintf(stderr, "%s: [%ld] Test error: not connected\n", timestamp(), TU_ID(tu));
+		return -1;
+	    }
+	    reset_command(tu);
+	    break;
+	case TU_FLOOD_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_FLOOD_CMD (%d messages)\n",
+		    timestamp(), TU_ID(tu), ts - scr, ts->id_to_dial);
+	    flood_command(tu, ts->id_to_dial);
+	    // The replies are those to as many chats.
+	    cmd = TU_CHAT_CMD;
+	    break;
+	case TU_TRICKLE_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_TRICKLE_CMD (%d messages)\n",
+		    timestamp(), TU_ID(tu), ts - scr, ts->id_to_dial);
+	    // The messages are sent while reading the replies, below.
+	    cmd = TU_CHAT_CMD;
+	    break;
 	
 	// Real commands
 	case TU_PICKUP_CMD:
@@ -315,6 +410,36 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	    fprintf(tu->out, "%s%s", tu_command_names[cmd], EOL);
 	    fflush(tu->out);
 	    break;
+	case TU_CAMP_ON_CMD:
+	    ext = tus[ts->id_to_dial].extension;
+	    fprintf(stderr, "%s: [%ld] (step #%ld) camp extension %d (id %d)\n",
+		    timestamp(), TU_ID(tu), ts - scr, ext, ts->id_to_dial);
+	    fprintf(tu->out, "camp %d%s", ext, EOL);
+	    fflush(tu->out);
+	    break;
+	case TU_DRAIN_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_DRAIN_CMD (%d messages)\n",
+		    timestamp(), TU_ID(tu), ts - scr, ts->id_to_dial);
+	    break;
+	case TU_CONF_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) conf room %d\n",
+		    timestamp(), TU_ID(tu), ts - scr, ts->id_to_dial);
+	    fprintf(tu->out, "conf %d%s", ts->id_to_dial, EOL);
+	    fflush(tu->out);
+	    tu->in_conf = 1;
+	    break;
+	case TU_JOIN_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) join pilot %d\n",
+		    timestamp(), TU_ID(tu), ts - scr, ts->id_to_dial);
+	    fprintf(tu->out, "join %d%s", ts->id_to_dial, EOL);
+	    fflush(tu->out);
+	    break;
+	case TU_DIAL_PILOT_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) %s pilot %d\n",
+		    timestamp(), TU_ID(tu), ts - scr, tu_command_names[TU_DIAL_CMD], ts->id_to_dial);
+	    fprintf(tu->out, "%s %d%s", tu_command_names[TU_DIAL_CMD], ts->id_to_dial, EOL);
+	    fflush(tu->out);
+	    break;
 
 	// Unknown command
 	default:
@@ -322,9 +447,9 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 		  timestamp(), TU_ID(tu), ts - scr, cmd);
 	    return -1;
 	}
-	if(cmd <= TU_CHAT_CMD) {
+	if(cmd <= TU_CHAT_CMD || cmd >= TU_FIRST_EXT_CMD) {
 	    tu->last_command = cmd;
-	    tu->expected_states = next_states[tu->current_state][cmd];
+	    tu->expected_states = expected_states(tu->current_state, cmd);
 	} else if(cmd == TU_CONNECT_CMD) {
 	    // This is to get the right set of expected commands on initial connect,
 	    // when no previous command has actually been sent.
@@ -337,15 +462,39 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	} else {
 	    // For pseudo-commands, just recalculate the expected states based on
 	    // the last real command.
-	    tu->expected_states = next_states[tu->current_state][tu->last_command];
+	    tu->expected_states = expected_states(tu->current_state, tu->last_command);
 	}
 
 	// Next, read responses while keeping track of timeout.
 	// If expected response seen, go to next step.
 	// If unexpected response seen, fail.
 	// If timeout occurs, shutdown the connection so that read will fail.
-	if(tu->infd && read_responses(tu, ts->response, ts->timeout) == -1)
-	    return -1;
+	// A drain of chat reads until that many chat messages have arrived, counting
+	// those that arrived while reading other responses.  A drain of states reads
+	// that many of them, and counts the chat messages that arrive in between.
+	if(cmd == TU_DRAIN_CMD && ts->response == TU_CHAT_MSG) {
+	    while(tu->infd && tu->chats < ts->id_to_dial) {
+		if(read_responses(tu, TU_CHAT_MSG, ts->timeout) == -1)
+		    return -1;
+	    }
+	    if(tu->chats < ts->id_to_dial) {
+		fprintf(stderr, "%s: [%ld] Only %d chat messages received, expected %d\n",
+			timestamp(), TU_ID(tu), tu->chats, ts->id_to_dial);
+		return -1;
+	    }
+	    tu->chats -= ts->id_to_dial;
+	} else if(ts->command == TU_TRICKLE_CMD) {
+	    for(int i = 0; i < ts->id_to_dial && tu->infd; i++) {
+		flood_command(tu, 1);
+		if(read_responses(tu, ts->response, ts->timeout) == -1)
+		    return -1;
+	    }
+	} else {
+	    for(int i = 0; i < (cmd == TU_DRAIN_CMD ? ts->id_to_dial : 1); i++) {
+		if(tu->infd && read_responses(tu, ts->response, ts->timeout) == -1)
+		    return -1;
+	    }
+	}
 
 	// Advance script to next test step.
 	ts++;
@@ -419,8 +568,80 @@ static void disconnect_command(TU *tu) {
 #endif
 }
 
+/*
+ * Disconnect a specified TU from the server abortively: the server sees the
+ * connection reset rather than closed, and any output it has not yet
+ * delivered is lost.
+ */
+static void reset_command(TU *tu) {
+    struct linger lg = { 1, 0 };
+    setsockopt(tu->infd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    fclose(tu->out);
+    fclose(tu->in);
+    tu->out = tu->in = NULL;
+    tu->outfd = tu->infd = 0;
+}
+
+/*
+ * Send the next 'count' flood messages of a TU.  They are written at once, so
+ * that the server has all of them to work through while the steps that follow
+ * are carried out.
+ */
+static void flood_command(TU *tu, int count) {
+    size_t len = 0;
+    char *flood = malloc(count * (FLOOD_MSG_LEN + 16));
+    for(int i = 0; i < count; i++) {
+	char msg[FLOOD_MSG_LEN + 1];
+	len += sprintf(flood + len, "%s %s%s", tu_command_names[TU_CHAT_CMD],
+		       flood_message(TU_ID(tu), tu->flood_sent++, msg), EOL);
+    }
+    fwrite(flood, 1, len, tu->out);
+    fflush(tu->out);
+    free(flood);
+}
+
+/*
+ * Construct the chat message number 'seq' of a flood from TU 'from', which is
+ * FLOOD_MSG_LEN bytes long and tells by its contents which message it is.
+ */
+static char *flood_message(int from, int seq, char *buf) {
+    int n = sprintf(buf, "%02d %06d ", from, seq);
+    for(int i = n; i < FLOOD_MSG_LEN; i++)
+	buf[i] = 'a' + (from + seq + i) % 26;
+    buf[FLOOD_MSG_LEN] = '\0';
+    return buf;
+}
+
+/*
+ * Check that a chat message received by a TU is a flood message, intact, and
+ * later than any received before from the same sender.  Messages may be
+ * missing, for a TU misses those sent while it is out of a conference room,
+ * but a drain that waits for them will notice.
+ * Returns 0 if it is, -1 otherwise.
+ */
+static int check_flood_message(TU *tu, char *msg) {
+    char expected[FLOOD_MSG_LEN + 1];
+    int from, seq;
+    if(sscanf(msg, "%d %d", &from, &seq) != 2 || from < 0 || from >= MAX_TUS) {
+	fprintf(stderr, "%s: [%ld] Chat is not a flood message\n", timestamp(), TU_ID(tu));
+	return -1;
+    }
+    if(seq < tu->flood_next[from]) {
+	fprintf(stderr, "%s: [%ld] Flood message %d from [%d] received, expected %d on\n",
+		timestamp(), TU_ID(tu), seq, from, tu->flood_next[from]);
+	return -1;
+    }
+    if(strcmp(msg, flood_message(from, seq, expected)) != 0) {
+	fprintf(stderr, "%s: [%ld] Flood message %d from [%d] damaged\n",
+		timestamp(), TU_ID(tu), seq, from);
+	return -1;
+    }
+    tu->flood_next[from] = seq + 1;
+    return 0;
+}
+
 /* There isn't really a maximum message length, but this is just a test driver... */
-#define MAX_MESSAGE_LEN 256
+#define MAX_MESSAGE_LEN (FLOOD_MSG_LEN + 32)
 
 static struct timeval current_timeout;
 
@@ -440,7 +661,7 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
     char *arg;
     int ret = 0;
     fprintf(stderr, "%s: [%ld] Read responses until %s\n",
-	    timestamp(), TU_ID(tu), exp == -1 ? "EOF" : tu_state_names[exp]);
+	    timestamp(), TU_ID(tu), exp == -1 ? "EOF" : exp == TU_CHAT_MSG ? "CHAT" : tu_state_names[exp]);
     tu_to_read = tu;
     struct itimerval itv = {0};
     struct sigaction sa = {0}, oa;
@@ -494,13 +715,21 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 	}
 	if(new == NUM_STATES) {
 	    // The message is chat.  There is no state transition, but we must be
-	    // in the connected state.
-	    if(tu->current_state != TU_CONNECTED) {
+	    // in the connected state, or have been in a conference room.
+	    if(tu->current_state != TU_CONNECTED && !tu->in_conf) {
 		fprintf(stderr, "%s: [%ld] Chat received when not in state %s\n",
 			timestamp(), TU_ID(tu), tu_state_names[tu->current_state]);
 		ret = -1;
 		goto disarm;
 	    }
+	    // Only floods have content, and each one must arrive whole and in order.
+	    if(*arg != '\0' && check_flood_message(tu, arg + 1) == -1) {
+		ret = -1;
+		goto disarm;
+	    }
+	    tu->chats++;
+	    if(exp == TU_CHAT_MSG)
+		goto disarm;
 	    continue;
 	}
 
@@ -545,7 +774,7 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
 	    // unless we are draining to get EOF.
 	    //fprintf(stderr, "%s: [%ld] Resync\n", timestamp(), TU_ID(tu));
 	    if(tu->expected_states != ~0)
-		tu->expected_states = next_states[new][tu->last_command];
+		tu->expected_states = expected_states(new, tu->last_command);
 	}
     } while(tu->current_state != exp);
 
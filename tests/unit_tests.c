@@ -0,0 +1,269 @@
+/*
+ * Tests of the server's modules on their own, called directly from the test
+ * process.  Unlike those of basecode_tests.c, they start no server, so they
+ * may run concurrently with each other.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include <criterion/criterion.h>
+#include <pthread.h>
+
+#include "__test_includes.h"
+#include "timer_wheel.h"
+#include "hunt_bits.h"
+
+#define SUITE unit_suite
+
+/*
+ * Read and discard whatever the TUs of a test send.
+ */
+static void *drain(void *arg) {
+    int fd = *(int *) arg;
+    char buf[4096];
+    while (read(fd, buf, sizeof(buf)) > 0 || errno == EINTR)
+        ;
+    return NULL;
+}
+
+/*
+ * Connect the TUs of a test to a socket whose other end is drained.
+ *
+ * @return the descriptor the TUs are to write to.
+ */
+static int drained_socket(void) {
+    static int sv[2];
+    pthread_t tid;
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0, "socketpair failed");
+    cr_assert_eq(pthread_create(&tid, NULL, drain, &sv[1]), 0, "pthread_create failed");
+    return sv[0];
+}
+
+#define CHURN_THREADS 4
+#define CHURN_WARMUP 2000           // Rounds per thread before memory is measured,
+#define CHURN_ROUNDS 50000          // And after.
+#define CHURN_SLACK 16              // Bytes per TU that memory in use may grow by meanwhile.
+
+static int churn_fd;
+static pthread_barrier_t churn_barrier;
+
+/*
+ * Set up a call between two TUs of a thread's own, tear it down, unregister
+ * both and drop their last references, over and over.  The TUs hold
+ * references to each other while they are peers, and the registry holds
+ * references until an epoch grace period has passed.
+ */
+static void *churn(void *arg) {
+    int ext = 1 + 2 * (int) (long) arg;     // Each thread has two extensions of its own.
+    for (int phase = 0; phase < 2; phase++)
+    {
+        for (int i = 0; i < (phase == 0 ? CHURN_WARMUP : CHURN_ROUNDS); i++)
+        {
+            TU *caller = tu_init(churn_fd);
+            TU *callee = tu_init(churn_fd);
+            cr_assert(caller != NULL && callee != NULL, "tu_init failed");
+            cr_assert_eq(pbx_register(pbx, caller, ext), 0, "pbx_register failed");
+            cr_assert_eq(pbx_register(pbx, callee, ext + 1), 0, "pbx_register failed");
+            tu_pickup(caller);
+            pbx_dial(pbx, caller, ext + 1);
+            tu_pickup(callee);                  // Answer.
+            tu_chat(caller, "hello");
+            tu_hangup(caller);
+            pbx_unregister(pbx, caller);
+            pbx_unregister(pbx, callee);
+            tu_unref(caller, "test done");
+            tu_unref(callee, "test done");
+        }
+        pthread_barrier_wait(&churn_barrier);   // Between the phases, main measures memory in use.
+        pthread_barrier_wait(&churn_barrier);
+    }
+    return NULL;
+}
+
+/*
+ * TUs that are registered, called, unregistered and released by several threads
+ * at once must all be freed: once warm, memory in use must not grow with the
+ * number of TUs that came and went.  It may grow a little, as the pools are
+ * never shrunk: a thread preempted within an epoch critical section holds up
+ * the freeing of the TUs that the others unregister meanwhile, and the pools
+ * grow to hold them.  A TU with its registry node and queue takes several
+ * hundred bytes, so the slack lets no more than a few percent of them leak.
+ */
+Test(SUITE, tu_churn_test, .timeout = 60) {
+    cr_assert((pbx = pbx_init()) != NULL, "pbx_init failed");
+    churn_fd = drained_socket();
+    pthread_barrier_init(&churn_barrier, NULL, CHURN_THREADS + 1);
+    pthread_t tids[CHURN_THREADS];
+    for (long i = 0; i < CHURN_THREADS; i++)
+        cr_assert_eq(pthread_create(&tids[i], NULL, churn, (void *) i), 0, "pthread_create failed");
+
+    pthread_barrier_wait(&churn_barrier);       // Warm.
+    size_t before = mallinfo2().uordblks;
+    pthread_barrier_wait(&churn_barrier);
+    pthread_barrier_wait(&churn_barrier);       // Done.
+    size_t after = mallinfo2().uordblks;
+    pthread_barrier_wait(&churn_barrier);
+    for (int i = 0; i < CHURN_THREADS; i++)
+        pthread_join(tids[i], NULL);
+
+    fprintf(stderr, "Memory in use: %zu bytes when warm, %zu after %d more TUs\n",
+            before, after, 2 * CHURN_THREADS * CHURN_ROUNDS);
+    cr_assert(after <= before + (size_t) CHURN_SLACK * 2 * CHURN_THREADS * CHURN_ROUNDS,
+              "memory in use grew from %zu to %zu bytes", before, after);
+}
+
+#define CASCADE_MARGIN 1000         // Milliseconds before a probe is due that the clock is warped to,
+#define CASCADE_LATE 50             // And how late, in milliseconds, it may fire.
+
+typedef struct probe {
+    TIMER timer;
+    atomic_ulong fired;             // The clock when it fired, or 0.
+} PROBE;
+
+static void probe_fire(TIMER *timer) {
+    PROBE *probe = (PROBE *) timer;
+    atomic_store(&probe->fired, timer_now());
+}
+
+static unsigned long probe_wait(PROBE *probe) {
+    unsigned long fired;
+    while ((fired = atomic_load(&probe->fired)) == 0)
+        usleep(1000);
+    return fired;
+}
+
+/*
+ * Timers whose delays straddle the reach of each level must come down the
+ * levels and fire on time: never early, and not much late.  The clock is
+ * warped to shortly before each is due, and a timer armed then, at the
+ * shortest delay, fires once the wheel has caught up with the jump.  The probe
+ * must still be pending then, or it came down to a slot before its time.
+ */
+Test(SUITE, timer_cascade_test, .timeout = 60) {
+    unsigned long delays[] = { 63, 64, 4095, 4096, TIMER_MAX_MS };
+    for (int i = 0; i < sizeof(delays) / sizeof(delays[0]); i++)
+    {
+        PROBE probe = { .fired = 0 };
+        timer_init(&probe.timer, probe_fire);
+        unsigned long armed = timer_now();
+        timer_arm(&probe.timer, delays[i]);
+        if (delays[i] > CASCADE_MARGIN)
+        {
+            timer_warp(armed + delays[i] - CASCADE_MARGIN - timer_now());
+            PROBE caught_up = { .fired = 0 };
+            timer_init(&caught_up.timer, probe_fire);
+            timer_arm(&caught_up.timer, 0);
+            probe_wait(&caught_up);
+            cr_assert(atomic_load(&probe.fired) == 0, "timer of %lu ms fired %d ms early or more",
+                      delays[i], CASCADE_MARGIN);
+        }
+        unsigned long fired = probe_wait(&probe);
+        cr_assert(fired > armed + delays[i], "timer of %lu ms fired %lu ms early",
+                  delays[i], armed + delays[i] + 1 - fired);
+        cr_assert(fired <= armed + delays[i] + 1 + CASCADE_LATE, "timer of %lu ms fired %lu ms late",
+                  delays[i], fired - armed - delays[i] - 1);
+    }
+}
+
+static unsigned long next_random(unsigned long *x) {
+    *x ^= *x << 13;                     // xorshift64.
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/*
+ * @return the first position set in 'ref' from 'from' on, wrapping around to
+ * 0 if 'wrap' is nonzero, or -1 if there is none.
+ */
+static int linear_next(const char *ref, int n, int from, int wrap) {
+    for (int i = 0; i < (wrap ? n : n - from); i++)
+        if (ref[(from + i) % n])
+            return (from + i) % n;
+    return -1;
+}
+
+/*
+ * Check a hunt bitmap against a byte per position, from the positions on each
+ * side of a word of each level, and from random ones.
+ */
+static void bits_check(struct hunt_bits *bits, const char *ref, int n, unsigned long *seed) {
+    int froms[] = { 0, 1, 62, 63, 64, 65, 4094, 4095, 4096, 4097, n - 1, n };
+    for (int i = 0; i < sizeof(froms) / sizeof(froms[0]) + 64; i++)
+    {
+        int from = (i < sizeof(froms) / sizeof(froms[0])) ? froms[i] : next_random(seed) % (n + 1);
+        if (from > n)
+            continue;
+        cr_assert_eq(hunt_bits_next(bits, from), linear_next(ref, n, from, 0),
+                     "hunt_bits_next(%d) over %d positions", from, n);
+        cr_assert_eq(hunt_bits_next_wrap(bits, from), linear_next(ref, n, from, 1),
+                     "hunt_bits_next_wrap(%d) over %d positions", from, n);
+    }
+}
+
+#define BITS_DENSITIES 5
+
+/*
+ * The bitmaps of hunt groups must find the next position set just as a linear
+ * scan does, at any size they grow to and whether the positions set are few or
+ * many.  Growing keeps the positions set before, half of them at random, and
+ * sets the new ones, or leaves them clear, as asked.  Single positions at the edges of the words of
+ * each level, alone in the bitmap, must be found from anywhere.
+ */
+Test(SUITE, hunt_bits_test, .timeout = 60) {
+    int densities[BITS_DENSITIES] = { 0, 4, 1024, 64512, 32768 };  // Out of 65536; the last is grown with.
+    unsigned long seed = 88172645463325252UL;
+    struct hunt_bits bits = { { NULL }, 0 };
+    char *ref = calloc(HUNT_MAX_POSITIONS, 1);
+    for (int words = 1, fill = 1; words <= HUNT_MAX_POSITIONS / 64; words *= 2, fill = !fill)
+    {
+        int old = bits.num_words * 64;
+        int n = words * 64;
+        hunt_bits_grow(&bits, words, fill);
+        memset(ref + old, fill, n - old);
+        bits_check(&bits, ref, n, &seed);
+
+        for (int pos = 0; pos < n; pos++)
+            if (ref[pos])
+            {
+                hunt_bits_clear(&bits, pos);
+                ref[pos] = 0;
+            }
+        int alone[] = { 0, 63, 64, 4095, 4096, n - 1 };
+        for (int i = 0; i < sizeof(alone) / sizeof(alone[0]); i++)
+        {
+            if (alone[i] >= n)
+                continue;
+            hunt_bits_set(&bits, alone[i]);
+            ref[alone[i]] = 1;
+            bits_check(&bits, ref, n, &seed);
+            hunt_bits_clear(&bits, alone[i]);
+            ref[alone[i]] = 0;
+        }
+
+        for (int d = 0; d < BITS_DENSITIES; d++)
+        {
+            for (int pos = 0; pos < n; pos++)
+            {
+                int set = (next_random(&seed) % 65536 < densities[d]);
+                if (set != ref[pos])
+                {
+                    if (set)
+                        hunt_bits_set(&bits, pos);
+                    else
+                        hunt_bits_clear(&bits, pos);
+                    ref[pos] = set;
+                }
+            }
+            bits_check(&bits, ref, n, &seed);
+        }
+    }
+    free(ref);
+}
@@ -0,0 +1,191 @@
+/*
+ * Benchmark of reading and parsing client commands: the line reader and
+ * client_parse() of the server, against the Rio_readlineb() and strtok_r()
+ * loop the server used before them, which is reproduced here.
+ *
+ * Usage: parse_bench [-l <lines>] [-s <chat bytes>] [-r <passes>]
+ *
+ * A file of <lines> lines is written first, in a cycle of pickup, dial, chat,
+ * chat and hangup, with chat messages of <chat bytes> bytes of words.  Each
+ * pass reads the whole file from its descriptor and parses every line, so the
+ * time includes the read() calls of each reader.  Parsing stops at the
+ * command: nothing is carried out.  Each path makes <passes> passes, and the
+ * time reported is per line.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "client.h"
+#include "line_reader.h"
+#include "csapp.h"
+
+static int lines = 100000;
+static int chat_bytes = 64;
+static int passes = 20;
+
+static void fail(const char *what) {
+    fprintf(stderr, "parse_bench: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Write the commands to a file that is deleted once closed.
+ *
+ * @return the descriptor of the file.
+ */
+static int write_commands(void) {
+    char path[] = "/tmp/parse_bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        fail("mkstemp");
+    unlink(path);
+    FILE *f = fdopen(dup(fd), "w");
+    if (f == NULL)
+        fail("fdopen");
+    char *msg = malloc(chat_bytes + 1);
+    for (int i = 0; i < chat_bytes; i++)
+        msg[i] = (i % 6 == 5) ? ' ' : 'a' + i % 26;      // Words of five letters.
+    msg[chat_bytes] = '\0';
+    for (int i = 0; i < lines; i++)
+    {
+        switch (i % 5)
+        {
+        case 0: fputs("pickup\r\n", f); break;
+        case 1: fprintf(f, "dial %d\r\n", 1000 + i % 9000); break;
+        case 2:
+        case 3: fprintf(f, "chat %s\r\n", msg); break;
+        case 4: fputs("hangup\r\n", f); break;
+        }
+    }
+    if (fclose(f) != 0)
+        fail("fclose");
+    free(msg);
+    return fd;
+}
+
+/*
+ * The parsing loop of the server before the line reader, with each command
+ * counted instead of carried out.
+ */
+static long old_parse(char *buf) {
+    long sum = 0;
+    char *token;
+    char *rest = buf;
+    while ((token = strtok_r(rest, " ", &rest)))
+    {
+        if (strcmp(token, "pickup\r\n") == 0)
+            sum += 1;
+        else if ((strcmp(token, "hangup\r\n")) == 0)
+            sum += 2;
+        else if (strcmp(token, "dial") == 0)
+        {
+            token = strtok_r(rest, " ", &rest);
+            sum += atoi(token);
+        }
+        else if (strcmp(token, "chat") == 0)
+        {
+            char *buf_p = buf + 5;
+            sum += buf_p[0];
+        }
+    }
+    return sum;
+}
+
+static long old_pass(int fd) {
+    long sum = 0;
+    char buf[MAXLINE];
+    rio_t rio;
+    Rio_readinitb(&rio, fd);
+    while (Rio_readlineb(&rio, buf, MAXLINE) != 0)
+        sum += old_parse(buf);
+    return sum;
+}
+
+static long new_pass(int fd) {
+    long sum = 0;
+    LINE_READER lr;
+    char *line;
+    size_t len;
+    int arg;
+    line_reader_init(&lr, fd);
+    while (line_reader_next(&lr, &line, &len) > 0)
+    {
+        switch (client_parse(line, len, &arg))
+        {
+        case CLIENT_PICKUP: sum += 1; break;
+        case CLIENT_HANGUP: sum += 2; break;
+        case CLIENT_DIAL: sum += arg; break;
+        case CLIENT_CHAT: sum += line[5]; break;
+        default: break;
+        }
+    }
+    return sum;
+}
+
+/*
+ * Make the passes of one path.
+ *
+ * @return the time per line, in nanoseconds.
+ */
+static double run(int fd, long (*pass)(int), long *sum) {
+    long start = now_ns();
+    for (int p = 0; p < passes; p++)
+    {
+        if (lseek(fd, 0, SEEK_SET) < 0)
+            fail("lseek");
+        *sum = pass(fd);
+    }
+    return (double) (now_ns() - start) / ((double) passes * lines);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-l <lines>] [-s <chat bytes>] [-r <passes>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "l:s:r:")) != EOF)
+    {
+        switch (option)
+        {
+        case 'l':
+            lines = atoi(optarg);
+            break;
+        case 's':
+            chat_bytes = atoi(optarg);
+            break;
+        case 'r':
+            passes = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (lines < 1 || chat_bytes < 1 || chat_bytes > MAXLINE - 8 || passes < 1)
+        usage(argv[0]);
+
+    int fd = write_commands();
+    long old_sum, new_sum;
+    double old_ns = run(fd, old_pass, &old_sum);
+    double new_ns = run(fd, new_pass, &new_sum);
+    if (old_sum != new_sum)
+    {
+        fprintf(stderr, "parse_bench: the parsers disagree (%ld, %ld)\n", old_sum, new_sum);
+        exit(EXIT_FAILURE);
+    }
+    printf("%d lines, %d-byte chat messages, %d passes\n", lines, chat_bytes, passes);
+    printf("rio_readlineb + strtok:   %8.1f ns per line\n", old_ns);
+    printf("line_reader + memcmp:     %8.1f ns per line\n", new_ns);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,500 @@
+/*
+ * Load generator for the PBX server: measures how fast a running server
+ * accepts clients, carries calls through, or relays chat.
+ *
+ * Usage: pbx_bench -p <port> [-h <host>] [-m connect|call|chat|conf] [-c <clients>] [-d <seconds>] [-s <bytes>]
+ *                  [-i <idle>]
+ *
+ *   connect  Each client connects, waits for its "ON HOOK" greeting, and
+ *            disconnects, waiting for the server to close the connection in
+ *            turn, over and over.  Reports connections per second.
+ *   call     The clients are paired, and each pair places calls: pickup, dial,
+ *            answer, one chat message each way, and both hang up.  Reports
+ *            calls per second and the mean time a call takes.
+ *   chat     The clients are paired and connected, and one of each pair sends
+ *            chat lines of <bytes> bytes as fast as the other receives them.
+ *            Reports the messages and megabytes per second delivered.
+ *   conf     The clients all join one conference room, and one of them sends
+ *            chat lines of <bytes> bytes as fast as the slowest of the others
+ *            receives them.  Reports the messages sent per second, and the
+ *            deliveries and megabytes per second over all the members.
+ *
+ * Every client runs on a thread of its own, and the clients are set up before
+ * timing starts.  With -i, that many more clients connect first and stay idle,
+ * so that the registry holds that many more TUs.  The server must already be
+ * running.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BENCH_LINE_MAX 65536            // Longest line a client reads.
+#define BENCH_CHAT_WINDOW 65536         // Most bytes of chat a sender has in flight, which fit any output queue.
+#define BENCH_CHAT_CREDITS 2            // Parts of the window a sender writes at once, each when the last one is delivered.
+
+#define BENCH_CONF_ROOM 1               // The conference room joined.
+
+enum bench_mode { BENCH_CONNECT, BENCH_CALL, BENCH_CHAT, BENCH_CONF };
+
+static const char *mode_names[] = { "connect", "call", "chat", "conf" };
+
+static char *host = "localhost";
+static char *port;
+static enum bench_mode mode = BENCH_CALL;
+static int num_clients = 2;
+static int seconds = 5;
+static int chat_size = 64;
+static int num_idle = 0;
+
+static pthread_barrier_t ready;         // Passed by every client thread once set up, and by main.
+static atomic_long done;                // Connections, calls or chat messages completed, or conference messages delivered.
+static atomic_long busy_ns;             // Time spent in the calls completed.
+
+struct reader {                         // A reader structure contains:
+    int fd;                             // The connection read from,
+    size_t start;                       // The start of the unread bytes in 'buf',
+    size_t end;                         // The end of the unread bytes in 'buf',
+    char buf[BENCH_LINE_MAX];           // Bytes read.
+};
+
+struct chat_pair {                      // A chat_pair structure contains:
+    struct reader *receiver;            // The connection chat is delivered on,
+    int lines;                          // The number of lines the sender writes for each credit,
+    sem_t credits;                      // The parts of the window the sender may write.
+};
+
+struct conf_member {                    // A conf_member structure contains:
+    struct reader *receiver;            // A connection conference chat is delivered on,
+    int lines;                          // The number of lines in a part of the window,
+    atomic_long parts;                  // The number of parts delivered on it,
+    sem_t *progress;                    // Posted whenever a part is delivered to any member.
+};
+
+static void fail(const char *what) {
+    fprintf(stderr, "pbx_bench: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int bench_connect(void) {
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+    int err;
+    if ((err = getaddrinfo(host, port, &hints, &ai)) != 0)
+    {
+        fprintf(stderr, "pbx_bench: %s:%s: %s\n", host, port, gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+        fail("socket");
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+        fail("connect");
+    freeaddrinfo(ai);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void bench_send(int fd, const char *buf, size_t len) {
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fail("write");
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Read the next line from a connection, without its terminator.
+ *
+ * @return the line, which stays valid until the next call.
+ */
+static char *bench_line(struct reader *r) {
+    while (1)
+    {
+        char *nl = memchr(r->buf + r->start, '\n', r->end - r->start);
+        if (nl != NULL)
+        {
+            char *line = r->buf + r->start;
+            r->start = nl + 1 - r->buf;
+            if (nl > line && nl[-1] == '\r')
+                nl--;
+            *nl = '\0';
+            return line;
+        }
+        if (r->start > 0)               // Make room after the partial line.
+        {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        if (r->end == sizeof(r->buf))
+        {
+            fprintf(stderr, "pbx_bench: line too long\n");
+            exit(EXIT_FAILURE);
+        }
+        int one = 1;                    // Acknowledge at once, or a server that has Nagle's algorithm on
+        setsockopt(r->fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));    // waits for our delayed ACK.
+        ssize_t n = read(r->fd, r->buf + r->end, sizeof(r->buf) - r->end);
+        if (n == 0)
+        {
+            fprintf(stderr, "pbx_bench: the server closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fail("read");
+        }
+        r->end += n;
+    }
+}
+
+/*
+ * Read lines until one starts with 'expect'.  Other lines are notifications
+ * that crossed the awaited one, or chat.
+ */
+static char *bench_expect(struct reader *r, const char *expect) {
+    char *line;
+    while (strncmp((line = bench_line(r)), expect, strlen(expect)) != 0)
+        ;
+    return line;
+}
+
+static struct reader *bench_open(int *ext) {
+    struct reader *r = calloc(1, sizeof(struct reader));
+    if (r == NULL)
+        fail("calloc");
+    r->fd = bench_connect();
+    char *greeting = bench_expect(r, "ON HOOK");
+    if (ext != NULL)
+        *ext = atoi(greeting + strlen("ON HOOK"));
+    return r;
+}
+
+static void *connect_client(void *arg) {
+    struct reader *r = calloc(1, sizeof(struct reader));
+    if (r == NULL)
+        fail("calloc");
+    pthread_barrier_wait(&ready);
+    while (1)
+    {
+        r->fd = bench_connect();
+        r->start = r->end = 0;
+        bench_expect(r, "ON HOOK");
+        shutdown(r->fd, SHUT_WR);       // Wait for the server to close its end, once it has unregistered the TU.
+        while (read(r->fd, r->buf, sizeof(r->buf)) > 0)
+            ;
+        close(r->fd);
+        atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void *call_pair(void *arg) {
+    int ext_a, ext_b;
+    struct reader *a = bench_open(&ext_a);
+    struct reader *b = bench_open(&ext_b);
+    char dial[32];
+    int dial_len = snprintf(dial, sizeof(dial), "pickup\r\ndial %d\r\n", ext_b);
+    pthread_barrier_wait(&ready);
+    while (1)
+    {
+        long start = now_ns();
+        bench_send(a->fd, dial, dial_len);
+        bench_expect(a, "RING BACK");
+        bench_expect(b, "RINGING");
+        bench_send(b->fd, "pickup\r\nchat hello\r\n", 20);
+        bench_expect(a, "CHAT");
+        bench_send(a->fd, "chat goodbye\r\nhangup\r\n", 22);
+        bench_expect(a, "ON HOOK");
+        bench_expect(b, "DIAL TONE");
+        bench_send(b->fd, "hangup\r\n", 8);
+        bench_expect(b, "ON HOOK");
+        atomic_fetch_add_explicit(&busy_ns, now_ns() - start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static int chat_line_len(void) {
+    return strlen("chat ") + chat_size + 2;
+}
+
+/*
+ * @return the number of chat lines in a part of a sender's window.
+ */
+static int chat_lines(void) {
+    int lines = BENCH_CHAT_WINDOW / BENCH_CHAT_CREDITS / chat_line_len();
+    return (lines > 0) ? lines : 1;
+}
+
+/*
+ * @return a part of a sender's window: 'lines' chat lines of 'chat_size' bytes.
+ */
+static char *chat_part(int lines) {
+    int line_len = chat_line_len();
+    char *part = malloc((size_t) lines * line_len);
+    if (part == NULL)
+        fail("malloc");
+    for (int i = 0; i < lines; i++)
+    {
+        char *line = part + (size_t) i * line_len;
+        memcpy(line, "chat ", 5);
+        memset(line + 5, 'a' + i % 26, chat_size);
+        memcpy(line + 5 + chat_size, "\r\n", 2);
+    }
+    return part;
+}
+
+/*
+ * Discard the states the server reports to a chat sender, one per message, so
+ * that its output queue never overflows.
+ */
+static void *chat_echoes(void *arg) {
+    int fd = *(int *) arg;
+    char buf[BENCH_CHAT_WINDOW];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+/*
+ * Count the chat delivered to the receiver of a pair, and give the sender a
+ * credit for each part of the window delivered.
+ */
+static void *chat_receiver(void *arg) {
+    struct chat_pair *pair = arg;
+    for (long n = 1; ; n++)
+    {
+        bench_expect(pair->receiver, "CHAT");
+        atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+        if (n % pair->lines == 0)
+            sem_post(&(pair->credits));
+    }
+    return NULL;
+}
+
+static void *chat_sender(void *arg) {
+    int ext_b;
+    struct reader *a = bench_open(NULL);
+    struct reader *b = bench_open(&ext_b);
+    char cmd[64];
+    bench_send(a->fd, cmd, snprintf(cmd, sizeof(cmd), "pickup\r\ndial %d\r\n", ext_b));
+    bench_expect(b, "RINGING");
+    bench_send(b->fd, "pickup\r\n", 8);
+    bench_expect(a, "CONNECTED");
+    bench_expect(b, "CONNECTED");
+
+    struct chat_pair *pair = malloc(sizeof(struct chat_pair));
+    if (pair == NULL)
+        fail("malloc");
+    pair->receiver = b;
+    pair->lines = chat_lines();
+    sem_init(&(pair->credits), 0, BENCH_CHAT_CREDITS);
+    char *part = chat_part(pair->lines);
+    pthread_t tid;
+    pthread_create(&tid, NULL, chat_echoes, &(a->fd));
+    pthread_create(&tid, NULL, chat_receiver, pair);
+    pthread_barrier_wait(&ready);
+    while (1)
+    {
+        while (sem_wait(&(pair->credits)) < 0)
+            ;
+        bench_send(a->fd, part, (size_t) pair->lines * chat_line_len());
+    }
+    return NULL;
+}
+
+/*
+ * Count the conference chat delivered to a member, and tell the sender each
+ * time a part of the window has been delivered.
+ */
+static void *conf_receiver(void *arg) {
+    struct conf_member *member = arg;
+    for (long n = 1; ; n++)
+    {
+        bench_expect(member->receiver, "CHAT");
+        atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+        if (n % member->lines == 0)
+        {
+            atomic_fetch_add(&(member->parts), 1);
+            sem_post(member->progress);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Bring every client into the conference room, then send chat to the room
+ * from the first, a part of the window at a time, once the slowest member
+ * has received all but the last BENCH_CHAT_CREDITS - 1 parts sent.
+ */
+static void *conf_sender(void *arg) {
+    int num_members = num_clients - 1;
+    struct reader *a = bench_open(NULL);
+    struct conf_member *members = calloc(num_members, sizeof(struct conf_member));
+    sem_t *progress = malloc(sizeof(sem_t));
+    if (members == NULL || progress == NULL)
+        fail("malloc");
+    sem_init(progress, 0, 0);
+    char cmd[64];
+    int cmd_len = snprintf(cmd, sizeof(cmd), "pickup\r\nconf %d\r\n", BENCH_CONF_ROOM);
+    bench_send(a->fd, cmd, cmd_len);
+    bench_expect(a, "DIAL TONE");
+    bench_expect(a, "DIAL TONE");
+    for (int i = 0; i < num_members; i++)
+    {
+        members[i].receiver = bench_open(NULL);
+        members[i].lines = chat_lines();
+        members[i].progress = progress;
+        bench_send(members[i].receiver->fd, cmd, cmd_len);
+        bench_expect(members[i].receiver, "DIAL TONE");
+        bench_expect(members[i].receiver, "DIAL TONE");     // In the room.
+    }
+
+    char *part = chat_part(chat_lines());
+    pthread_t tid;
+    pthread_create(&tid, NULL, chat_echoes, &(a->fd));
+    for (int i = 0; i < num_members; i++)
+        pthread_create(&tid, NULL, conf_receiver, &members[i]);
+    pthread_barrier_wait(&ready);
+    for (long sent = 0; ; sent++)
+    {
+        while (1)
+        {
+            long slowest = sent;
+            for (int i = 0; i < num_members; i++)
+                if (atomic_load(&(members[i].parts)) < slowest)
+                    slowest = atomic_load(&(members[i].parts));
+            if (sent - slowest < BENCH_CHAT_CREDITS)
+                break;
+            while (sem_wait(progress) < 0)
+                ;
+        }
+        bench_send(a->fd, part, (size_t) chat_lines() * chat_line_len());
+    }
+    return NULL;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s -p <port> [-h <host>] [-m connect|call|chat|conf] [-c <clients>] [-d <seconds>] [-s <bytes>] [-i <idle>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "p:h:m:c:d:s:i:")) != EOF)
+    {
+        switch (option)
+        {
+        case 'p':
+            port = optarg;
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "connect") == 0)
+                mode = BENCH_CONNECT;
+            else if (strcmp(optarg, "call") == 0)
+                mode = BENCH_CALL;
+            else if (strcmp(optarg, "chat") == 0)
+                mode = BENCH_CHAT;
+            else if (strcmp(optarg, "conf") == 0)
+                mode = BENCH_CONF;
+            else
+                usage(argv[0]);
+            break;
+        case 'c':
+            num_clients = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            chat_size = atoi(optarg);
+            break;
+        case 'i':
+            num_idle = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (port == NULL || num_clients <= 0 || seconds <= 0 || chat_size <= 0 || chat_size > BENCH_LINE_MAX - 16 || num_idle < 0)
+        usage(argv[0]);
+    if (mode == BENCH_CONF && num_clients < 2)
+        usage(argv[0]);
+
+    for (int i = 0; i < num_idle; i++)  // Left open until the process exits.
+    {
+        struct reader *r = bench_open(NULL);
+        free(r);
+    }
+
+    int threads = (mode == BENCH_CONNECT) ? num_clients : (mode == BENCH_CONF) ? 1 : (num_clients + 1) / 2;
+    void *(*client)(void *) = (mode == BENCH_CONNECT) ? connect_client : (mode == BENCH_CALL) ? call_pair
+                              : (mode == BENCH_CHAT) ? chat_sender : conf_sender;
+    pthread_barrier_init(&ready, NULL, threads + 1);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_t tid;
+        if ((errno = pthread_create(&tid, NULL, client, NULL)) != 0)
+            fail("pthread_create");
+    }
+    pthread_barrier_wait(&ready);       // Every client is set up.
+
+    long start = now_ns();
+    long first = atomic_load(&done);
+    sleep(seconds);
+    long count = atomic_load(&done) - first;
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%s, %d clients", mode_names[mode], num_clients);
+    if (num_idle > 0)
+        printf(", %d idle", num_idle);
+    printf(", %.1f s: ", elapsed);
+    switch (mode)
+    {
+    case BENCH_CONNECT:
+        printf("%.0f connections/s\n", count / elapsed);
+        break;
+    case BENCH_CALL:
+        printf("%.0f calls/s, %.1f us per call\n", count / elapsed,
+               count > 0 ? atomic_load(&busy_ns) / 1e3 / atomic_load(&done) : 0.0);
+        break;
+    case BENCH_CHAT:
+        printf("%.0f messages/s, %.1f MB/s of %d-byte messages\n", count / elapsed,
+               count * (double) chat_size / elapsed / 1e6, chat_size);
+        break;
+    case BENCH_CONF:
+        printf("%.0f messages/s to %d members, %.0f deliveries/s, %.1f MB/s of %d-byte messages\n",
+               count / elapsed / (num_clients - 1), num_clients - 1, count / elapsed,
+               count * (double) chat_size / elapsed / 1e6, chat_size);
+        break;
+    }
+    exit(EXIT_SUCCESS);                 // The clients are left running; exiting closes their connections.
+}
@@ -0,0 +1,183 @@
+/*
+ * Benchmark of the pool allocator against malloc() under thread churn, as a
+ * server with a thread per connection sees it: threads come and go, and each
+ * allocates the objects of a connection, uses them a while and frees them.
+ *
+ * Usage: pool_bench [-t <threads>] [-c <connections>] [-r <rounds>]
+ *                   [-o <objects>] [-s <size>]
+ *
+ * Each round starts <threads> threads at once and waits for them to exit.
+ * Each thread serves <connections> connections in turn.  For each, it takes
+ * <objects> objects of <size> bytes, aligned on a cache line like a TU, then
+ * frees them.  Every other object is freed by the next thread of the round
+ * instead, as a TU is freed by whichever thread drops its last reference.  A
+ * fresh thread thus starts with empty caches, and frees land in the caches of
+ * other threads.
+ *
+ * Both allocators run the same rounds: pool_alloc() and pool_free() on one
+ * pool, then posix_memalign() and free().  The time reported is per object
+ * allocated and freed, including the starting and joining of the threads.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "pool.h"
+
+#define BENCH_MAX_THREADS 256
+#define BENCH_MAX_OBJECTS 64
+#define BENCH_ALIGN 64
+
+static int num_threads = 16;
+static int connections = 1000;
+static int rounds = 20;
+static int objects = 4;
+static int size = 256;
+
+static POOL *pool;
+static int use_pool;
+
+typedef struct worker {                         // A worker thread of a round has
+    _Atomic(void *) handoff[BENCH_MAX_OBJECTS];     // The objects left for it to free, by index.
+} WORKER;
+
+static WORKER workers[BENCH_MAX_THREADS];
+
+static void fail(const char *what) {
+    fprintf(stderr, "pool_bench: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void *bench_alloc(void) {
+    void *obj;
+    if (use_pool)
+        return pool_alloc(pool);
+    if ((errno = posix_memalign(&obj, BENCH_ALIGN, size)) != 0)
+        fail("posix_memalign");
+    return obj;
+}
+
+static void bench_free(void *obj) {
+    if (use_pool)
+        pool_free(pool, obj);
+    else
+        free(obj);
+}
+
+/*
+ * Serve the connections of a worker.  Of each connection's objects, the odd
+ * ones are left in the handoff slots of the next worker, which frees them.  A
+ * worker frees an object itself only if the next has not yet taken the one
+ * left before it.
+ */
+static void *serve(void *arg) {
+    int self = (int) (long) arg;
+    WORKER *mine = &workers[self];
+    WORKER *next = &workers[(self + 1) % num_threads];
+    void *objs[BENCH_MAX_OBJECTS];
+    for (int c = 0; c < connections; c++)
+    {
+        for (int i = 0; i < objects; i++)
+        {
+            objs[i] = bench_alloc();
+            memset(objs[i], 0, size);       // Use it, as tu_init() would.
+        }
+        for (int i = 0; i < objects; i++)
+        {
+            void *obj = objs[i];
+            if (i % 2 == 1)
+            {
+                if ((obj = atomic_exchange(&(next->handoff[i]), obj)) != NULL)
+                    bench_free(obj);                // Not taken yet.
+                obj = atomic_exchange(&(mine->handoff[i]), NULL);      // Left by the previous worker.
+            }
+            if (obj != NULL)
+                bench_free(obj);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run the rounds with one allocator.
+ *
+ * @return the time per object allocated and freed, in nanoseconds.
+ */
+static double run(int with_pool) {
+    use_pool = with_pool;
+    pthread_t tids[BENCH_MAX_THREADS];
+    long start = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (long i = 0; i < num_threads; i++)
+            if ((errno = pthread_create(&tids[i], NULL, serve, (void *) i)) != 0)
+                fail("pthread_create");
+        for (int i = 0; i < num_threads; i++)
+            pthread_join(tids[i], NULL);
+    }
+    for (int i = 0; i < num_threads; i++)           // Free what the last round left over.
+        for (int j = 0; j < objects; j++)
+        {
+            void *obj = atomic_exchange(&(workers[i].handoff[j]), NULL);
+            if (obj != NULL)
+                bench_free(obj);
+        }
+    return (double) (now_ns() - start) / ((double) rounds * num_threads * connections * objects);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-t <threads>] [-c <connections>] [-r <rounds>] [-o <objects>] [-s <size>]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "t:c:r:o:s:")) != EOF)
+    {
+        switch (option)
+        {
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'o':
+            objects = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (num_threads < 1 || num_threads > BENCH_MAX_THREADS || connections < 1 || rounds < 1
+        || objects < 1 || objects > BENCH_MAX_OBJECTS || size < (int) sizeof(void *))
+        usage(argv[0]);
+
+    POOL bench_pool = POOL_INITIALIZER(size, BENCH_ALIGN);
+    pool = &bench_pool;
+    printf("%d threads x %d connections x %d objects of %d bytes, %d rounds\n",
+           num_threads, connections, objects, size, rounds);
+    double pool_ns = run(1);
+    double malloc_ns = run(0);
+    printf("pool:   %8.1f ns per object\n", pool_ns);
+    printf("malloc: %8.1f ns per object\n", malloc_ns);
+    exit(EXIT_SUCCESS);
+}
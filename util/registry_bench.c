@@ -0,0 +1,245 @@
+/*
+ * Benchmark of the PBX registry: registers TUs with a PBX in this process, with
+ * no network in between, and times pbx_dial() to them.
+ *
+ * Usage: registry_bench [-n <count>[,<count>...]] [-t <threads>[,<threads>...]]
+ *                       [-d <seconds>] [-s]
+ *
+ * For each count, in increasing order, TUs are registered until that many are.
+ * Then, for each number of threads, that many of the first TUs place calls at
+ * once for <seconds>, each from a thread of its own: pickup, dial a randomly
+ * chosen extension among the TUs that do not place calls, hangup.  Only
+ * pbx_dial() is timed, so the time reported covers the lookup of the extension
+ * and the transition of both TUs, with their notifications.  Dials per second
+ * are summed over the threads.  All the TUs write their notifications to one
+ * socket, which a thread keeps draining; registering and calling wait for it
+ * to catch up whenever much is left unread, so that the socket never fills.
+ * A full socket would make the server's output queues take over, and drop the
+ * connection of any that overflowed.
+ *
+ * Each TU gets a descriptor of its own for that socket, and is registered at the
+ * extension of the same number, which works for registries that take an
+ * extension to be a descriptor.  The process may then run out of descriptors
+ * before it reaches a count.  With -s, the TUs share one descriptor and are
+ * registered at extensions 0, 1, 2, ... instead.
+ *
+ * A registry with no room for a count, or a process out of descriptors for it,
+ * is reported as such, and the sweep stops there.  The default counts are 10,
+ * 100, 1000, 10000 and 100000.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+
+#include "pbx.h"
+
+#define BENCH_MAX_COUNTS 16
+#define BENCH_MAX_THREADS 256
+#define BENCH_SNDBUF (1 << 20)              // Room asked for in the socket for what the TUs send,
+#define BENCH_MAX_UNREAD 65536              // Of which this much, overhead included, may be left unread.
+
+static int counts[BENCH_MAX_COUNTS] = { 10, 100, 1000, 10000, 100000 };
+static int num_counts = 5;
+static int threads[BENCH_MAX_COUNTS] = { 1 };
+static int num_threads = 1;
+static int seconds = 1;
+static int shared = 0;
+
+static int *exts;                       // The extension of each registered TU.
+static TU *callers[BENCH_MAX_THREADS];  // The first TUs registered, which place the calls.
+static int registered = 0;
+static int tus_fd;                      // The end of the socket that the TUs write to.
+
+typedef struct caller {                 // What a calling thread is given and measures:
+    TU *tu;                             // The TU placing the calls,
+    int first;                          // The index in 'exts' of the first extension to dial,
+    unsigned long seed;                 // The state of its random numbers,
+    long dials;                         // The number of calls placed,
+    long dial_ns;                       // And the time spent in pbx_dial().
+} CALLER;
+
+static void fail(const char *what) {
+    fprintf(stderr, "registry_bench: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Read and discard whatever the TUs send.
+ */
+static void *drain(void *arg) {
+    int fd = *(int *) arg;
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0 || errno == EINTR)
+        ;
+    return NULL;
+}
+
+/*
+ * Wait while the drain is behind, so that writes to the socket never block or
+ * queue up.  The socket counts what is left unread in its sender's buffer,
+ * with the overhead of each write.
+ */
+static void wait_drained(int fd) {
+    int unread;
+    while (ioctl(fd, TIOCOUTQ, &unread) == 0 && unread > BENCH_MAX_UNREAD)
+        sched_yield();
+}
+
+static unsigned long next_random(unsigned long *x) {
+    *x ^= *x << 13;                     // xorshift64.
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/*
+ * Place calls for 'seconds', timing pbx_dial().
+ */
+static void *place_calls(void *arg) {
+    CALLER *c = arg;
+    long end = now_ns() + seconds * 1000000000L;
+    do {
+        int ext = exts[c->first + next_random(&c->seed) % (registered - c->first)];
+        wait_drained(tus_fd);
+        tu_pickup(c->tu);
+        long start = now_ns();
+        pbx_dial(pbx, c->tu, ext);
+        c->dial_ns += now_ns() - start;
+        wait_drained(tus_fd);
+        tu_hangup(c->tu);
+        c->dials++;
+    } while (now_ns() < end);
+    return NULL;
+}
+
+/*
+ * Parse a comma-separated list of at most BENCH_MAX_COUNTS increasing numbers.
+ *
+ * @return the length of the list, or 0 if it is not valid.
+ */
+static int parse_list(char *arg, int *list, int min) {
+    int n = 0;
+    for (char *p = strtok(arg, ","); p != NULL; p = strtok(NULL, ","))
+    {
+        if (n == BENCH_MAX_COUNTS)
+            return 0;
+        list[n] = atoi(p);
+        if (list[n] < min || (n > 0 && list[n] <= list[n - 1]))
+            return 0;
+        n++;
+    }
+    return n;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-n <count>[,<count>...]] [-t <threads>[,<threads>...]] [-d <seconds>] [-s]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "n:t:d:s")) != EOF)
+    {
+        switch (option)
+        {
+        case 'n':
+            num_counts = parse_list(optarg, counts, 2);
+            break;
+        case 't':
+            num_threads = parse_list(optarg, threads, 1);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            shared = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (num_counts == 0 || num_threads == 0 || seconds <= 0)
+        usage(argv[0]);
+    int max_threads = threads[num_threads - 1];
+    if (max_threads > BENCH_MAX_THREADS || counts[0] <= max_threads)   // Each count leaves some TUs to dial.
+        usage(argv[0]);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        fail("socketpair");
+    int sndbuf = BENCH_SNDBUF;
+    if (setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+        fail("setsockopt");
+    tus_fd = sv[0];
+    pthread_t tid;
+    if ((errno = pthread_create(&tid, NULL, drain, &sv[1])) != 0)
+        fail("pthread_create");
+    if ((pbx = pbx_init()) == NULL)
+    {
+        fprintf(stderr, "registry_bench: pbx_init failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((exts = malloc(counts[num_counts - 1] * sizeof(int))) == NULL)
+        fail("malloc");
+    printf("%10s %8s %12s %12s\n", "registered", "threads", "dials/s", "ns per dial");
+    for (int i = 0; i < num_counts; i++)
+    {
+        for (; registered < counts[i]; registered++)
+        {
+            wait_drained(tus_fd);
+            int fd = shared ? sv[0] : dup(sv[0]);
+            if (fd < 0)
+            {
+                printf("%10d out of descriptors\n", registered);
+                exit(EXIT_SUCCESS);
+            }
+            exts[registered] = shared ? registered : fd;
+            TU *tu = tu_init(fd);
+            if (tu == NULL || pbx_register(pbx, tu, exts[registered]) < 0)
+            {
+                printf("%10d registry full\n", registered);
+                exit(EXIT_SUCCESS);
+            }
+            if (registered < max_threads)
+                callers[registered] = tu;
+        }
+
+        for (int j = 0; j < num_threads; j++)
+        {
+            CALLER c[BENCH_MAX_THREADS];
+            pthread_t tids[BENCH_MAX_THREADS];
+            for (int k = 0; k < threads[j]; k++)
+            {
+                c[k] = (CALLER) { callers[k], max_threads, 88172645463325252UL + k, 0, 0 };
+                if ((errno = pthread_create(&tids[k], NULL, place_calls, &c[k])) != 0)
+                    fail("pthread_create");
+            }
+            long dials = 0, dial_ns = 0;
+            for (int k = 0; k < threads[j]; k++)
+            {
+                pthread_join(tids[k], NULL);
+                dials += c[k].dials;
+                dial_ns += c[k].dial_ns;
+            }
+            printf("%10d %8d %12.0f %12.0f\n", registered, threads[j], (double) dials / seconds,
+                   (double) dial_ns / dials);
+            fflush(stdout);
+        }
+    }
+    exit(EXIT_SUCCESS);                 // The TUs are left registered; exiting closes their socket.
+}
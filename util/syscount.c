@@ -0,0 +1,65 @@
+/*
+ * Counter of the I/O system calls a program makes, to be preloaded into it:
+ *
+ *   LD_PRELOAD=util/syscount.so bin/pbx -p 9999
+ *
+ * read(), recv(), write(), writev(), send(), sendto() and sendmsg() are
+ * counted, then made with syscall(), and the counts are written to standard
+ * error when the program exits (for the server, on SIGHUP).  Calls that the C
+ * library makes internally, and I/O submitted through io_uring, are not seen.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+enum { SC_READ, SC_RECV, SC_WRITE, SC_WRITEV, SC_SEND, SC_SENDMSG, SC_NUM };
+
+static const char *syscount_names[SC_NUM] = { "read", "recv", "write", "writev", "send", "sendmsg" };
+static atomic_long syscount[SC_NUM];
+
+static void syscount_report(void) __attribute__((destructor));
+
+static void syscount_report(void) {
+    fprintf(stderr, "syscount:");
+    for (int i = 0; i < SC_NUM; i++)
+        fprintf(stderr, " %s %ld", syscount_names[i], atomic_load(&syscount[i]));
+    fprintf(stderr, "\n");
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    atomic_fetch_add_explicit(&syscount[SC_READ], 1, memory_order_relaxed);
+    return syscall(SYS_read, fd, buf, count);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    atomic_fetch_add_explicit(&syscount[SC_RECV], 1, memory_order_relaxed);
+    return syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    atomic_fetch_add_explicit(&syscount[SC_WRITE], 1, memory_order_relaxed);
+    return syscall(SYS_write, fd, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    atomic_fetch_add_explicit(&syscount[SC_WRITEV], 1, memory_order_relaxed);
+    return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    atomic_fetch_add_explicit(&syscount[SC_SEND], 1, memory_order_relaxed);
+    return syscall(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addrlen) {
+    atomic_fetch_add_explicit(&syscount[SC_SEND], 1, memory_order_relaxed);
+    return syscall(SYS_sendto, fd, buf, len, flags, addr, addrlen);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    atomic_fetch_add_explicit(&syscount[SC_SENDMSG], 1, memory_order_relaxed);
+    return syscall(SYS_sendmsg, fd, msg, flags);
+}
@@ -0,0 +1,229 @@
+/*
+ * Benchmark of the timer wheel: the cost of arming and cancelling timers with
+ * many of them armed, and how late timers fire.
+ *
+ * Usage: timer_bench [-n <timers>] [-t <threads>[,<threads>...]] [-d <seconds>]
+ *                    [-e <timers>] [-m <ms>]
+ *
+ * First, <timers> timers are armed, at random delays of a minute up to the
+ * reach of the wheel, so that they spread over its levels and none fires
+ * during the run; the time per arm is reported.  Then, for each number of
+ * threads, that many threads each move timers of their own to new random
+ * delays, and cancel and arm them again, for <seconds>, as the server does with
+ * its ring and idle timers.  Operations per second are summed over the threads.
+ *
+ * Last, <timers> of -e are armed at random delays of 1 to <ms> milliseconds
+ * (default 100000 and 2000), with the first timers still armed, and each
+ * records how long after its delay it fired.  The delays are measured on a
+ * clock of nanoseconds, so the lateness reported includes the rounding of the
+ * wheel's clock to milliseconds.  A timer that fired early would show a
+ * negative lateness.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+#define BENCH_MAX_THREADS 256
+#define BENCH_THREAD_TIMERS 1024            // Timers that each thread moves in turn.
+
+static int num_armed = 100000;
+static int threads[BENCH_MAX_THREADS] = { 1, 4 };
+static int num_threads = 2;
+static int seconds = 1;
+static int num_expiring = 100000;
+static int max_ms = 2000;
+
+typedef struct probe {                  // A timer whose lateness is measured:
+    TIMER timer;
+    long due_ns;                        // When it is due, on the clock of now_ns(),
+    long late_ns;                       // And how late it fired.
+} PROBE;
+
+static atomic_int fired;
+
+static void fail(const char *what) {
+    fprintf(stderr, "timer_bench: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned long next_random(unsigned long *x) {
+    *x ^= *x << 13;                     // xorshift64.
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static void never(TIMER *timer) {
+    fprintf(stderr, "timer_bench: a timer armed for the whole run fired\n");
+    exit(EXIT_FAILURE);
+}
+
+static void probe_fire(TIMER *timer) {
+    PROBE *probe = (PROBE *) timer;
+    probe->late_ns = now_ns() - probe->due_ns;
+    atomic_fetch_add(&fired, 1);
+}
+
+typedef struct churner {                // What a churning thread is given and counts:
+    unsigned long seed;                 // The state of its random numbers,
+    long ops;                           // And the number of operations made.
+} CHURNER;
+
+/*
+ * Move and cancel timers for 'seconds'.
+ */
+static void *churn(void *arg) {
+    CHURNER *c = arg;
+    unsigned long seed = c->seed;
+    TIMER *timers = malloc(BENCH_THREAD_TIMERS * sizeof(TIMER));
+    if (timers == NULL)
+        fail("malloc");
+    for (int i = 0; i < BENCH_THREAD_TIMERS; i++)
+    {
+        timer_init(&timers[i], never);
+        timer_arm(&timers[i], 60000 + next_random(&seed) % (TIMER_MAX_MS - 60000));
+    }
+    long n = 0;
+    long end = now_ns() + seconds * 1000000000L;
+    do {
+        for (int i = 0; i < BENCH_THREAD_TIMERS; i++)
+        {
+            TIMER *timer = &timers[i];
+            unsigned long ms = 60000 + next_random(&seed) % (TIMER_MAX_MS - 60000);
+            timer_arm(timer, ms);                   // Move it,
+            timer_cancel(timer);                    // Cancel it,
+            timer_arm(timer, ms);                   // And arm it again.
+        }
+        n += 3 * BENCH_THREAD_TIMERS;
+    } while (now_ns() < end);
+    for (int i = 0; i < BENCH_THREAD_TIMERS; i++)
+        timer_cancel(&timers[i]);
+    free(timers);
+    c->ops = n;
+    return NULL;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Parse a comma-separated list of at most BENCH_MAX_THREADS increasing numbers.
+ *
+ * @return the length of the list, or 0 if it is not valid.
+ */
+static int parse_list(char *arg, int *list, int min) {
+    int n = 0;
+    for (char *p = strtok(arg, ","); p != NULL; p = strtok(NULL, ","))
+    {
+        if (n == BENCH_MAX_THREADS)
+            return 0;
+        list[n] = atoi(p);
+        if (list[n] < min || (n > 0 && list[n] <= list[n - 1]))
+            return 0;
+        n++;
+    }
+    return n;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-n <timers>] [-t <threads>[,<threads>...]] [-d <seconds>] [-e <timers>] [-m <ms>]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "n:t:d:e:m:")) != EOF)
+    {
+        switch (option)
+        {
+        case 'n':
+            num_armed = atoi(optarg);
+            break;
+        case 't':
+            num_threads = parse_list(optarg, threads, 1);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'e':
+            num_expiring = atoi(optarg);
+            break;
+        case 'm':
+            max_ms = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (num_armed < 1 || num_threads == 0 || threads[num_threads - 1] > BENCH_MAX_THREADS || seconds <= 0
+        || num_expiring < 1 || max_ms < 1)
+        usage(argv[0]);
+
+    TIMER *armed = malloc(num_armed * sizeof(TIMER));
+    PROBE *probes = malloc(num_expiring * sizeof(PROBE));
+    long *late = malloc(num_expiring * sizeof(long));
+    if (armed == NULL || probes == NULL || late == NULL)
+        fail("malloc");
+    unsigned long seed = 88172645463325252UL;
+    for (int i = 0; i < num_armed; i++)
+        timer_init(&armed[i], never);
+    long start = now_ns();
+    for (int i = 0; i < num_armed; i++)
+        timer_arm(&armed[i], 60000 + next_random(&seed) % (TIMER_MAX_MS - 60000));
+    printf("%d timers armed: %.0f ns per arm\n", num_armed, (double) (now_ns() - start) / num_armed);
+
+    printf("%8s %14s %12s\n", "threads", "ops/s", "ns per op");
+    for (int j = 0; j < num_threads; j++)
+    {
+        pthread_t tids[BENCH_MAX_THREADS];
+        CHURNER c[BENCH_MAX_THREADS];
+        for (int k = 0; k < threads[j]; k++)
+        {
+            c[k] = (CHURNER) { 88172645463325252UL + k + 1, 0 };
+            if ((errno = pthread_create(&tids[k], NULL, churn, &c[k])) != 0)
+                fail("pthread_create");
+        }
+        long total = 0;
+        for (int k = 0; k < threads[j]; k++)
+        {
+            pthread_join(tids[k], NULL);
+            total += c[k].ops;
+        }
+        printf("%8d %14.0f %12.1f\n", threads[j], (double) total / seconds,
+               (double) seconds * threads[j] * 1e9 / total);
+        fflush(stdout);
+    }
+
+    for (int i = 0; i < num_expiring; i++)
+    {
+        unsigned long ms = 1 + next_random(&seed) % max_ms;
+        timer_init(&probes[i].timer, probe_fire);
+        probes[i].due_ns = now_ns() + ms * 1000000L;
+        timer_arm(&probes[i].timer, ms);
+    }
+    while (atomic_load(&fired) < num_expiring)
+        usleep(10000);
+    for (int i = 0; i < num_expiring; i++)
+        late[i] = probes[i].late_ns;
+    qsort(late, num_expiring, sizeof(long), compare_long);
+    printf("%d timers of 1-%d ms, fired late by: min %.2f ms, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           num_expiring, max_ms, late[0] / 1e6, late[num_expiring / 2] / 1e6,
+           late[(long) num_expiring * 99 / 100] / 1e6, late[num_expiring - 1] / 1e6);
+    exit(EXIT_SUCCESS);
+}